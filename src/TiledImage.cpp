@@ -1,89 +1,1604 @@
 #include <fstream>
+#include <cmath>
+#include <chrono>
 
 #include "TiledImage.h"
+#include "glupload.h"
 #include "imgjpg.h"
+#include "jpgsplit.h"
+#include "mipmap.h"
+#include "parallel.h"
+#include "pvtfile.h"
 
 
+// scale of the preview in progressive mode, one of 2, 4, 8
+static const int PREVIEW_SCALE = 8;
+
+// bytes per asynchronous upload step, tiles are uploaded in stripes of rows
+static const int UPLOAD_STRIPE = 1 << 20;
+// internal format of compressed tiles
+static const GLenum BC1_FORMAT = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+
+static const double PI = 3.141592653589793;
+
+// direction on the unit sphere for normalized image coordinates, this is
+// the inverse of the mapping in the fragment shader
+static Vec3d sphereDirection(const double u, const double v) {
+  const double theta = v * PI;
+  const double phi = u * 2.0 * PI - PI;
+  return Vec3d(-sin(theta) * cos(phi), sin(theta) * sin(phi), cos(theta));
+}
+
+static double angleBetween(const Vec3d &a, const Vec3d &b) {
+  return acos(std::max(-1.0, std::min(1.0, a * b)));
+}
+
 void TiledImage::cleanup() {
+  stopLoader();
+  m_preview.reset();
+  m_mapped = false;
   // reset to default values;
   m_azimuth = 360.0;
   m_elevation = 180.0;
   if (m_tiles.width() > 0) {
+    // unused names (0) are silently ignored
     glDeleteTextures((GLsizei)m_tiles.getData().size(), m_tiles.data());
-    m_tiles.clear();
+    m_tiles.resize(0, 0, 1);
+  }
+  glDeleteTextures(1, &m_array);
+  glDeleteTextures(1, &m_tileMask);
+  m_array = m_tileMask = 0;
+  m_edges.clear();
+  glDeleteTextures(1, &m_cube);
+  if (!m_faceTextures.empty()) {
+    glDeleteTextures((GLsizei)m_faceTextures.size(), &m_faceTextures[0]);
+    m_faceTextures.clear();
   }
+  m_cube = 0;
+  m_faceSize = m_faceTiles = 0;
 }
 
-TiledImage::~TiledImage() { cleanup(); }
+TiledImage::TiledImage(const int tSize)
+    : tileSize(tSize), m_width(0), m_height(0), m_useArray(false),
+      m_array(0), m_tileMask(0), m_useBC1(false), m_bc1(false),
+      m_useZeroCopy(false), m_mapped(false), m_gutter(0),
+      m_azimuth(360.0), m_elevation(180.0), m_streaming(false), m_mipmaps(true),
+      m_usePreview(false), m_cancel(false), m_loaderDone(false),
+      m_queueTiles(false), m_uploadBudget(0.0), m_useRing(true),
+      m_uploadTexture(0), m_uploadLevel(0), m_uploadRow(0), m_rowsTile(0),
+      m_onDemand(false),
+      m_viewDir(sphereDirection(0.5, 0.5)), m_useIndex(false),
+      m_useCache(false), m_useCube(false),
+      m_cubeFilter(IMG::CUBE::BILINEAR), m_cube(0), m_faceSize(0),
+      m_faceTiles(0) {}
+
+TiledImage::~TiledImage() {
+  cleanup();
+  if (m_ring) {
+    m_ring->release();
+  }
+}
 
 bool TiledImage::loadFromJPEG(std::string filename) {
+  cleanup();
 
-  // load image data
-  if (IMG::loadJPEG<Image>(filename.c_str(), base)) {
-    generateTiles();
-
-    IMG::EXIF::EXIFTAGS exiftags =
-        IMG::EXIF::parseExif<IMG::EXIF::EXIFTAGS>(filename);
-    if (exiftags.find(IMG::EXIF::UserComment) != exiftags.end()) {
-      const std::string &UC = exiftags[IMG::EXIF::UserComment];
-      // try to parse FOV from hugin-style comment
-      std::string token =
-          UC.substr(UC.find_first_of("FOV") + 4, UC.find_first_of("Ev") - 4);
-      std::sscanf(token.c_str(), "%lf x %lf", &m_azimuth, &m_elevation);
-      std::cout << "found field of view, azimuth:" << m_azimuth
-                << " elevation:" << m_elevation << std::endl;
+  // the file is opened once, decoding and EXIF parsing read the same mapping
+  std::unique_ptr<IMG::MappedFile> file(new IMG::MappedFile);
+  if (!file->open(filename.c_str())) {
+    return false;
+  }
+  // keep the defaults if there is no field of view in the file
+  readFieldOfView(file->data(), file->size(), m_azimuth, m_elevation);
+
+  // a horizontal cross of faces is only taken as one if a cube map was
+  // asked for, by cube mode or by the file name
+  IMG::STREAM::Layout layout;
+  const bool cross =
+      (m_useCube || IMG::CUBE::isCrossName(filename)) &&
+      IMG::STREAM::parseLayout(file->data(), file->size(), layout) &&
+      IMG::CUBE::isCross(layout.width, layout.height);
+  // the faces are resampled from a full sphere, a partial panorama is
+  // shown as tiles
+  bool cube = m_useCube || cross;
+  if (cube && !cross && (m_azimuth < 360.0 || m_elevation < 180.0)) {
+    std::cout << "cube maps need a full panorama, showing tiles" << std::endl;
+    cube = false;
+  }
+
+  // zero copy loading has no pixels on the CPU to write to the cache, the
+  // image is decoded every time
+  const bool zeroCopy = m_useZeroCopy && !cube && canMapUploads();
+
+  // the tile cache holds equirectangular tiles, cube maps are made from the
+  // full image each time
+  if (m_useCache && !cube && !zeroCopy) {
+    IMG::PVT::SourceKey key;
+    if (IMG::PVT::makeSourceKey(filename.c_str(), file->data(), file->size(),
+                                key)) {
+      const std::string cacheFile = IMG::PVT::cacheFileName(key, tileSize);
+      if (!cacheFile.empty() && loadFromPVT(cacheFile, key)) {
+        return true;
+      }
+      // the tiles are written to the cache while they are created,
+      // in any order
+      if (!cacheFile.empty()) {
+        m_cacheWriter.reset(new IMG::PVT::Writer(cacheFile, key));
+      }
     }
+  }
+  if (m_cacheWriter) {
+    m_cacheWriter->setFieldOfView(m_azimuth, m_elevation);
+  }
+
+  // files without restart markers are split at MCU rows with an index
+  IMG::JIDX::Index indexData;
+  const IMG::JIDX::Index *index = NULL;
+  if (m_useIndex && IMG::JIDX::openIndex(filename.c_str(), file->data(),
+                                         file->size(), indexData)) {
+    index = &indexData;
+  }
+
+  if (cube) {
+    return loadCube(*file, index, cross);
+  }
+
+  m_mapped = zeroCopy;
+
+  std::unique_ptr<IMG::JPEGRegionReader> region;
+  if (m_onDemand && !zeroCopy) {
+    region.reset(new IMG::JPEGRegionReader);
+    if (!region->open(file->data(), file->size(), index) ||
+        !region->hasRandomAccess()) {
+      region.reset();
+    }
+  }
+
+  bool ok;
+  if (region) {
+    ok = loadOnDemand(std::move(file), std::move(region), index);
+  } else if (m_usePreview || (m_streaming && m_uploadBudget > 0.0)) {
+    // decoded in the background
+    ok = loadProgressive(std::move(file), index);
+  } else if (m_streaming) {
+    ok = loadStreaming(*file);
+    finishCache();
+  } else if (m_uploadBudget > 0.0 && loadMapped(file, index)) {
+    // decoded in the background straight into mapped buffers
+    ok = true;
+  } else {
+    // load image data
+    ok = IMG::loadJPEG<Image>(file->data(), file->size(), base, 0, 1, index);
+    if (ok) {
+      generateTiles();
+    }
+  }
+  if (!ok) {
+    m_cacheWriter.reset();
+  }
+  return ok;
+}
+
+bool TiledImage::loadFromPVT(const std::string &filename,
+                             const IMG::PVT::SourceKey &key) {
+  std::unique_ptr<IMG::PVT::File> file(new IMG::PVT::File);
+  if (!file->open(filename)) {
+    return false;
+  }
+  const IMG::PVT::Header &header = file->header();
+  if (!(header.source == key) || (int)header.tileSize != tileSize ||
+      (int)header.levels != mipLevels()) {
+    return false;
+  }
+  base = Image();
+  m_width = header.width;
+  m_height = header.height;
+  allocateTiles();
+  m_azimuth = header.azimuth;
+  m_elevation = header.elevation;
+  std::cout << "loading tiles from cache " << filename << std::endl;
+  IMG::PVT::touch(filename);
+
+  if (m_uploadBudget > 0.0) {
+    // the pages of the mapping are read in by the loader thread
+    m_cacheFile = std::move(file);
+    startLoader([this]() { readCachedTiles(); });
     return true;
   }
-  return false;
+  // upload straight from the mapping, pages are read in on demand
+  const IMG::PVT::File &pvt = *file;
+  TileLevels levels;
+  for (int ty = 0, tym = numTilesY(); ty < tym; ++ty) {
+    for (int tx = 0, txm = numTilesX(); tx < txm; ++tx) {
+      if (getGutter() > 0) {
+        // the gutters need a copy
+        readCachedTile(pvt, tx, ty, levels);
+        addGutters(tx, ty, levels);
+        uploadTile(tx, ty, levels);
+        continue;
+      }
+      for (int l = 0; l < (int)header.levels; ++l) {
+        uploadTile(tx, ty, l, pvt.tileWidth(tx, l), pvt.tileHeight(ty, l),
+                   pvt.tile(tx, ty, l));
+      }
+    }
+    if (m_progress) {
+      m_progress(ty + 1, tym);
+    }
+  }
+  return true;
 }
 
-void TiledImage::generateTiles() {
+void TiledImage::readCachedTile(const IMG::PVT::File &pvt, const int tx,
+                                const int ty, TileLevels &levels) {
+  levels.resize(pvt.header().levels);
+  for (int l = 0; l < (int)levels.size(); ++l) {
+    const int w = pvt.tileWidth(tx, l);
+    const int h = pvt.tileHeight(ty, l);
+    levels[l].resize(w, h);
+    memcpy(&levels[l].unsafeData()[0], pvt.tile(tx, ty, l), (size_t)w * h * 3);
+  }
+}
+
+// loader thread: copy the tiles of the opened cache file for update()
+void TiledImage::readCachedTiles() {
+  const IMG::PVT::File &pvt = *m_cacheFile;
+  TileLevels levels;
+  for (int ty = 0, tym = numTilesY(); ty < tym; ++ty) {
+    for (int tx = 0, txm = numTilesX(); tx < txm; ++tx) {
+      readCachedTile(pvt, tx, ty, levels);
+      if (!deliverTile(tx, ty, levels)) {
+        return;
+      }
+    }
+  }
+}
+
+bool TiledImage::isTileSet(const std::string &path) {
+  IMG::TILESET::Manifest manifest;
+  return IMG::TILESET::readManifest(path, manifest);
+}
+
+bool TiledImage::loadFromTileSet(const std::string &path) {
+  cleanup();
+
+  IMG::TILESET::Manifest manifest;
+  if (!IMG::TILESET::readManifest(path, manifest)) {
+    return false;
+  }
+  const std::string dir =
+      IMG::TILESET::directoryOf(IMG::TILESET::manifestName(path));
+  base = Image();
+  tileSize = manifest.tileSize; // the tiles are fixed by the files
+  m_width = manifest.width;
+  m_height = manifest.height;
+  m_azimuth = manifest.azimuth;
+  m_elevation = manifest.elevation;
+  allocateTiles();
+
+  if (m_uploadBudget > 0.0) {
+    startLoader([this, dir]() { readTileSet(dir); });
+    return true;
+  }
+  if (!readTileSet(dir)) {
+    cleanup();
+    m_width = m_height = 0;
+    return false;
+  }
+  return true;
+}
+
+// each tile is a JPEG of its own, decode a row of them in parallel
+bool TiledImage::readTileSet(const std::string &dir) {
+  const int levels = mipLevels();
+  std::vector<TileLevels> row(numTilesX());
+  for (int ty = 0, tym = numTilesY(); ty < tym; ++ty) {
+    std::atomic<bool> ok(true);
+    PARALLEL::forEach(numTilesX(), [&](int tx) {
+      row[tx].resize(1);
+      Image &tile = row[tx][0];
+      if (!IMG::loadJPEG(IMG::TILESET::tileName(dir, tx, ty).c_str(), tile,
+                         1) ||
+          tile.width() != getTileWidth(tx) ||
+          tile.height() != getTileHeight(ty)) {
+        ok = false;
+        return;
+      }
+      IMG::buildMipChain(row[tx], levels);
+    });
+    if (!ok) {
+      std::cout << "incomplete tile set " << dir << std::endl;
+      return false;
+    }
+    for (int tx = 0, txm = numTilesX(); tx < txm; ++tx) {
+      if (!deliverTile(tx, ty, row[tx])) {
+        return false;
+      }
+    }
+    if (m_progress && !m_queueTiles) {
+      m_progress(ty + 1, tym);
+    }
+  }
+  return true;
+}
+
+bool TiledImage::isCubeFaceSet(const std::string &path) {
+  std::string files[6];
+  if (!IMG::CUBE::faceFiles(path, files)) {
+    return false;
+  }
+  for (int f = 0; f < 6; ++f) {
+    if (!std::ifstream(files[f].c_str()).good()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TiledImage::loadFromCubeFaces(const std::string &filename) {
+  cleanup();
+
+  std::string files[6];
+  if (!IMG::CUBE::faceFiles(filename, files)) {
+    return false;
+  }
+  // one face per thread
+  Image faces[6];
+  std::atomic<bool> ok(true);
+  PARALLEL::forEach(6, [&](int f) {
+    if (!IMG::loadJPEG(files[f].c_str(), faces[f], 1) ||
+        faces[f].width() != faces[f].height()) {
+      ok = false;
+    }
+  });
+  for (int f = 1; ok && f < 6; ++f) {
+    ok = faces[f].width() == faces[0].width();
+  }
+  if (!ok) {
+    std::cout << "incomplete cube face set " << filename << std::endl;
+    return false;
+  }
+  base = Image();
+  uploadCube(faces);
+  return true;
+}
+
+bool TiledImage::readFieldOfView(const unsigned char *data, const size_t size,
+                                 double &azimuth, double &elevation) {
+  if (!IMG::EXIF::readFieldOfView(data, size, azimuth, elevation)) {
+    return false;
+  }
+  std::cout << "found field of view, azimuth:" << azimuth
+            << " elevation:" << elevation << std::endl;
+  return true;
+}
+
+bool TiledImage::loadStreaming(const IMG::MappedFile &file) {
+  IMG::JPEGReader reader;
+  if (!reader.open(file.data(), file.size())) {
+    return false;
+  }
+  // the full image is not kept
+  base = Image();
+
+  m_width = reader.width();
+  m_height = reader.height();
+  allocateTiles();
+
+  // decode one band of tileSize scanlines, cut and upload its row of tiles
+  Image band;
+  std::vector<TileLevels> row;
+  for (int ty = 0, tym = numTilesY(); ty < tym; ++ty) {
+    const int tileHeight = getTileHeight(ty);
+    if (reader.readRows(band, tileHeight) != tileHeight) {
+      break;
+    }
+    cutTileRow(band, 0, ty, row);
+    for (int tx = 0, txm = numTilesX(); tx < txm; ++tx) {
+      storeTile(tx, ty, row[tx]);
+      addGutters(tx, ty, row[tx]);
+      uploadTile(tx, ty, row[tx]);
+    }
+    if (m_progress) {
+      m_progress(ty + 1, tym);
+    }
+  }
+  return true;
+}
+
+std::unique_ptr<TiledImage>
+TiledImage::createPreview(const IMG::MappedFile &file,
+                          const IMG::JIDX::Index *index) const {
+  // the preview is small, decode it on all cores if possible
+  std::unique_ptr<TiledImage> preview(new TiledImage(tileSize));
+  preview->setMipmaps(m_mipmaps);
+  preview->setGutter(m_gutter);
+  if (!IMG::loadJPEG(file.data(), file.size(), preview->base, 0,
+                     PREVIEW_SCALE, index)) {
+    return nullptr;
+  }
+  preview->generateTiles();
+  preview->base = Image();
+  return preview;
+}
+
+bool TiledImage::loadProgressive(std::unique_ptr<IMG::MappedFile> file,
+                                 const IMG::JIDX::Index *index) {
+  std::unique_ptr<TiledImage> preview;
+  if (m_usePreview) {
+    preview = createPreview(*file, index);
+    if (!preview) {
+      return false;
+    }
+  }
+
+  std::unique_ptr<IMG::JPEGReader> reader(new IMG::JPEGReader);
+  if (!reader->open(file->data(), file->size())) {
+    return false;
+  }
+  base = Image();
+  m_width = reader->width();
+  m_height = reader->height();
+  // two bands, one is decoded while the tiles of the other are specified
+  createRowBuffers(2, 1);
+  allocateTiles();
+
+  m_preview = std::move(preview);
+  m_file = std::move(file); // the reader points into this mapping
+  m_reader = std::move(reader);
+  startLoader([this]() { refine(); });
+  return true;
+}
+
+// background thread: decode bands of tileSize scanlines and cut them into
+// tiles, or decode them into mapped buffers, the upload is done by update()
+// on the OpenGL thread
+void TiledImage::refine() {
+  Image band;
+  std::vector<TileLevels> row;
+  for (int ty = 0, tym = numTilesY(); ty < tym; ++ty) {
+    const int tileHeight = getTileHeight(ty);
+    if (!m_rowBuffers.empty()) {
+      const int buffer = acquireRows();
+      if (buffer < 0) {
+        return;
+      }
+      ImageView rows(m_rowBuffers[buffer].pixels,
+                          (size_t)m_rowBuffers[buffer].size);
+      if (m_reader->readRows(rows, tileHeight) != tileHeight) {
+        break;
+      }
+      queueRows(buffer, ty, ty + 1);
+      continue;
+    }
+    if (m_reader->readRows(band, tileHeight) != tileHeight) {
+      break;
+    }
+    cutTileRow(band, 0, ty, row);
+    for (int tx = 0, txm = numTilesX(); tx < txm; ++tx) {
+      if (!deliverTile(tx, ty, row[tx])) {
+        return;
+      }
+    }
+  }
+}
+
+// zero copy: decode the rows of tiles on the loader thread straight into a
+// ring of mapped pixel buffers one row of tiles high, update() specifies
+// the tiles from there. Files that can be split (restart markers or an
+// index) are decoded a row of tiles per core, others in order like
+// refine(). False if that is not possible, file is kept then.
+bool TiledImage::loadMapped(std::unique_ptr<IMG::MappedFile> &file,
+                            const IMG::JIDX::Index *index) {
+  std::unique_ptr<IMG::JPEGRegionReader> region(new IMG::JPEGRegionReader);
+  std::unique_ptr<IMG::JPEGReader> reader;
+  if (!canLoadMapped() || !region->open(file->data(), file->size(), index)) {
+    return false;
+  }
+  if (!region->hasRandomAccess()) {
+    region.reset();
+    reader.reset(new IMG::JPEGReader);
+    if (!reader->open(file->data(), file->size())) {
+      return false;
+    }
+  }
+  const int threads = region ? (int)PARALLEL::numThreads() : 1;
+  base = Image();
+  m_width = region ? region->width() : reader->width();
+  m_height = region ? region->height() : reader->height();
+  // one buffer per decoding thread and one for the GPU, made before the
+  // tiles so that a failure leaves the image to the other loaders
+  if (!createRowBuffers(threads + 1, 1)) {
+    return false;
+  }
+  allocateTiles();
+
+  m_file = std::move(file);
+  if (reader) {
+    m_reader = std::move(reader);
+    startLoader([this]() { refine(); });
+    return true;
+  }
+  m_region = std::move(region);
+  startLoader([this, threads]() {
+    PARALLEL::forEach(numTilesY(), [this](int ty) {
+      const int buffer = acquireRows();
+      if (buffer < 0) {
+        return;
+      }
+      ImageView rows(m_rowBuffers[buffer].pixels,
+                     (size_t)m_rowBuffers[buffer].size);
+      if (m_region->read(0, ty * tileSize, m_width, getTileHeight(ty),
+                         rows)) {
+        queueRows(buffer, ty, ty + 1);
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_freeRows.push_back(buffer);
+      }
+      m_cond.notify_all();
+    }, threads);
+  });
+  return true;
+}
+
+// the pixels never pass the CPU, so the GPU has to build the mipmaps and
+// there is no tile cache to write, compression or gutters. The tiles are
+// specified as textures of their own, the mipmaps of one layer of an array
+// can not be generated.
+bool TiledImage::canMapUploads() const {
+  return GLUTIL::MappedBuffer::isSupported() && !m_useBC1 &&
+         (!m_mipmaps || GLUTIL::canGenerateMipmaps());
+}
+
+// the loaded image is decoded into mapped buffers, see loadFromJPEG
+bool TiledImage::canLoadMapped() const { return m_mapped; }
+
+// count mapped buffers for bands of tileRows rows of tiles, false if zero
+// copy loading is not possible. The image is then loaded through the CPU,
+// with gutters and the array texture if they are enabled, so call it
+// before allocateTiles().
+bool TiledImage::createRowBuffers(const int count, const int tileRows) {
+  if (!canLoadMapped()) {
+    return false;
+  }
+  const GLsizeiptr bytes =
+      (GLsizeiptr)m_width * 3 * std::min(m_height, tileRows * tileSize);
+  m_rowBuffers.resize(count);
+  for (int i = 0; i < count; ++i) {
+    if (!m_rowBuffers[i].create(bytes)) {
+      releaseRowBuffers();
+      m_mapped = false;
+      return false;
+    }
+    m_freeRows.push_back(i);
+  }
+  return true;
+}
+
+void TiledImage::releaseRowBuffers() {
+  for (size_t i = 0; i < m_rowBuffers.size(); ++i) {
+    m_rowBuffers[i].release();
+  }
+  m_rowBuffers.clear();
+  m_freeRows.clear();
+  m_filledRows.clear();
+  m_fencedRows.clear();
+  m_rowsTile = 0;
+}
+
+// loader thread: wait for a mapped buffer that may be filled, -1 if
+// loading was cancelled
+int TiledImage::acquireRows() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_cond.wait(lock, [this]() { return m_cancel || !m_freeRows.empty(); });
+  if (m_cancel) {
+    return -1;
+  }
+  const int buffer = m_freeRows.back();
+  m_freeRows.pop_back();
+  return buffer;
+}
+
+// loader thread: the buffer holds the rows of tiles [ty0,ty1)
+void TiledImage::queueRows(const int buffer, const int ty0, const int ty1) {
+  FilledRows rows;
+  rows.buffer = buffer;
+  rows.ty0 = ty0;
+  rows.ty1 = ty1;
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_filledRows.push_back(rows);
+  wake();
+}
+
+bool TiledImage::loadOnDemand(std::unique_ptr<IMG::MappedFile> file,
+                              std::unique_ptr<IMG::JPEGRegionReader> region,
+                              const IMG::JIDX::Index *index) {
+  std::unique_ptr<TiledImage> preview;
+  if (m_usePreview) {
+    preview = createPreview(*file, index);
+    if (!preview) {
+      return false;
+    }
+  }
+  base = Image();
+  m_width = region->width();
+  m_height = region->height();
+  allocateTiles();
+
+  m_preview = std::move(preview);
+  m_file = std::move(file); // the region reader points into this mapping
+  m_region = std::move(region);
+  startOnDemand();
+  return true;
+}
+
+// start the on demand loader threads for the allocated tiles
+void TiledImage::startOnDemand() {
+  m_scheduled.assign(numTilesX() * numTilesY(), false);
+  startLoader([this]() {
+    PARALLEL::forEach(PARALLEL::numThreads(),
+                      [this](int) { loadVisible(); });
+  });
+}
+
+// run produce on the loader thread, the tiles it delivers are uploaded by
+// update() on the OpenGL thread
+void TiledImage::startLoader(const std::function<void()> &produce) {
+  m_cancel = false;
+  m_loaderDone = false;
+  m_queueTiles = true;
+  m_loader = std::thread([this, produce]() {
+    produce();
+    finishCache();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_loaderDone = true;
+    }
+    wake();
+  });
+}
+
+// loader threads: tell the OpenGL thread there is something for update()
+void TiledImage::wake() {
+  if (m_wake) {
+    m_wake();
+  }
+}
+
+// hand a finished tile over for upload: right away when loading on the
+// OpenGL thread, else queued for update() with at most two rows of tiles
+// waiting, so memory stays bounded. False if loading was cancelled.
+bool TiledImage::deliverTile(const int tx, const int ty, TileLevels &levels) {
+  storeTile(tx, ty, levels);
+  addGutters(tx, ty, levels);
+  if (!m_queueTiles) {
+    uploadTile(tx, ty, levels);
+    return true;
+  }
+  PendingTile tile;
+  tile.tx = tx;
+  tile.ty = ty;
+  tile.levels.swap(levels);
+  compressTile(tile, 0);
+
+  const int txm = numTilesX();
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_cond.wait(lock, [this, txm]() {
+    return m_cancel || (int)m_pending.size() < 2 * txm;
+  });
+  if (m_cancel) {
+    return false;
+  }
+  m_pending.push_back(std::move(tile));
+  lock.unlock();
+  wake();
+  return true;
+}
+
+// worker of the on demand loader, runs on several threads: decode the
+// unscheduled tile closest to the view until all tiles are done. Without
+// column cropping in libjpeg a whole row of tiles is decoded at once.
+void TiledImage::loadVisible() {
+  const int txm = numTilesX();
+  const bool singleTiles = IMG::JPEGRegionReader::cropsColumns();
+  Image region;
+  for (;;) {
+    int tx0, tx1, ty;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cond.wait(lock, [this, txm]() {
+        return m_cancel || (int)m_pending.size() < 2 * txm;
+      });
+      const int next = m_cancel ? -1 : nextVisibleTile();
+      if (next < 0) {
+        return;
+      }
+      ty = next / txm;
+      tx0 = singleTiles ? next % txm : 0;
+      tx1 = singleTiles ? tx0 + 1 : txm;
+      for (int tx = tx0; tx < tx1; ++tx) {
+        m_scheduled[ty * txm + tx] = true;
+      }
+    }
+    const int x0 = tx0 * tileSize;
+    const int x1 = (tx1 - 1) * tileSize + getTileWidth(tx1 - 1);
+    if (!m_region->read(x0, ty * tileSize, x1 - x0, getTileHeight(ty),
+                        region)) {
+      return;
+    }
+    for (int tx = tx0; tx < tx1; ++tx) {
+      PendingTile tile;
+      tile.tx = tx;
+      tile.ty = ty;
+      tile.levels.resize(1);
+      cutTile(region, tx * tileSize - x0, 0, getTileWidth(tx),
+              getTileHeight(ty), tile.levels[0]);
+      IMG::buildMipChain(tile.levels, mipLevels());
+      storeTile(tx, ty, tile.levels);
+      addGutters(tx, ty, tile.levels);
+      compressTile(tile, 1);
+
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push_back(std::move(tile));
+      }
+      wake();
+    }
+  }
+}
+
+// the unscheduled tile closest to the view direction, -1 if there is none.
+// m_mutex has to be locked.
+int TiledImage::nextVisibleTile() const {
+  int best = -1;
+  double bestDistance = 0.0;
+  for (int ty = 0, tym = numTilesY(); ty < tym; ++ty) {
+    for (int tx = 0, txm = numTilesX(); tx < txm; ++tx) {
+      if (m_scheduled[ty * txm + tx]) {
+        continue;
+      }
+      Vec3d center;
+      double radius;
+      getTileBounds(tx, ty, center, radius);
+      const double distance = angleBetween(m_viewDir, center) - radius;
+      if (best < 0 || distance < bestDistance) {
+        best = ty * txm + tx;
+        bestDistance = distance;
+      }
+    }
+  }
+  return best;
+}
+
+void TiledImage::setViewDirection(const Vec3d &direction) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_viewDir = direction;
+}
+
+void TiledImage::getTileBounds(const int tx, const int ty, Vec3d &center,
+                               double &radius) const {
+  float xmin, xmax, ymin, ymax;
+  getNormalizedTileCoordinates(tx, ty, xmin, xmax, ymin, ymax);
+  center = sphereDirection(0.5 * (xmin + xmax), 0.5 * (ymin + ymax));
+  // sample the border, tiles near the poles are far from rectangular
+  std::vector<Vec3d> border;
+  getTileBorder(tx, ty, 4, border);
+  radius = 0.0;
+  for (size_t i = 0; i < border.size(); ++i) {
+    radius = std::max(radius, angleBetween(center, border[i]));
+  }
+}
+
+void TiledImage::getTileBorder(const int tx, const int ty, const int steps,
+                               std::vector<Vec3d> &border) const {
+  float xmin, xmax, ymin, ymax;
+  getNormalizedTileCoordinates(tx, ty, xmin, xmax, ymin, ymax);
+  border.resize(4 * steps);
+  for (int i = 0; i < steps; ++i) {
+    const double s = (double)i / steps;
+    border[i] = sphereDirection(xmin + (xmax - xmin) * s, ymin);
+    border[steps + i] = sphereDirection(xmax, ymin + (ymax - ymin) * s);
+    border[2 * steps + i] = sphereDirection(xmax - (xmax - xmin) * s, ymax);
+    border[3 * steps + i] = sphereDirection(xmin, ymax - (ymax - ymin) * s);
+  }
+}
+
+void TiledImage::stopLoader() {
+  if (m_loader.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_cancel = true;
+    }
+    m_cond.notify_all();
+    m_loader.join();
+  }
+  m_pending.clear();
+  m_queueTiles = false;
+  if (m_uploadTexture != 0) {
+    glDeleteTextures(1, &m_uploadTexture);
+    m_uploadTexture = 0;
+  }
+  m_upload.levels.clear();
+  m_upload.blocks.clear();
+  releaseRowBuffers();
+  m_reader.reset();
+  m_region.reset();
+  m_file.reset();
+  m_cacheFile.reset();
+  // an unfinished cache file is discarded
+  m_cacheWriter.reset();
+}
+
+// texture parameters of a tile (or the array of all tiles) with the given
+// number of mipmap levels
+static void setTileParameters(const int levels,
+                              const GLenum target = GL_TEXTURE_2D) {
+  glTexParameterf(target, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
+  glTexParameterf(target, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
+  glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  // checkGLError();
+  glTexParameteri(target, GL_TEXTURE_MIN_FILTER,
+                  levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+  // the chain may end above 1x1 if tileSize is not a power of two
+  glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, levels - 1);
+  // checkGLError();
+}
+
+bool TiledImage::update() {
+  if (!m_loader.joinable()) {
+    return false;
+  }
+  typedef std::chrono::duration<double, std::milli> dms;
+  const auto T0 = std::chrono::high_resolution_clock::now();
+  const bool budget = m_uploadBudget > 0.0;
+  if (!m_ring) {
+    m_ring.reset(new GLUTIL::UploadRing);
+    // a ring without buffers hands the pixels to the driver directly
+    if (m_useRing) {
+      m_ring->initialize();
+    }
+  }
+
+  // mapped buffers the GPU is done with can be filled again
+  bool recycled = false;
+  for (size_t i = 0; i < m_fencedRows.size();) {
+    if (m_rowBuffers[m_fencedRows[i]].isIdle()) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_freeRows.push_back(m_fencedRows[i]);
+      m_fencedRows.erase(m_fencedRows.begin() + i);
+      recycled = true;
+    } else {
+      ++i;
+    }
+  }
+  if (recycled) {
+    m_cond.notify_all();
+  }
+
+  bool changed = false;
+  for (;;) {
+    // rather wait for the next frame than for the GPU
+    const UploadResult result =
+        m_rowBuffers.empty() ? uploadStep(!budget) : uploadFromRows();
+    if (result == UPLOAD_NONE) {
+      break;
+    }
+    changed |= result == UPLOAD_TILE;
+    if (budget && dms(std::chrono::high_resolution_clock::now() - T0).count() >=
+                      m_uploadBudget) {
+      break;
+    }
+  }
+
+  bool done;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    done = m_loaderDone && m_pending.empty() && m_filledRows.empty() &&
+           m_upload.levels.empty();
+  }
+  if (done) {
+    // all refined tiles are in, the preview is not needed anymore
+    stopLoader();
+    m_preview.reset();
+  }
+  return changed || done;
+}
+
+bool TiledImage::isUploading() {
+  if (!m_loader.joinable()) {
+    return false;
+  }
+  if (!m_upload.levels.empty() || !m_fencedRows.empty()) {
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_loaderDone || !m_pending.empty() || !m_filledRows.empty();
+}
+
+// upload the next stripe of rows of the pending tiles through the ring,
+// without wait nothing is done while the next buffer of the ring is in use
+TiledImage::UploadResult TiledImage::uploadStep(const bool wait) {
+  if (m_upload.levels.empty()) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_pending.empty()) {
+        return UPLOAD_NONE;
+      }
+      m_upload = std::move(m_pending.front());
+      m_pending.pop_front();
+    }
+    m_cond.notify_all();
+
+    // storage for all levels, the pixels follow in stripes. The layer of
+    // the array is not shown before the tile is complete.
+    const int levels = (int)m_upload.levels.size();
+    if (m_array == 0) {
+      glGenTextures(1, &m_uploadTexture);
+      glBindTexture(GL_TEXTURE_2D, m_uploadTexture);
+      setTileParameters(levels);
+      for (int l = 0; l < levels; ++l) {
+        glTexImage2D(GL_TEXTURE_2D, l, m_bc1 ? BC1_FORMAT : GL_RGB,
+                     m_upload.levels[l].width(), m_upload.levels[l].height(),
+                     0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+      }
+    }
+    m_uploadLevel = 0;
+    m_uploadRow = 0;
+  }
+  if (!wait && !m_ring->isReady()) {
+    return UPLOAD_NONE;
+  }
+
+  if (!m_upload.blocks.empty()) {
+    // compressed stripes are whole rows of blocks
+    const IMG::BC1::Blocks &blocks = m_upload.blocks[m_uploadLevel];
+    const int blockRows =
+        std::min(blocks.blocksY() - m_uploadRow / 4,
+                 std::max(1, UPLOAD_STRIPE / (int)blocks.rowBytes()));
+    const int rows = std::min(4 * blockRows, blocks.height - m_uploadRow);
+    const GLsizei bytes = (GLsizei)(blockRows * blocks.rowBytes());
+    const unsigned char *stripe =
+        &blocks.data[(size_t)(m_uploadRow / 4) * blocks.rowBytes()];
+    if (m_array != 0) {
+      glBindTexture(GL_TEXTURE_2D_ARRAY, m_array);
+      m_ring->compressedTexSubImage3D(
+          GL_TEXTURE_2D_ARRAY, m_uploadLevel, 0, m_uploadRow,
+          tileLayer(m_upload.tx, m_upload.ty), blocks.width, rows, BC1_FORMAT,
+          bytes, stripe);
+    } else {
+      glBindTexture(GL_TEXTURE_2D, m_uploadTexture);
+      m_ring->compressedTexSubImage2D(GL_TEXTURE_2D, m_uploadLevel, 0,
+                                      m_uploadRow, blocks.width, rows,
+                                      BC1_FORMAT, bytes, stripe);
+    }
+    m_uploadRow += rows;
+    if (m_uploadRow < blocks.height) {
+      return UPLOAD_PART;
+    }
+  } else {
+    const Image &level = m_upload.levels[m_uploadLevel];
+    const int rowBytes = level.width() * 3;
+    const int rows = std::min(level.height() - m_uploadRow,
+                              std::max(1, UPLOAD_STRIPE / rowBytes));
+    const unsigned char *stripe =
+        level.data() + (size_t)m_uploadRow * rowBytes;
+    if (m_array != 0) {
+      glBindTexture(GL_TEXTURE_2D_ARRAY, m_array);
+      m_ring->texSubImage3D(GL_TEXTURE_2D_ARRAY, m_uploadLevel, 0,
+                            m_uploadRow, tileLayer(m_upload.tx, m_upload.ty),
+                            level.width(), rows, stripe);
+    } else {
+      glBindTexture(GL_TEXTURE_2D, m_uploadTexture);
+      m_ring->texSubImage2D(GL_TEXTURE_2D, m_uploadLevel, 0, m_uploadRow,
+                            level.width(), rows, stripe);
+    }
+    m_uploadRow += rows;
+    if (m_uploadRow < level.height()) {
+      return UPLOAD_PART;
+    }
+    if (m_array != 0 && getGutter() == 0) {
+      padArrayLevel(m_upload.tx, m_upload.ty, m_uploadLevel, level.width(),
+                    level.height(), level.data());
+    }
+  }
+  m_uploadRow = 0;
+  if (++m_uploadLevel < (int)m_upload.levels.size()) {
+    return UPLOAD_PART;
+  }
+  // complete, show it
+  if (m_array != 0) {
+    showArrayTile(m_upload.tx, m_upload.ty);
+    exchangeGutters(m_upload.tx, m_upload.ty, m_upload.levels);
+    m_upload.levels.clear();
+    m_upload.blocks.clear();
+    return UPLOAD_TILE;
+  }
+  GLuint &texname = m_tiles(m_upload.tx, m_upload.ty);
+  if (texname != 0) {
+    glDeleteTextures(1, &texname);
+  }
+  texname = m_uploadTexture;
+  m_uploadTexture = 0;
+  exchangeGutters(m_upload.tx, m_upload.ty, m_upload.levels);
+  m_upload.levels.clear();
+  m_upload.blocks.clear();
+  return UPLOAD_TILE;
+}
+
+// specify the next tile from the oldest filled mapped buffer
+TiledImage::UploadResult TiledImage::uploadFromRows() {
+  FilledRows rows;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_filledRows.empty()) {
+      return UPLOAD_NONE;
+    }
+    rows = m_filledRows.front();
+  }
+  const int txm = numTilesX();
+  const int tx = m_rowsTile % txm;
+  const int ty = rows.ty0 + m_rowsTile / txm;
+  const int levels = mipLevels();
+  GLUTIL::MappedBuffer &buffer = m_rowBuffers[rows.buffer];
+
+  GLuint texname;
+  glGenTextures(1, &texname);
+  glBindTexture(GL_TEXTURE_2D, texname);
+  setTileParameters(levels);
+  buffer.texImage2D(GL_TEXTURE_2D, 0, m_width, tx * tileSize,
+                    (ty - rows.ty0) * tileSize, getTileWidth(tx),
+                    getTileHeight(ty));
+  if (levels > 1) {
+    glGenerateMipmap(GL_TEXTURE_2D);
+  }
+  GLuint &tile = m_tiles(tx, ty);
+  if (tile != 0) {
+    glDeleteTextures(1, &tile);
+  }
+  tile = texname;
+
+  if (++m_rowsTile == (rows.ty1 - rows.ty0) * txm) {
+    // all tiles of the buffer are specified
+    buffer.fenceReads();
+    m_fencedRows.push_back(rows.buffer);
+    m_rowsTile = 0;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_filledRows.pop_front();
+  }
+  return UPLOAD_TILE;
+}
+
+void TiledImage::allocateTiles() {
   // calculate number of tiles
-  int horizontalTiles = (int)ceil((double)base.width() / (double)tileSize);
-  int verticalTiles = (int)ceil((double)base.height() / (double)tileSize);
+  int horizontalTiles = (int)ceil((double)m_width / (double)tileSize);
+  int verticalTiles = (int)ceil((double)m_height / (double)tileSize);
 
   // clear opengl data
   if (!m_tiles.getData().empty()) {
     cleanup();
   }
 
+  // texture names are created on upload
   m_tiles.resize(horizontalTiles, verticalTiles, 1);
+  std::fill(m_tiles.unsafeData().begin(), m_tiles.unsafeData().end(), 0u);
+  m_edges.assign(getGutter() > 0 ? horizontalTiles * verticalTiles : 0,
+                 TileEdges());
+  m_bc1 = m_useBC1 && GLEW_EXT_texture_compression_s3tc;
+  if (m_useArray && !m_mapped) {
+    allocateArray();
+  }
+
+  if (m_cacheWriter &&
+      !m_cacheWriter->create(m_width, m_height, tileSize, mipLevels())) {
+    m_cacheWriter.reset();
+  }
+}
+
+// storage for all tiles as layers of an array texture, false if they
+// exceed its limits
+bool TiledImage::allocateArray() {
+  if (!GLEW_VERSION_3_0) {
+    return false;
+  }
+  GLint maxLayers = 0, maxSize = 0;
+  glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+  const int layers = numTilesX() * numTilesY();
+  const int size = tileSize + 2 * getGutter();
+  if (layers > maxLayers || size > maxSize) {
+    return false;
+  }
+  // clear earlier errors, so that running out of memory can be told
+  while (glGetError() != GL_NO_ERROR) {
+  }
+  const int levels = mipLevels();
+  glGenTextures(1, &m_array);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, m_array);
+  setTileParameters(levels, GL_TEXTURE_2D_ARRAY);
+  for (int l = 0; l < levels; ++l) {
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, l, m_bc1 ? BC1_FORMAT : GL_RGB,
+                 size >> l, size >> l, layers, 0, GL_RGB, GL_UNSIGNED_BYTE,
+                 NULL);
+  }
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+  if (glGetError() != GL_NO_ERROR) {
+    glDeleteTextures(1, &m_array);
+    m_array = 0;
+    return false;
+  }
+
+  // nothing is shown before its tile is in
+  const std::vector<unsigned char> none(layers, 0);
+  glGenTextures(1, &m_tileMask);
+  glBindTexture(GL_TEXTURE_2D, m_tileMask);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, numTilesX(), numTilesY(), 0, GL_RED,
+               GL_UNSIGNED_BYTE, &none[0]);
+  return true;
+}
+
+// repeat the last column and row of a short tile once in the padding of its
+// layer, so that filtering at its border does not see undefined texels
+void TiledImage::padArrayLevel(const int tx, const int ty, const int level,
+                               const int w, const int h,
+                               const unsigned char *pixels) {
+  const int size = tileSize >> level;
+  const int layer = tileLayer(tx, ty);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, m_array);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+  if (w < size) {
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, w - 1);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, w, 0, layer, 1, h, 1, GL_RGB,
+                    GL_UNSIGNED_BYTE, pixels);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+  }
+  if (h < size) {
+    const unsigned char *last = pixels + (size_t)(h - 1) * w * 3;
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, h, layer, w, 1, 1, GL_RGB,
+                    GL_UNSIGNED_BYTE, last);
+    if (w < size) {
+      glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, w, h, layer, 1, 1, 1,
+                      GL_RGB, GL_UNSIGNED_BYTE, last + (w - 1) * 3);
+    }
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+// BC1 blocks of a level of a tile. In the array they also cover one column
+// and row of padding, that repeats the last ones of the tile.
+void TiledImage::compressLevel(const int level, const int w, const int h,
+                               const unsigned char *pixels,
+                               IMG::BC1::Blocks &blocks,
+                               const unsigned int threads) const {
+  int bw = w, bh = h;
+  if (m_array != 0) {
+    const int size = tileSize >> level;
+    bw = std::min(size, (w + 4) & ~3);
+    bh = std::min(size, (h + 4) & ~3);
+  }
+  IMG::BC1::compress(pixels, w, h, (size_t)w * 3, bw, bh, blocks, threads);
+}
 
-  // register OpenGL tiles
-  // std::vector<unsigned char> v_texdata( tileSize*tileSize );
+// compress the levels of a queued tile on the loader thread, update() only
+// copies the blocks
+void TiledImage::compressTile(PendingTile &tile,
+                              const unsigned int threads) const {
+  if (!m_bc1) {
+    return;
+  }
+  tile.blocks.resize(tile.levels.size());
+  for (size_t l = 0; l < tile.levels.size(); ++l) {
+    const Image &level = tile.levels[l];
+    compressLevel((int)l, level.width(), level.height(), level.data(),
+                  tile.blocks[l], threads);
+  }
+}
+
+void TiledImage::uploadBlocks(const int tx, const int ty, const int level,
+                              const IMG::BC1::Blocks &blocks) {
+  if (m_array != 0) {
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_array);
+    glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0,
+                              tileLayer(tx, ty), blocks.width, blocks.height,
+                              1, BC1_FORMAT, (GLsizei)blocks.size(),
+                              &blocks.data[0]);
+    if (level == 0) {
+      showArrayTile(tx, ty);
+    }
+    return;
+  }
+  GLuint texname = getTile(tx, ty);
+  if (texname == 0) {
+    glGenTextures(1, &texname);
+    m_tiles(tx, ty) = texname;
+  }
+  glBindTexture(GL_TEXTURE_2D, texname);
+  if (level == 0) {
+    setTileParameters(mipLevels());
+  }
+  glCompressedTexImage2D(GL_TEXTURE_2D, level, BC1_FORMAT, blocks.width,
+                         blocks.height, 0, (GLsizei)blocks.size(),
+                         &blocks.data[0]);
+}
+
+void TiledImage::showArrayTile(const int tx, const int ty) {
+  const unsigned char shown = 255;
+  glBindTexture(GL_TEXTURE_2D, m_tileMask);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, tx, ty, 1, 1, GL_RED, GL_UNSIGNED_BYTE,
+                  &shown);
+}
+
+void TiledImage::storeTile(const int tx, const int ty,
+                           const TileLevels &levels) {
+  for (size_t l = 0; m_cacheWriter && l < levels.size(); ++l) {
+    if (!m_cacheWriter->writeTile(tx, ty, (int)l, levels[l])) {
+      m_cacheWriter.reset();
+    }
+  }
+}
+
+void TiledImage::finishCache() {
+  if (m_cacheWriter) {
+    m_cacheWriter->finish();
+    m_cacheWriter.reset();
+  }
+}
+
+void TiledImage::cutTile(const Image &src, const int x0, const int y0,
+                         const int w, const int h, Image &dst) {
+  dst.copyRegion(src, x0, y0, w, h);
+}
+
+int TiledImage::mipLevels() const {
+  if (!m_mipmaps) {
+    return 1;
+  }
+  const int levels = std::min(IMG::seamlessMipLevels(tileSize),
+                              IMG::fullMipLevels(tileSize, tileSize));
+  // down to a gutter of one texel
+  return getGutter() > 0
+             ? std::min(levels, IMG::seamlessMipLevels(getGutter()))
+             : levels;
+}
+
+void TiledImage::setGutter(const int texels) {
+  m_gutter = 0;
+  for (int g = 1; g <= texels; g *= 2) {
+    m_gutter = g;
+  }
+}
+
+// surround the levels of tile (tx,ty) with its gutters, that repeat its
+// edges for now. Level l of the texture is (w >> l) + 2 * (gutter >> l)
+// wide, its chain stays complete.
+void TiledImage::addGutters(const int tx, const int ty,
+                            TileLevels &levels) const {
+  const int gutter = getGutter();
+  if (gutter == 0) {
+    return;
+  }
+  const int w = getTileWidth(tx), h = getTileHeight(ty);
+  Image padded;
+  for (size_t l = 0; l < levels.size(); ++l) {
+    const int g = gutter >> l;
+    IMG::padImage(levels[l], g, (w >> l) + 2 * g, (h >> l) + 2 * g, padded);
+    std::swap(levels[l], padded);
+  }
+}
+
+// the tile next to (tx,ty) in direction (dx,dy), the first and last column
+// of tiles are neighbours. False at the top and bottom.
+bool TiledImage::neighbour(const int tx, const int ty, const int dx,
+                           const int dy, int &nx, int &ny) const {
+  ny = ty + dy;
+  nx = (tx + dx + numTilesX()) % numTilesX();
+  return ny >= 0 && ny < numTilesY();
+}
+
+// tile (tx,ty) has been uploaded: keep its edges for the neighbours that
+// are still missing, fill its gutters from the ones that are in and its
+// edges into their gutters
+void TiledImage::exchangeGutters(const int tx, const int ty,
+                                 const TileLevels &levels) {
+  const int gutter = getGutter();
+  if (gutter == 0) {
+    return;
+  }
+  const int w = getTileWidth(tx), h = getTileHeight(ty);
+  TileEdges &edges = m_edges[tileLayer(tx, ty)];
+  const size_t count = levels.size();
+  edges.left.resize(count);
+  edges.right.resize(count);
+  edges.top.resize(count);
+  edges.bottom.resize(count);
+  for (size_t l = 0; l < count; ++l) {
+    const int g = gutter >> l, iw = w >> l, ih = h >> l;
+    edges.left[l].copyRegion(levels[l], g, g, g, ih);
+    edges.right[l].copyRegion(levels[l], iw, g, g, ih);
+    edges.top[l].copyRegion(levels[l], 0, g, iw + 2 * g, g);
+    edges.bottom[l].copyRegion(levels[l], 0, ih, iw + 2 * g, g);
+  }
+  edges.uploaded = true;
+
+  int nx, ny;
+  for (int dy = -1; dy <= 1; ++dy) {
+    for (int dx = -1; dx <= 1; ++dx) {
+      if ((dx != 0 || dy != 0) && neighbour(tx, ty, dx, dy, nx, ny) &&
+          m_edges[tileLayer(nx, ny)].uploaded) {
+        fillGutter(tx, ty, dx, dy, m_edges[tileLayer(nx, ny)]);
+        fillGutter(nx, ny, -dx, -dy, edges);
+      }
+    }
+  }
+  for (int dy = -1; dy <= 1; ++dy) {
+    for (int dx = -1; dx <= 1; ++dx) {
+      if (neighbour(tx, ty, dx, dy, nx, ny)) {
+        releaseEdges(nx, ny);
+      }
+    }
+  }
+}
+
+// copy the edges of the neighbour in direction (dx,dy) of tile (tx,ty) into
+// the gutter on that side, at all levels. Corners come from the diagonal
+// neighbours.
+void TiledImage::fillGutter(const int tx, const int ty, const int dx,
+                            const int dy, const TileEdges &from) {
+  const int gutter = getGutter();
+  const int w = getTileWidth(tx), h = getTileHeight(ty);
+  const int layer = tileLayer(tx, ty);
+  if (m_array != 0) {
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_array);
+  } else {
+    glBindTexture(GL_TEXTURE_2D, getTile(tx, ty));
+  }
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (size_t l = 0; l < from.left.size(); ++l) {
+    const int g = gutter >> l, iw = w >> l, ih = h >> l;
+    // a side takes a column of the neighbour, top and bottom a row of it,
+    // starting at the matching column
+    const Image &strip = dy == 0 ? (dx < 0 ? from.right[l] : from.left[l])
+                                 : (dy < 0 ? from.bottom[l] : from.top[l]);
+    const int sx =
+        dy == 0 ? 0 : (dx < 0 ? strip.width() - 2 * g : g);
+    const int x = dx < 0 ? 0 : (dx == 0 ? g : g + iw);
+    const int y = dy < 0 ? 0 : (dy == 0 ? g : g + ih);
+    const int cw = dx == 0 ? iw : g, ch = dy == 0 ? ih : g;
+    if (cw == 0 || ch == 0) {
+      continue;
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, strip.width());
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, sx);
+    if (m_array != 0) {
+      glTexSubImage3D(GL_TEXTURE_2D_ARRAY, (GLint)l, x, y, layer, cw, ch, 1,
+                      GL_RGB, GL_UNSIGNED_BYTE, strip.data());
+    } else {
+      glTexSubImage2D(GL_TEXTURE_2D, (GLint)l, x, y, cw, ch, GL_RGB,
+                      GL_UNSIGNED_BYTE, strip.data());
+    }
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+}
+
+// the edges of tile (tx,ty) are dropped once all of its neighbours are in
+void TiledImage::releaseEdges(const int tx, const int ty) {
+  TileEdges &edges = m_edges[tileLayer(tx, ty)];
+  if (!edges.uploaded) {
+    return;
+  }
+  int nx, ny;
+  for (int dy = -1; dy <= 1; ++dy) {
+    for (int dx = -1; dx <= 1; ++dx) {
+      if (neighbour(tx, ty, dx, dy, nx, ny) &&
+          !m_edges[tileLayer(nx, ny)].uploaded) {
+        return;
+      }
+    }
+  }
+  edges.left.clear();
+  edges.right.clear();
+  edges.top.clear();
+  edges.bottom.clear();
+}
+
+// cut the row of tiles ty from src starting at scanline y0 and build their
+// mipmaps, the tiles are independent and processed in parallel
+void TiledImage::cutTileRow(const Image &src, const int y0, const int ty,
+                            std::vector<TileLevels> &row) const {
+  const int levels = mipLevels();
+  row.resize(numTilesX());
+  PARALLEL::forEach(numTilesX(), [&](int tx) {
+    row[tx].resize(1);
+    cutTile(src, tx * tileSize, y0, getTileWidth(tx), getTileHeight(ty),
+            row[tx][0]);
+    IMG::buildMipChain(row[tx], levels);
+  });
+}
+
+void TiledImage::uploadTile(const int tx, const int ty,
+                            const TileLevels &levels) {
+  for (size_t l = 0; l < levels.size(); ++l) {
+    uploadTile(tx, ty, (int)l, levels[l].width(), levels[l].height(),
+               levels[l].data());
+  }
+  exchangeGutters(tx, ty, levels);
+}
+
+void TiledImage::uploadTile(const int tx, const int ty, const int level,
+                            const int w, const int h,
+                            const unsigned char *pixels) {
+  if (m_bc1) {
+    IMG::BC1::Blocks blocks;
+    compressLevel(level, w, h, pixels, blocks);
+    uploadBlocks(tx, ty, level, blocks);
+    return;
+  }
+  if (m_array != 0) {
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_array);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, tileLayer(tx, ty), w, h,
+                    1, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+    if (getGutter() == 0) {
+      padArrayLevel(tx, ty, level, w, h, pixels);
+    }
+    if (level == 0) {
+      showArrayTile(tx, ty);
+    }
+    return;
+  }
+  GLuint texname = getTile(tx, ty);
+  if (texname == 0) {
+    glGenTextures(1, &texname);
+    m_tiles(tx, ty) = texname;
+  }
   glEnable(GL_TEXTURE_2D);
-  glGenTextures((GLsizei)m_tiles.getData().size(), (GLuint *)m_tiles.data());
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+  // load texture to opengl
+  glBindTexture(GL_TEXTURE_2D, texname);
+
+  if (level == 0) {
+    setTileParameters(mipLevels());
+  }
+  glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, w, h, 0, GL_RGB,
+               GL_UNSIGNED_BYTE, pixels);
+}
+
+// decode the whole image and resample or cut it into cube faces
+bool TiledImage::loadCube(const IMG::MappedFile &file,
+                          const IMG::JIDX::Index *index, const bool cross) {
+  if (!IMG::loadJPEG<Image>(file.data(), file.size(), base, 0, 1, index)) {
+    return false;
+  }
+  typedef std::chrono::duration<double, std::milli> dms;
+  const auto T0 = std::chrono::high_resolution_clock::now();
+  Image faces[6];
+  if (cross) {
+    IMG::CUBE::fromCross(base, faces);
+  } else {
+    IMG::CUBE::fromEquirect(base, IMG::CUBE::faceSize(base.width()), faces,
+                            m_cubeFilter);
+  }
+  base = Image();
+  std::cout << "cube faces of " << faces[0].width() << "x"
+            << faces[0].height() << " in "
+            << dms(std::chrono::high_resolution_clock::now() - T0).count()
+            << " ms" << std::endl;
+  uploadCube(faces);
+  return true;
+}
 
+// upload the faces with their mipmaps, the faces are taken apart
+void TiledImage::uploadCube(Image faces[6]) {
+  const int n = faces[0].width();
+  m_faceSize = n;
+  m_width = 4 * n;
+  m_height = 2 * n;
+  GLint cubeLimit = 0, textureLimit = 0;
+  glGetIntegerv(GL_MAX_CUBE_MAP_TEXTURE_SIZE, &cubeLimit);
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &textureLimit);
   glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  TileLevels levels(1);
+
+  if (n <= cubeLimit) {
+    glGenTextures(1, &m_cube);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, m_cube);
+    const int count = m_mipmaps ? IMG::fullMipLevels(n, n) : 1;
+    setTileParameters(count, GL_TEXTURE_CUBE_MAP);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    for (int f = 0; f < 6; ++f) {
+      std::swap(levels[0], faces[f]);
+      IMG::buildMipChain(levels, count);
+      for (int l = 0; l < count; ++l) {
+        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + f, l, GL_RGB,
+                     levels[l].width(), levels[l].height(), 0, GL_RGB,
+                     GL_UNSIGNED_BYTE, levels[l].data());
+      }
+    }
+    // filter across the edges of the faces
+    if (GLEW_VERSION_3_2 || GLEW_ARB_seamless_cube_map) {
+      glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+    }
+    return;
+  }
 
-  for (int ty = 0; ty < verticalTiles; ++ty) {
-    int tileHeight = getTileHeight(ty);
-    for (int tx = 0; tx < horizontalTiles; ++tx) {
-      int tileWidth = getTileWidth(tx);
-      ImageT<unsigned char> texData;
-      texData.resize(tileWidth, tileHeight, 3);
-      // copy tile content, *very* inefficient, should be done by memcpy rows
-      for (int y = 0; y < tileHeight; ++y) {
-        for (int x = 0; x < tileWidth; ++x) {
-          texData(x, y, 0) = base(tx * tileSize + x, ty * tileSize + y, 0);
-          texData(x, y, 1) = base(tx * tileSize + x, ty * tileSize + y, 1);
-          texData(x, y, 2) = base(tx * tileSize + x, ty * tileSize + y, 2);
+  // faces of separate tiles with gutters of their neighbours on the same
+  // face, the edges of the faces are clamped
+  m_faceTiles = (n + textureLimit - 2 * m_gutter - 1) /
+                std::max(1, textureLimit - 2 * m_gutter);
+  const int ts = getFaceTileSize();
+  int count = m_mipmaps ? IMG::seamlessMipLevels(ts) : 1;
+  if (m_gutter > 0) {
+    count = std::min(count, IMG::seamlessMipLevels(m_gutter));
+  }
+  m_faceTextures.resize(6 * m_faceTiles * m_faceTiles);
+  glGenTextures((GLsizei)m_faceTextures.size(), &m_faceTextures[0]);
+  for (int f = 0; f < 6; ++f) {
+    for (int ty = 0; ty < m_faceTiles; ++ty) {
+      for (int tx = 0; tx < m_faceTiles; ++tx) {
+        int x0, x1, y0, y1;
+        getFaceTileTexels(tx, x0, x1);
+        getFaceTileTexels(ty, y0, y1);
+        cutTile(faces[f], x0, y0, x1 - x0, y1 - y0, levels[0]);
+        IMG::buildMipChain(levels, count);
+        glBindTexture(GL_TEXTURE_2D, getFaceTile(f, tx, ty));
+        setTileParameters(count);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        for (int l = 0; l < count; ++l) {
+          glTexImage2D(GL_TEXTURE_2D, l, GL_RGB, levels[l].width(),
+                       levels[l].height(), 0, GL_RGB, GL_UNSIGNED_BYTE,
+                       levels[l].data());
         }
       }
-      // load texture to opengl
-      GLuint texname = getTile(tx, ty);
-      glBindTexture(GL_TEXTURE_2D, texname);
+    }
+    faces[f] = Image();
+  }
+}
+
+void TiledImage::generateTiles() {
+  m_width = base.width();
+  m_height = base.height();
+  allocateTiles();
 
-      glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
-      glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-      // checkGLError();
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-      // checkGLError();
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, tileWidth, tileHeight, 0, GL_RGB,
-                   GL_UNSIGNED_BYTE, texData.data());
+  if (m_uploadBudget > 0.0) {
+    startLoader([this]() { cutTiles(); });
+  } else {
+    cutTiles();
+    finishCache();
+  }
+}
+
+// cut base into tiles and deliver them
+void TiledImage::cutTiles() {
+  // the next row of tiles is cut on the pool workers while this thread
+  // delivers the current one
+  std::vector<TileLevels> row, next;
+  cutTileRow(base, 0, 0, row);
+  for (int ty = 0, verticalTiles = numTilesY(); ty < verticalTiles; ++ty) {
+    PARALLEL::Job cutter;
+    if (ty + 1 < verticalTiles) {
+      cutter.start([this, ty, &next]() {
+        cutTileRow(base, (ty + 1) * tileSize, ty + 1, next);
+      });
+    }
+    bool ok = true;
+    for (int tx = 0, horizontalTiles = numTilesX();
+         ok && tx < horizontalTiles; ++tx) {
+      ok = deliverTile(tx, ty, row[tx]);
+    }
+    cutter.wait();
+    if (!ok) {
+      return;
     }
+    row.swap(next);
   }
 }
 
@@ -6,7 +6,31 @@
 
 #include "image.h"
 #include <GL/glew.h>
+#include "glupload.h"
+#include "bc1.h"
+#include "cubemap.h"
 #include "vec3t.h"
+#include <string>
+#include <functional>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace IMG {
+class JPEGReader;
+class JPEGRegionReader;
+class MappedFile;
+namespace PVT {
+struct SourceKey;
+class Writer;
+class File;
+}
+namespace JIDX {
+struct Index;
+}
+}
 
 //  Ulrich Krispel        uli@krispel.net
 //
@@ -14,21 +38,361 @@
 //
 
 class TiledImage {
+public:
+  // called after each finished row of tiles while streaming (done, total)
+  typedef std::function<void(int, int)> ProgressCallback;
+  // mipmap levels of a tile, level 0 is full resolution
+  typedef std::vector<Image> TileLevels;
+
+private:
   Image base;
   int tileSize;
-  ImageT<GLuint> m_tiles;
+  int m_width, m_height;
+  ImageT<GLuint> m_tiles; // texture name per tile, 0 if not uploaded yet
+
+  // texture array: all tiles are layers of one GL_TEXTURE_2D_ARRAY of
+  // tileSize x tileSize plus the gutters, m_tiles stays 0. Without gutters
+  // short tiles are padded by repeating their last column and row.
+  bool m_useArray;
+  GLuint m_array;    // 0 if the tiles are separate textures
+  GLuint m_tileMask; // one GL_R8 texel per tile, 255 once it is uploaded
+
+  // texture compression: tiles are BC1 compressed on the CPU before upload,
+  // 0.5 instead of 3-4 bytes per pixel in texture memory
+  bool m_useBC1;
+  bool m_bc1; // for the loaded image, needs EXT_texture_compression_s3tc
+
+  // zero copy loading: JPEGs are decoded straight into mapped pixel
+  // buffers and the tiles specified from there (loadMapped, refine). The
+  // pixels never pass the CPU, so such an image has no gutters, no array
+  // texture and is not written to the tile cache. m_mapped is set for the
+  // loaded image.
+  bool m_useZeroCopy;
+  bool m_mapped;
+
+  // gutters: the texture of a tile has a border of m_gutter texels at level
+  // 0 (halved per level) with the pixels of its neighbours, wrapping around
+  // at 360 degrees. It repeats the edges of the tile until a neighbour is
+  // uploaded, then the two exchange their edges.
+  int m_gutter;
+  struct TileEdges {
+    bool uploaded;
+    // per level: g columns of the tile at its left and right side, g rows
+    // of the tile and its gutters at the top and bottom
+    TileLevels left, right, top, bottom;
+    TileEdges() : uploaded(false) {}
+  };
+  std::vector<TileEdges> m_edges; // per tile, until all neighbours are in
+
   double m_azimuth, m_elevation;
+  bool m_streaming;
+  bool m_mipmaps;
+  ProgressCallback m_progress;
+  std::function<void()> m_wake;
+
+  // progressive loading: a low resolution preview is shown while the
+  // full resolution tiles are decoded by a background thread
+  struct PendingTile {
+    int tx, ty;
+    TileLevels levels;
+    std::vector<IMG::BC1::Blocks> blocks; // the compressed levels, if any
+  };
+  bool m_usePreview;
+  std::unique_ptr<TiledImage> m_preview;
+  std::unique_ptr<IMG::MappedFile> m_file; // compressed data for refinement
+  std::unique_ptr<IMG::JPEGReader> m_reader;
+  std::thread m_loader;
+  std::mutex m_mutex; // guards the members below
+  std::condition_variable m_cond;
+  std::deque<PendingTile> m_pending;
+  bool m_cancel, m_loaderDone;
+  // tiles are handed to update() instead of being uploaded right away
+  bool m_queueTiles;
+
+  // asynchronous upload: update() uploads pending tiles in stripes of rows
+  // through a ring of pixel buffers until the time budget is used up, a tile
+  // is shown when all of its levels are in
+  double m_uploadBudget; // milliseconds, 0 to upload while loading
+  bool m_useRing;        // false hands the stripes to the driver directly
+  std::unique_ptr<GLUTIL::UploadRing> m_ring;
+  PendingTile m_upload;   // the tile being uploaded
+  GLuint m_uploadTexture; // its texture, 0 if there is none
+  int m_uploadLevel, m_uploadRow;
+
+  // zero copy loading: the loader decodes rows of tiles straight into
+  // persistently mapped pixel buffers and update() specifies the tiles
+  // from there, their mipmaps are generated by the GPU
+  struct FilledRows {
+    int buffer;   // index into m_rowBuffers
+    int ty0, ty1; // the rows of tiles it holds
+  };
+  std::vector<GLUTIL::MappedBuffer> m_rowBuffers;
+  std::vector<int> m_freeRows;         // may be filled, guarded by m_mutex
+  std::deque<FilledRows> m_filledRows; // guarded by m_mutex
+  std::vector<int> m_fencedRows;       // the GPU may still read from them
+  int m_rowsTile; // next tile of m_filledRows.front() to specify
+
+  // on demand loading: tiles are decoded one by one from a JPEG with random
+  // access, the ones closest to the view direction first
+  bool m_onDemand;
+  std::unique_ptr<IMG::JPEGRegionReader> m_region;
+  std::vector<bool> m_scheduled; // per tile, guarded by m_mutex
+  Vec3d m_viewDir;               // guarded by m_mutex
+
+  // random access index for JPEGs without restart markers, see jpgindex.h
+  bool m_useIndex;
+
+  // tile cache: tiles of a decoded JPEG are also written to a .pvt file,
+  // that is used instead of the JPEG the next time
+  bool m_useCache;
+  std::unique_ptr<IMG::PVT::Writer> m_cacheWriter; // while loading, if any
+  std::unique_ptr<IMG::PVT::File> m_cacheFile; // read by the loader, if any
+
+  // cube map: the panorama is resampled into six faces of a
+  // GL_TEXTURE_CUBE_MAP. Faces larger than the cube map limit are cut into
+  // m_faceTiles x m_faceTiles 2D textures each, m_cube stays 0 then.
+  bool m_useCube;
+  IMG::CUBE::Filter m_cubeFilter;
+  GLuint m_cube;
+  int m_faceSize, m_faceTiles;
+  std::vector<GLuint> m_faceTextures; // per face, row by row
+
+  void allocateTiles();
+  bool allocateArray();
+  inline int tileLayer(const int tx, const int ty) const {
+    return ty * numTilesX() + tx;
+  }
+  void padArrayLevel(const int tx, const int ty, const int level,
+                     const int w, const int h, const unsigned char *pixels);
+  void showArrayTile(const int tx, const int ty);
+  void compressLevel(const int level, const int w, const int h,
+                     const unsigned char *pixels, IMG::BC1::Blocks &blocks,
+                     const unsigned int threads = 0) const;
+  void compressTile(PendingTile &tile, const unsigned int threads) const;
+  void uploadBlocks(const int tx, const int ty, const int level,
+                    const IMG::BC1::Blocks &blocks);
+  void addGutters(const int tx, const int ty, TileLevels &levels) const;
+  bool neighbour(const int tx, const int ty, const int dx, const int dy,
+                 int &nx, int &ny) const;
+  void exchangeGutters(const int tx, const int ty, const TileLevels &levels);
+  void fillGutter(const int tx, const int ty, const int dx, const int dy,
+                  const TileEdges &from);
+  void releaseEdges(const int tx, const int ty);
+  void cutTileRow(const Image &src, const int y0, const int ty,
+                  std::vector<TileLevels> &row) const;
+  void uploadTile(const int tx, const int ty, const TileLevels &levels);
+  void uploadTile(const int tx, const int ty, const int level, const int w,
+                  const int h, const unsigned char *pixels);
+  void storeTile(const int tx, const int ty, const TileLevels &levels);
+  bool deliverTile(const int tx, const int ty, TileLevels &levels);
+  enum UploadResult { UPLOAD_NONE, UPLOAD_PART, UPLOAD_TILE };
+  UploadResult uploadStep(const bool wait);
+  UploadResult uploadFromRows();
+  bool createRowBuffers(const int count, const int tileRows);
+  void releaseRowBuffers();
+  int acquireRows();
+  void queueRows(const int buffer, const int ty0, const int ty1);
+  bool canLoadMapped() const;
+  bool canMapUploads() const;
+  bool loadMapped(std::unique_ptr<IMG::MappedFile> &file,
+                  const IMG::JIDX::Index *index);
+  void startLoader(const std::function<void()> &produce);
+  void cutTiles();
+  void readCachedTiles();
+  static void readCachedTile(const IMG::PVT::File &pvt, const int tx,
+                             const int ty, TileLevels &levels);
+  bool readTileSet(const std::string &dir);
+  bool loadCube(const IMG::MappedFile &file, const IMG::JIDX::Index *index,
+                const bool cross);
+  void uploadCube(Image faces[6]);
+  void finishCache();
+  bool loadFromPVT(const std::string &filename,
+                   const IMG::PVT::SourceKey &key);
+  bool loadStreaming(const IMG::MappedFile &file);
+  bool loadProgressive(std::unique_ptr<IMG::MappedFile> file,
+                       const IMG::JIDX::Index *index);
+  bool loadOnDemand(std::unique_ptr<IMG::MappedFile> file,
+                    std::unique_ptr<IMG::JPEGRegionReader> region,
+                    const IMG::JIDX::Index *index);
+  std::unique_ptr<TiledImage>
+  createPreview(const IMG::MappedFile &file,
+                const IMG::JIDX::Index *index) const;
+  void startOnDemand();
+  void refine();
+  void loadVisible();
+  int nextVisibleTile() const;
+  void stopLoader();
+  void wake();
+  static bool readFieldOfView(const unsigned char *data, const size_t size,
+                              double &azimuth, double &elevation);
+
+  TiledImage(const TiledImage &);
+  TiledImage &operator=(const TiledImage &);
 
 public:
-  TiledImage(const int tSize = 1024) : tileSize(tSize){};
+  TiledImage(const int tSize = 1024);
   ~TiledImage();
 
-  inline bool isValid() const { return base.isValid(); }
-  inline int width() const { return base.width(); }
-  inline int height() const { return base.height(); }
+  inline bool isValid() const { return m_width > 0 && m_height > 0; }
+  inline int width() const { return m_width; }
+  inline int height() const { return m_height; }
 
   inline void setTileSize(int tsize) { tileSize = tsize; }
 
+  // streaming mode: decode the image in bands of tileSize scanlines and
+  // upload each row of tiles as soon as it is decoded, the full image is
+  // never held in memory
+  inline void setStreaming(bool streaming) { m_streaming = streaming; }
+  inline bool isStreaming() const { return m_streaming; }
+  inline void setProgressCallback(const ProgressCallback &cb) {
+    m_progress = cb;
+  }
+
+  // progressive mode: first show a 1/8 scale preview decoded by DCT
+  // scaling, then refine to full resolution in the background
+  inline void setPreview(bool preview) { m_usePreview = preview; }
+  // the preview while refinement is in progress, NULL otherwise
+  inline const TiledImage *getPreview() const { return m_preview.get(); }
+  // true while tiles are still being decoded or uploaded in the background
+  inline bool isRefining() const { return m_loader.joinable(); }
+
+  // on demand mode: for JPEGs with random access (restart markers) the
+  // tiles are decoded one by one on all cores, the ones closest to the
+  // view direction first. Other files are loaded as without it.
+  inline void setOnDemand(bool onDemand) { m_onDemand = onDemand; }
+  inline bool isOnDemand() const { return m_onDemand; }
+  // unit vector in the direction of the view
+  void setViewDirection(const Vec3d &direction);
+
+  // bounding cone of a tile on the unit sphere: axis through the tile
+  // center and the largest angle to its border
+  void getTileBounds(const int tx, const int ty, Vec3d &center,
+                     double &radius) const;
+  // steps points per edge on the border of a tile on the unit sphere, in
+  // order around it
+  void getTileBorder(const int tx, const int ty, const int steps,
+                     std::vector<Vec3d> &border) const;
+
+  // index JPEGs without restart markers on first use (sidecar .jidx file),
+  // so that they are decoded in parallel and on demand like files with them
+  inline void setIndexing(bool indexing) { m_useIndex = indexing; }
+  inline bool isIndexing() const { return m_useIndex; }
+
+  // build a mipmap chain for every tile and sample with trilinear
+  // filtering, only levels that stay aligned to the tile grid are built
+  inline void setMipmaps(bool mipmaps) { m_mipmaps = mipmaps; }
+  inline bool hasMipmaps() const { return m_mipmaps; }
+  int mipLevels() const;
+
+  // cache the tiles of loaded JPEGs as memory mappable .pvt files in
+  // $PANOVIEWER_CACHE or the user cache directory
+  inline void setCache(bool cache) { m_useCache = cache; }
+  inline bool isCaching() const { return m_useCache; }
+
+  // time per update() for uploads in milliseconds. With a budget all
+  // loading is done in the background and the tiles are uploaded by
+  // update(), without one (0, the default) images are loaded and uploaded
+  // before the load functions return, except for the refined tiles of
+  // progressive and on demand loading. Set it before loading.
+  inline void setUploadBudget(double ms) { m_uploadBudget = ms; }
+  inline double uploadBudget() const { return m_uploadBudget; }
+  // stage the uploads of update() in the ring of pixel buffers where the
+  // driver supports it (the default), or hand them to the driver directly.
+  // Set it before loading.
+  inline void setUploadRing(bool ring) { m_useRing = ring; }
+  inline bool usesUploadRing() const { return m_useRing; }
+
+  // has to be called regularly on the OpenGL thread while loading in the
+  // background, uploads finished tiles within the upload budget (all of
+  // them without one) and drops the preview when all tiles are in.
+  // Returns true if the displayed tiles changed.
+  bool update();
+  // true while update() has work left on the OpenGL thread: tiles or
+  // buffers waiting for upload, uploads the GPU has not finished, or a
+  // loader that is done
+  bool isUploading();
+  // called on the loader threads whenever they hand work to update(), e.g.
+  // to wake up an event loop that waits for input
+  inline void setWakeCallback(const std::function<void()> &cb) {
+    m_wake = cb;
+  }
+
+  // store the tiles as layers of one array texture so that they can be
+  // drawn in a single pass, needs OpenGL 3.0 and not more tiles than array
+  // layers. Set it before loading.
+  inline void setTextureArray(bool array) { m_useArray = array; }
+  inline bool isTextureArray() const { return m_useArray; }
+  // the GL_TEXTURE_2D_ARRAY with tile (tx,ty) in layer ty * numTilesX() + tx,
+  // 0 if the tiles are separate textures (getTile())
+  inline GLuint getTileArray() const { return m_array; }
+  // GL_R8 texture of numTilesX() x numTilesY(), nonzero where the layer of
+  // a tile holds its pixels
+  inline GLuint getTileMask() const { return m_tileMask; }
+
+  // convert loaded panoramas to a cube map (bilinear or bicubic resampling
+  // on all cores) and drop the equirectangular tiles, a cube map is drawn
+  // with one texture lookup per pixel. Horizontal crosses of 4 x 3 faces
+  // are always loaded as cube maps. Set it before loading.
+  inline void setCubemap(bool cube) { m_useCube = cube; }
+  inline bool isCubemap() const { return m_useCube; }
+  inline void setCubeFilter(IMG::CUBE::Filter filter) {
+    m_cubeFilter = filter;
+  }
+  // true if the loaded image is a cube map, either getCubemap() or tiles
+  inline bool hasCubeFaces() const { return m_faceSize > 0; }
+  inline int getFaceSize() const { return m_faceSize; }
+  // the GL_TEXTURE_CUBE_MAP, 0 if there is none or the faces are tiled
+  inline GLuint getCubemap() const { return m_cube; }
+  // tiles per row and column of a face, 0 if the faces are not tiled
+  inline int numFaceTiles() const { return m_faceTiles; }
+  inline int getFaceTileSize() const {
+    return m_faceTiles > 0 ? (m_faceSize + m_faceTiles - 1) / m_faceTiles : 0;
+  }
+  // 2D texture of tile (tx,ty) of a face (IMG::CUBE::Face), clamped at its
+  // borders
+  inline GLuint getFaceTile(const int face, const int tx, const int ty) const {
+    return m_faceTextures[(face * m_faceTiles + ty) * m_faceTiles + tx];
+  }
+  // the columns (or rows) [t0,t1) of a face in the texture of tile column
+  // (or row) t, the tile and its gutters
+  inline void getFaceTileTexels(const int t, int &t0, int &t1) const {
+    const int ts = getFaceTileSize();
+    t0 = std::max(0, t * ts - m_gutter);
+    t1 = std::min(m_faceSize, (t + 1) * ts + m_gutter);
+  }
+  // the part of the texture of tile column (or row) t that the tile covers
+  inline void getFaceTileTextureCoordinates(const int t, float &min,
+                                            float &max) const {
+    const int ts = getFaceTileSize();
+    int t0, t1;
+    getFaceTileTexels(t, t0, t1);
+    min = (float)(t * ts - t0) / (t1 - t0);
+    max = (float)(std::min(m_faceSize, (t + 1) * ts) - t0) / (t1 - t0);
+  }
+
+  // compress tiles to BC1 (DXT1) on all cores before they are uploaded,
+  // if the GPU supports S3TC. Lossy, 0.5 byte per pixel in texture memory
+  // instead of the 4 that drivers usually take for RGB. Set it before
+  // loading.
+  inline void setCompression(bool bc1) { m_useBC1 = bc1; }
+  inline bool isCompressing() const { return m_useBC1; }
+  // prefer zero copy loading of JPEGs where it is supported (OpenGL 4.4 or
+  // ARB_buffer_storage), over on demand loading, the tile cache, gutters
+  // and the array texture
+  inline void setZeroCopy(bool zeroCopy) { m_useZeroCopy = zeroCopy; }
+  inline bool isZeroCopy() const { return m_useZeroCopy; }
+  // the loaded image was decoded into mapped buffers
+  inline bool isMapped() const { return m_mapped; }
+  // true if the tiles of the loaded image are compressed
+  inline bool hasCompressedTiles() const { return m_bc1; }
+
+  // gutter of neighbour pixels around every tile texture at level 0, so
+  // that filtering and mipmaps do not see the tile borders. A power of two
+  // (rounded down), 0 for none. Mipmaps end at the last level with a gutter
+  // of one texel. Not used for compressed tiles. Set it before loading.
+  void setGutter(const int texels);
+  inline int getGutter() const { return m_useBC1 || m_mapped ? 0 : m_gutter; }
+
   inline int getTileSize() const { return tileSize; }
 
   inline GLuint getTile(const int x, const int y) const {
@@ -36,12 +400,12 @@ public:
   }
   inline int getTileWidth(const int x) const {
     int width =
-        (x == (m_tiles.width() - 1)) ? (base.width() % tileSize) : tileSize;
+        (x == (m_tiles.width() - 1)) ? (m_width % tileSize) : tileSize;
     return (width == 0) ? tileSize : width;
   }
   inline int getTileHeight(const int y) const {
     int height =
-        (y == (m_tiles.height() - 1)) ? (base.height() % tileSize) : tileSize;
+        (y == (m_tiles.height() - 1)) ? (m_height % tileSize) : tileSize;
     return (height == 0) ? tileSize : height;
   }
   inline int numTilesX() const { return m_tiles.width(); }
@@ -51,18 +415,43 @@ public:
   void generateDummyTexture();
   void cleanup();
 
+  // copy a w x h block at (x0,y0) of src into dst, row by row
+  static void cutTile(const Image &src, const int x0, const int y0,
+                      const int w, const int h, Image &dst);
+
   bool loadFromJPEG(std::string filename);
+  // load a tile set written by PanoSplit, given by its directory or
+  // manifest, the tiles are decoded in parallel. Sets the tile size.
+  bool loadFromTileSet(const std::string &path);
+  static bool isTileSet(const std::string &path);
+  // load six cube faces <name>_px.jpg, _nx, _py, _ny, _pz, _nz given by any
+  // of them, decoded in parallel
+  bool loadFromCubeFaces(const std::string &filename);
+  static bool isCubeFaceSet(const std::string &path);
   inline void getNormalizedTileCoordinates(const int tx, const int ty,
                                            float &xmin, float &xmax,
-                                           float &ymin, float &ymax) {
+                                           float &ymin, float &ymax) const {
     xmin = ((float)tx * tileSize);
     xmax = xmin + (float)getTileWidth(tx);
     ymin = ((float)ty * tileSize);
     ymax = ymin + (float)getTileHeight(ty);
     // normalize
-    xmin /= base.width(); // xmin -= 0.5f;
-    xmax /= base.width(); // xmax -= 0.5f;
-    ymin /= base.height();
-    ymax /= base.height();
+    xmin /= m_width; // xmin -= 0.5f;
+    xmax /= m_width; // xmax -= 0.5f;
+    ymin /= m_height;
+    ymax /= m_height;
+  }
+  // the part of the image that the texture of a tile covers, the tile and
+  // its gutters
+  inline void getNormalizedTextureCoordinates(const int tx, const int ty,
+                                              float &xmin, float &xmax,
+                                              float &ymin, float &ymax) const {
+    getNormalizedTileCoordinates(tx, ty, xmin, xmax, ymin, ymax);
+    const float gx = (float)getGutter() / m_width;
+    const float gy = (float)getGutter() / m_height;
+    xmin -= gx;
+    xmax += gx;
+    ymin -= gy;
+    ymax += gy;
   }
 };
@@ -0,0 +1,318 @@
+#ifndef _BC1_H_
+#define _BC1_H_
+
+// BC1 (DXT1) texture compression of RGB images on the CPU
+//
+// Every block of 4x4 pixels is stored in 8 bytes: two RGB565 end points
+// and a 2 bit index per pixel into the palette of the end points and the
+// two colors at 1/3 and 2/3 between them, 0.5 byte per pixel. The end
+// points are the bounding box of the block, along the diagonal that
+// follows the correlation of its channels and inset by 1/16 of the box.
+// The indices are found by projecting the pixels onto the line between
+// the end points, four pixels at a time with SSE2.
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "image.h"
+#include "parallel.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMG_BC1_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace IMG
+{
+    namespace BC1
+    {
+        // the blocks of a width x height image, row by row. Blocks at the
+        // right and bottom border repeat the last column and row of pixels.
+        struct Blocks
+        {
+            int width, height;
+            std::vector<unsigned char> data;
+
+            Blocks() : width(0), height(0) {}
+
+            inline int blocksX() const { return (width + 3) / 4; }
+            inline int blocksY() const { return (height + 3) / 4; }
+            inline size_t rowBytes() const { return (size_t)blocksX() * 8; }
+            inline size_t size() const { return data.size(); }
+        };
+
+        inline size_t compressedSize(const int width, const int height)
+        {
+            return (size_t)((width + 3) / 4) * ((height + 3) / 4) * 8;
+        }
+
+        inline unsigned short pack565(const int r, const int g, const int b)
+        {
+            return (unsigned short)((((r * 31 + 127) / 255) << 11) |
+                                    (((g * 63 + 127) / 255) << 5) |
+                                    ((b * 31 + 127) / 255));
+        }
+
+        // 8 bit channels with the high bits repeated in the low ones, like
+        // the GPU expands them
+        inline void unpack565(const unsigned short c, int rgb[3])
+        {
+            const int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+            rgb[0] = (r << 3) | (r >> 2);
+            rgb[1] = (g << 2) | (g >> 4);
+            rgb[2] = (b << 3) | (b >> 2);
+        }
+
+        // palette of a block, index 2 and 3 are between the end points or
+        // their mean and black if c0 <= c1
+        inline void palette(const unsigned short c0, const unsigned short c1,
+                            unsigned char colors[4][3])
+        {
+            int e0[3], e1[3];
+            unpack565(c0, e0);
+            unpack565(c1, e1);
+            for (int c = 0; c < 3; ++c)
+            {
+                colors[0][c] = (unsigned char)e0[c];
+                colors[1][c] = (unsigned char)e1[c];
+                if (c0 > c1)
+                {
+                    colors[2][c] = (unsigned char)((2 * e0[c] + e1[c]) / 3);
+                    colors[3][c] = (unsigned char)((e0[c] + 2 * e1[c]) / 3);
+                }
+                else
+                {
+                    colors[2][c] = (unsigned char)((e0[c] + e1[c]) / 2);
+                    colors[3][c] = 0;
+                }
+            }
+        }
+
+        // dot products of the 16 RGBX pixels minus e0 with the axis d
+        inline void project(const unsigned char *px, const int e0[3], const int d[3],
+                            int t[16])
+        {
+#ifdef IMG_BC1_SSE2
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i origin = _mm_set_epi16(0, (short)e0[2], (short)e0[1], (short)e0[0],
+                                                 0, (short)e0[2], (short)e0[1], (short)e0[0]);
+            const __m128i axis = _mm_set_epi16(0, (short)d[2], (short)d[1], (short)d[0],
+                                               0, (short)d[2], (short)d[1], (short)d[0]);
+            for (int i = 0; i < 4; ++i)
+            {
+                const __m128i p = _mm_loadu_si128((const __m128i *)&px[16 * i]);
+                // two pixels per register: r*dr+g*dg and b*db in 32 bit lanes
+                __m128i lo = _mm_madd_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(p, zero), origin), axis);
+                __m128i hi = _mm_madd_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(p, zero), origin), axis);
+                lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+                hi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+                const __m128i dots = _mm_castps_si128(
+                    _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0)));
+                _mm_storeu_si128((__m128i *)&t[4 * i], dots);
+            }
+#else
+            for (int i = 0; i < 16; ++i)
+            {
+                const unsigned char *p = &px[4 * i];
+                t[i] = (p[0] - e0[0]) * d[0] + (p[1] - e0[1]) * d[1] + (p[2] - e0[2]) * d[2];
+            }
+#endif
+        }
+
+        // encode 16 pixels of 4 bytes (RGB and one unused), row by row
+        inline void encodeBlock(const unsigned char *px, unsigned char *out)
+        {
+            int lo[3], hi[3];
+#ifdef IMG_BC1_SSE2
+            __m128i mn = _mm_loadu_si128((const __m128i *)px);
+            __m128i mx = mn;
+            for (int i = 1; i < 4; ++i)
+            {
+                const __m128i p = _mm_loadu_si128((const __m128i *)&px[16 * i]);
+                mn = _mm_min_epu8(mn, p);
+                mx = _mm_max_epu8(mx, p);
+            }
+            mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 8));
+            mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 4));
+            mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 8));
+            mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 4));
+            const unsigned int mnv = (unsigned int)_mm_cvtsi128_si32(mn);
+            const unsigned int mxv = (unsigned int)_mm_cvtsi128_si32(mx);
+            for (int c = 0; c < 3; ++c)
+            {
+                lo[c] = (mnv >> (8 * c)) & 255;
+                hi[c] = (mxv >> (8 * c)) & 255;
+            }
+#else
+            for (int c = 0; c < 3; ++c)
+            {
+                lo[c] = hi[c] = px[c];
+            }
+            for (int i = 1; i < 16; ++i)
+            {
+                for (int c = 0; c < 3; ++c)
+                {
+                    lo[c] = std::min(lo[c], (int)px[4 * i + c]);
+                    hi[c] = std::max(hi[c], (int)px[4 * i + c]);
+                }
+            }
+#endif
+            // the channel with the largest range decides the diagonal, the
+            // others run against it if they are anti-correlated
+            int ref = 0;
+            for (int c = 1; c < 3; ++c)
+            {
+                if (hi[c] - lo[c] > hi[ref] - lo[ref])
+                {
+                    ref = c;
+                }
+            }
+            int cov[3] = {0, 0, 0};
+            const int center[3] = {lo[0] + hi[0], lo[1] + hi[1], lo[2] + hi[2]};
+            for (int i = 0; i < 16; ++i)
+            {
+                const int r = 2 * px[4 * i + ref] - center[ref];
+                for (int c = 0; c < 3; ++c)
+                {
+                    cov[c] += (2 * px[4 * i + c] - center[c]) * r;
+                }
+            }
+            for (int c = 0; c < 3; ++c)
+            {
+                const int inset = (hi[c] - lo[c]) >> 4;
+                lo[c] += inset;
+                hi[c] -= inset;
+                if (cov[c] < 0)
+                {
+                    std::swap(lo[c], hi[c]);
+                }
+            }
+
+            // four color mode needs c0 > c1
+            unsigned short c0 = pack565(hi[0], hi[1], hi[2]);
+            unsigned short c1 = pack565(lo[0], lo[1], lo[2]);
+            if (c0 < c1)
+            {
+                std::swap(c0, c1);
+            }
+            unsigned int indices = 0;
+            if (c0 != c1)
+            {
+                int e0[3], e1[3], d[3];
+                unpack565(c0, e0);
+                unpack565(c1, e1);
+                int dd = 0;
+                for (int c = 0; c < 3; ++c)
+                {
+                    d[c] = e1[c] - e0[c];
+                    dd += d[c] * d[c];
+                }
+                int t[16];
+                project(px, e0, d, t);
+                // nearest of the positions 0, 1/3, 2/3 and 1 on the line,
+                // stored as the palette indices 0, 2, 3 and 1
+                static const unsigned int order[4] = {0, 2, 3, 1};
+                for (int i = 15; i >= 0; --i)
+                {
+                    const int t6 = 6 * t[i];
+                    const int k = (t6 >= dd) + (t6 >= 3 * dd) + (t6 >= 5 * dd);
+                    indices = (indices << 2) | order[k];
+                }
+            }
+            out[0] = (unsigned char)(c0 & 255);
+            out[1] = (unsigned char)(c0 >> 8);
+            out[2] = (unsigned char)(c1 & 255);
+            out[3] = (unsigned char)(c1 >> 8);
+            for (int i = 0; i < 4; ++i)
+            {
+                out[4 + i] = (unsigned char)(indices >> (8 * i));
+            }
+        }
+
+        // compress the w x h RGB pixels (stride bytes per row) into
+        // blocks of a width x height image, width >= w and height >= h.
+        // Pixels outside repeat the last column and row. Rows of blocks
+        // are spread over the given number of threads, 0 for all cores.
+        inline void compress(const unsigned char *rgb, const int w, const int h,
+                             const size_t stride, const int width, const int height,
+                             Blocks &blocks, const unsigned int threads = 0)
+        {
+            blocks.width = width;
+            blocks.height = height;
+            blocks.data.resize(compressedSize(width, height));
+            const int bx = blocks.blocksX();
+            PARALLEL::forEach(blocks.blocksY(), [&](int by)
+            {
+                unsigned char px[64];
+                unsigned char *out = &blocks.data[by * blocks.rowBytes()];
+                const unsigned char *rows[4];
+                for (int j = 0; j < 4; ++j)
+                {
+                    rows[j] = rgb + std::min(4 * by + j, h - 1) * stride;
+                }
+                for (int x = 0; x < bx; ++x, out += 8)
+                {
+                    int cols[4];
+                    for (int i = 0; i < 4; ++i)
+                    {
+                        cols[i] = 3 * std::min(4 * x + i, w - 1);
+                    }
+                    for (int j = 0; j < 4; ++j)
+                    {
+                        for (int i = 0; i < 4; ++i)
+                        {
+                            const unsigned char *p = rows[j] + cols[i];
+                            unsigned char *q = &px[4 * (4 * j + i)];
+                            q[0] = p[0];
+                            q[1] = p[1];
+                            q[2] = p[2];
+                            q[3] = 0;
+                        }
+                    }
+                    encodeBlock(px, out);
+                }
+            }, threads);
+        }
+
+        inline void compress(const Image &img, Blocks &blocks, const unsigned int threads = 0)
+        {
+            compress(img.data(), img.width(), img.height(), (size_t)img.width() * 3,
+                     img.width(), img.height(), blocks, threads);
+        }
+
+        // decode to RGB, e.g. to check the compression without a GPU
+        inline void decompress(const Blocks &blocks, Image &img)
+        {
+            img.resize(blocks.width, blocks.height, 3);
+            for (int by = 0; by < blocks.blocksY(); ++by)
+            {
+                for (int bx = 0; bx < blocks.blocksX(); ++bx)
+                {
+                    const unsigned char *b = &blocks.data[by * blocks.rowBytes() + 8 * bx];
+                    unsigned char colors[4][3];
+                    palette((unsigned short)(b[0] | (b[1] << 8)),
+                            (unsigned short)(b[2] | (b[3] << 8)), colors);
+                    const unsigned int indices = b[4] | (b[5] << 8) | (b[6] << 16) |
+                                                 ((unsigned int)b[7] << 24);
+                    for (int j = 0; j < 4; ++j)
+                    {
+                        for (int i = 0; i < 4; ++i)
+                        {
+                            const int x = 4 * bx + i, y = 4 * by + j;
+                            if (x < blocks.width && y < blocks.height)
+                            {
+                                const unsigned char *c = colors[(indices >> (2 * (4 * j + i))) & 3];
+                                for (int ch = 0; ch < 3; ++ch)
+                                {
+                                    img(x, y, ch) = c[ch];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef _CUBEMAP_H_
+#define _CUBEMAP_H_
+
+// cube maps of equirectangular panoramas
+//
+// The six faces are in the order and orientation of OpenGL cube map faces
+// (+X,-X,+Y,-Y,+Z,-Z), row 0 first. The cube's y axis is up (world z) and
+// its +Z face shows the start view of the viewer (world y), so a world
+// direction d is looked up as (d.x,d.z,d.y). This is the layout of the
+// usual skybox images: six files or a horizontal cross of 4 x 3 faces
+//
+//        +Y
+//    -X  +Z  +X  -Z
+//        -Y
+//
+// can be cut into faces without flipping them.
+
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "image.h"
+#include "vec3t.h"
+#include "rectilinear.h"
+#include "parallel.h"
+
+namespace IMG
+{
+    namespace CUBE
+    {
+        enum Face { POSITIVE_X = 0, NEGATIVE_X, POSITIVE_Y, NEGATIVE_Y, POSITIVE_Z, NEGATIVE_Z };
+        enum Filter { BILINEAR = 0, BICUBIC };
+
+        // file name suffixes of the faces of a face set, <name>_px.jpg ...
+        static const char *const SUFFIX[6] = {"px", "nx", "py", "ny", "pz", "nz"};
+
+        // cube direction of the face position (s,t) in [-1,1], inverse of
+        // the face selection of OpenGL
+        inline void faceDirection(const int face, const float s, const float t, float d[3])
+        {
+            switch (face)
+            {
+            case POSITIVE_X: d[0] = 1.0f;  d[1] = -t;    d[2] = -s;    break;
+            case NEGATIVE_X: d[0] = -1.0f; d[1] = -t;    d[2] = s;     break;
+            case POSITIVE_Y: d[0] = s;     d[1] = 1.0f;  d[2] = t;     break;
+            case NEGATIVE_Y: d[0] = s;     d[1] = -1.0f; d[2] = -t;    break;
+            case POSITIVE_Z: d[0] = s;     d[1] = -t;    d[2] = 1.0f;  break;
+            default:         d[0] = -s;    d[1] = -t;    d[2] = -1.0f; break;
+            }
+        }
+
+        // face size that keeps the resolution of a panorama at the equator
+        inline int faceSize(const int panoWidth)
+        {
+            return std::max(1, (panoWidth + 2) / 4);
+        }
+
+        // a w x h image is a horizontal cross of faces
+        inline bool isCross(const int w, const int h)
+        {
+            return w > 0 && w % 4 == 0 && 3 * w == 4 * h;
+        }
+
+        // a file named <name>_cross.<ext> holds a cross, any 4:3 image
+        // could be one
+        inline bool isCrossName(const std::string &filename)
+        {
+            const size_t dot = filename.rfind('.');
+            return dot != std::string::npos && dot >= 6 &&
+                   filename.compare(dot - 6, 6, "_cross") == 0;
+        }
+
+        // the face set of a file named <name>_<suffix>.<ext>, false if the
+        // name does not end like that
+        inline bool faceFiles(const std::string &filename, std::string files[6])
+        {
+            const size_t dot = filename.rfind('.');
+            if (dot == std::string::npos || dot < 3 || filename[dot - 3] != '_')
+            {
+                return false;
+            }
+            const std::string suffix = filename.substr(dot - 2, 2);
+            if (std::find(SUFFIX, SUFFIX + 6, suffix) == SUFFIX + 6)
+            {
+                return false;
+            }
+            for (int f = 0; f < 6; ++f)
+            {
+                files[f] = filename.substr(0, dot - 2) + SUFFIX[f] + filename.substr(dot);
+            }
+            return true;
+        }
+
+        // round without a call to floor
+        inline int roundInt(const float v)
+        {
+            return (int)(v < 0.0f ? v - 0.5f : v + 0.5f);
+        }
+
+        inline int floorInt(const float v)
+        {
+            const int i = (int)v;
+            return i - (v < (float)i);
+        }
+
+        // Catmull-Rom weights of the four texels around a position with
+        // fraction t, in 1/256 and summing up to 256
+        inline void catmullRom(const float t, int w[4])
+        {
+            w[0] = roundInt(128.0f * ((-t + 2.0f) * t - 1.0f) * t);
+            w[2] = roundInt(128.0f * ((-3.0f * t + 4.0f) * t + 1.0f) * t);
+            w[3] = roundInt(128.0f * (t - 1.0f) * t * t);
+            w[1] = 256 - w[0] - w[2] - w[3];
+        }
+
+        // Catmull-Rom samples of the panorama at the n positions sx,sy with
+        // CH channels, repeating horizontally and clamped at the poles
+        template <int CH>
+        inline void sampleBicubic(const Image &pano, const float *sx, const float *sy,
+                                  const int n, unsigned char *dst)
+        {
+            const int w = pano.width(), h = pano.height();
+            for (int i = 0; i < n; ++i, dst += CH)
+            {
+                const int ix = floorInt(sx[i]), iy = floorInt(sy[i]);
+                int wx[4], wy[4];
+                catmullRom(sx[i] - ix, wx);
+                catmullRom(sy[i] - iy, wy);
+                int xs[4];
+                const int x0 = ix - 1;
+                for (int k = 0; k < 4; ++k)
+                {
+                    const int x = x0 + k;
+                    xs[k] = CH * ((x >= 0 && x < w) ? x : ((x % w) + w) % w);
+                }
+                const int y0 = iy - 1;
+                int sum[CH] = {0};
+                for (int j = 0; j < 4; ++j)
+                {
+                    const unsigned char *row = &pano(0, std::max(0, std::min(y0 + j, h - 1)));
+                    // the horizontal pass first, weighted by wy once per row
+                    int r[CH] = {0};
+                    for (int k = 0; k < 4; ++k)
+                    {
+                        for (int c = 0; c < CH; ++c)
+                        {
+                            r[c] += wx[k] * row[xs[k] + c];
+                        }
+                    }
+                    for (int c = 0; c < CH; ++c)
+                    {
+                        sum[c] += wy[j] * r[c];
+                    }
+                }
+                for (int c = 0; c < CH; ++c)
+                {
+                    dst[c] = (unsigned char)std::max(0, std::min(255, (sum[c] + 32768) >> 16));
+                }
+            }
+        }
+
+        inline void sampleBicubic(const Image &pano, const float *sx, const float *sy,
+                                  const int n, unsigned char *dst)
+        {
+            switch (pano.chan())
+            {
+            case 1: sampleBicubic<1>(pano, sx, sy, n, dst); break;
+            case 4: sampleBicubic<4>(pano, sx, sy, n, dst); break;
+            default: sampleBicubic<3>(pano, sx, sy, n, dst); break;
+            }
+        }
+
+        // resample the panorama into six faces of size x size, the rows of
+        // all faces are spread over the given number of threads, 0 for all
+        // cores
+        inline void fromEquirect(const Image &pano, const int size, Image faces[6],
+                                 const Filter filter = BILINEAR,
+                                 const unsigned int threads = 0)
+        {
+            for (int f = 0; f < 6; ++f)
+            {
+                faces[f].resize(size, size, pano.chan());
+            }
+            const int pw = pano.width(), ph = pano.height();
+            PARALLEL::forEach(6 * size, [&](int row)
+            {
+                const int f = row / size, y = row % size;
+                std::vector<float> x(size), yy(size), z(size), u(size), v(size);
+                const float t = 2.0f * (y + 0.5f) / size - 1.0f;
+                for (int i = 0; i < size; ++i)
+                {
+                    float d[3];
+                    faceDirection(f, 2.0f * (i + 0.5f) / size - 1.0f, t, d);
+                    // cube to world coordinates
+                    x[i] = d[0];
+                    yy[i] = d[2];
+                    z[i] = d[1];
+                }
+                SPHERE::toEquirect(&x[0], &yy[0], &z[0], size, &u[0], &v[0]);
+                for (int i = 0; i < size; ++i)
+                {
+                    u[i] = u[i] * pw - 0.5f;
+                    v[i] = v[i] * ph - 0.5f;
+                }
+                unsigned char *dst = &faces[f](0, y);
+                if (filter == BICUBIC)
+                {
+                    sampleBicubic(pano, &u[0], &v[0], size, dst);
+                    return;
+                }
+                std::vector<int> fx(size), fy(size);
+                RECT::toFixed(&u[0], size, &fx[0]);
+                RECT::toFixed(&v[0], size, &fy[0]);
+                RECT::sampleFixed(pano, &fx[0], &fy[0], size, dst);
+            }, threads);
+        }
+
+        // cut a horizontal cross into its faces
+        inline bool fromCross(const Image &cross, Image faces[6])
+        {
+            if (!isCross(cross.width(), cross.height()))
+            {
+                return false;
+            }
+            const int n = cross.width() / 4;
+            // column and row of every face in the cross
+            static const int at[6][2] = {{2, 1}, {0, 1}, {1, 0}, {1, 2}, {1, 1}, {3, 1}};
+            for (int f = 0; f < 6; ++f)
+            {
+                faces[f].resize(n, n, cross.chan());
+                const size_t bytes = (size_t)n * cross.chan();
+                for (int y = 0; y < n; ++y)
+                {
+                    memcpy(&faces[f](0, y), &cross(at[f][0] * n, at[f][1] * n + y), bytes);
+                }
+            }
+            return true;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,257 @@
+#ifndef _GLPROFILE_H_
+#define _GLPROFILE_H_
+
+// CPU and GPU time of the stages of a frame
+//
+// Every stage keeps the last samples of both in a ring buffer and reports
+// percentiles over them. CPU time is measured with steady_clock between
+// begin() and end(). GPU time is the difference of two GL_TIMESTAMP queries
+// at the same points, unlike GL_TIME_ELAPSED queries they may nest and
+// overlap, so a stage can be timed inside another one (a tile inside the
+// tile loop). The queries of a frame are read LATENCY frames later, when
+// the GPU is done with them, so the timing does not stall the pipeline.
+
+#include <GL/glew.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace GLUTIL
+{
+    // the last samples of a time in milliseconds
+    class TimeHistogram
+    {
+        std::vector<float> m_samples;
+        size_t m_next, m_count;
+
+    public:
+        TimeHistogram(const size_t capacity = 512)
+            : m_samples(std::max((size_t)1, capacity)), m_next(0), m_count(0) {}
+
+        void add(const double ms)
+        {
+            m_samples[m_next] = (float)ms;
+            m_next = (m_next + 1) % m_samples.size();
+            m_count = std::min(m_count + 1, m_samples.size());
+        }
+
+        void clear()
+        {
+            m_next = m_count = 0;
+        }
+
+        inline size_t count() const { return m_count; }
+
+        // the percentiles p[0..n-1] (0..100) of the samples, 0 if there are
+        // none
+        void percentiles(const double *p, const int n, double *result) const
+        {
+            std::vector<float> sorted(m_samples.begin(), m_samples.begin() + m_count);
+            std::sort(sorted.begin(), sorted.end());
+            for (int i = 0; i < n; ++i)
+            {
+                result[i] = sorted.empty() ? 0.0
+                    : sorted[std::min(sorted.size() - 1,
+                                      (size_t)(p[i] / 100.0 * sorted.size()))];
+            }
+        }
+
+        double mean() const
+        {
+            double sum = 0.0;
+            for (size_t i = 0; i < m_count; ++i)
+            {
+                sum += m_samples[i];
+            }
+            return m_count > 0 ? sum / m_count : 0.0;
+        }
+    };
+
+    class FrameProfiler
+    {
+    public:
+        enum { LATENCY = 4 }; // frames until the queries of one are read
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Stage
+        {
+            std::string name;
+            bool gpu;                // GPU time is measured
+            TimeHistogram cpu, gpuTime;
+            Clock::time_point start; // of the open begin()
+            int query;               // its timestamp in the frame, -1 if none
+            Stage(const std::string &n, const bool g, const size_t samples)
+                : name(n), gpu(g), cpu(samples), gpuTime(samples), query(-1) {}
+        };
+        struct Interval
+        {
+            int stage, begin, end; // indices into Frame::queries
+        };
+        struct Frame
+        {
+            std::vector<GLuint> queries;
+            size_t used;
+            std::vector<Interval> intervals;
+            Frame() : used(0) {}
+        };
+
+        std::vector<Stage> m_stages;
+        size_t m_samples;
+        bool m_gpu; // timer queries are supported
+        Frame m_frames[LATENCY];
+        int m_frame;
+
+        FrameProfiler(const FrameProfiler &);
+        FrameProfiler &operator=(const FrameProfiler &);
+
+        int timestamp()
+        {
+            Frame &f = m_frames[m_frame];
+            if (f.used == f.queries.size())
+            {
+                GLuint q = 0;
+                glGenQueries(1, &q);
+                f.queries.push_back(q);
+            }
+            glQueryCounter(f.queries[f.used], GL_TIMESTAMP);
+            return (int)f.used++;
+        }
+
+        // GPU times of a frame whose queries are done, dropped if they are
+        // not yet, so that there is never a wait
+        void collect(Frame &f)
+        {
+            if (!f.intervals.empty())
+            {
+                GLint available = 0;
+                glGetQueryObjectiv(f.queries[f.used - 1], GL_QUERY_RESULT_AVAILABLE,
+                                   &available);
+                for (size_t i = 0; available && i < f.intervals.size(); ++i)
+                {
+                    const Interval &t = f.intervals[i];
+                    GLuint64 t0 = 0, t1 = 0;
+                    glGetQueryObjectui64v(f.queries[t.begin], GL_QUERY_RESULT, &t0);
+                    glGetQueryObjectui64v(f.queries[t.end], GL_QUERY_RESULT, &t1);
+                    m_stages[t.stage].gpuTime.add((double)(t1 - t0) / 1e6);
+                }
+            }
+            f.intervals.clear();
+            f.used = 0;
+        }
+
+    public:
+        FrameProfiler(const size_t samples = 512)
+            : m_samples(samples), m_gpu(false), m_frame(0) {}
+
+        // needs a current context, GPU times need OpenGL 3.3 or
+        // ARB_timer_query
+        void initialize()
+        {
+            release();
+            m_gpu = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+        }
+
+        // delete the queries, call before the context goes away
+        void release()
+        {
+            for (int i = 0; i < LATENCY; ++i)
+            {
+                Frame &f = m_frames[i];
+                if (!f.queries.empty())
+                {
+                    glDeleteQueries((GLsizei)f.queries.size(), &f.queries[0]);
+                }
+                f = Frame();
+            }
+            m_frame = 0;
+        }
+
+        inline bool hasGPUTimes() const { return m_gpu; }
+
+        // a stage and its index for begin() and end()
+        int addStage(const std::string &name, const bool gpu = true)
+        {
+            m_stages.push_back(Stage(name, gpu, m_samples));
+            return (int)m_stages.size() - 1;
+        }
+
+        inline int numStages() const { return (int)m_stages.size(); }
+        inline const std::string &name(const int stage) const { return m_stages[stage].name; }
+        inline const TimeHistogram &cpu(const int stage) const { return m_stages[stage].cpu; }
+        inline const TimeHistogram &gpu(const int stage) const { return m_stages[stage].gpuTime; }
+
+        void beginFrame()
+        {
+            if (m_gpu)
+            {
+                collect(m_frames[m_frame]);
+            }
+        }
+
+        void endFrame()
+        {
+            m_frame = (m_frame + 1) % LATENCY;
+        }
+
+        void begin(const int stage)
+        {
+            Stage &s = m_stages[stage];
+            if (m_gpu && s.gpu)
+            {
+                s.query = timestamp();
+            }
+            s.start = Clock::now();
+        }
+
+        void end(const int stage)
+        {
+            Stage &s = m_stages[stage];
+            const std::chrono::duration<double, std::milli> dt = Clock::now() - s.start;
+            s.cpu.add(dt.count());
+            if (s.query >= 0)
+            {
+                const Interval t = {stage, s.query, timestamp()};
+                m_frames[m_frame].intervals.push_back(t);
+                s.query = -1;
+            }
+        }
+
+        // a line per stage and clock (cpu, gpu): samples, mean, p50, p95,
+        // p99 and max in milliseconds. Stages without GPU times have no gpu
+        // line.
+        bool writeCSV(const std::string &filename) const
+        {
+            std::ofstream out(filename.c_str());
+            if (!out)
+            {
+                return false;
+            }
+            out << "stage,clock,samples,mean_ms,p50_ms,p95_ms,p99_ms,max_ms\n";
+            const double p[4] = {50.0, 95.0, 99.0, 100.0};
+            for (size_t i = 0; i < m_stages.size(); ++i)
+            {
+                const TimeHistogram *h[2] = {&m_stages[i].cpu, &m_stages[i].gpuTime};
+                const char *clock[2] = {"cpu", "gpu"};
+                for (int k = 0; k < 2; ++k)
+                {
+                    if (h[k]->count() == 0)
+                    {
+                        continue;
+                    }
+                    double r[4];
+                    h[k]->percentiles(p, 4, r);
+                    out << m_stages[i].name << "," << clock[k] << "," << h[k]->count()
+                        << "," << h[k]->mean() << "," << r[0] << "," << r[1] << ","
+                        << r[2] << "," << r[3] << "\n";
+                }
+            }
+            return (bool)out;
+        }
+    };
+}
+
+#endif
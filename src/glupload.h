@@ -0,0 +1,305 @@
+#ifndef _GLUPLOAD_H_
+#define _GLUPLOAD_H_
+
+// asynchronous texture uploads through pixel unpack buffers
+
+#include <GL/glew.h>
+#include <vector>
+#include <cstring>
+
+namespace GLUTIL
+{
+    // The pixels of an upload are copied into the next buffer of the ring
+    // and the texture is specified from there, so the driver transfers them
+    // while the caller goes on. A fence per buffer tells when it may be
+    // written again. Without pixel buffer objects, sync objects or
+    // glMapBufferRange the pixels are handed to the driver directly.
+    class UploadRing
+    {
+        struct Slot
+        {
+            GLuint buffer;
+            GLsizeiptr size;
+            GLsync fence;
+        };
+        std::vector<Slot> m_slots;
+        size_t m_next;
+
+        UploadRing(const UploadRing &);
+        UploadRing &operator=(const UploadRing &);
+
+    public:
+        UploadRing() : m_next(0) {}
+
+        static bool isSupported()
+        {
+            return GLEW_ARB_pixel_buffer_object && GLEW_ARB_sync &&
+                   GLEW_ARB_map_buffer_range;
+        }
+
+        // count buffers of slotSize bytes each, they grow for larger uploads
+        void initialize(const int count = 4, const GLsizeiptr slotSize = 1 << 22)
+        {
+            release();
+            if (!isSupported())
+            {
+                return;
+            }
+            m_slots.resize(count);
+            for (size_t i = 0; i < m_slots.size(); ++i)
+            {
+                Slot &s = m_slots[i];
+                glGenBuffers(1, &s.buffer);
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s.buffer);
+                glBufferData(GL_PIXEL_UNPACK_BUFFER, slotSize, NULL, GL_STREAM_DRAW);
+                s.size = slotSize;
+                s.fence = 0;
+            }
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+
+        void release()
+        {
+            for (size_t i = 0; i < m_slots.size(); ++i)
+            {
+                if (m_slots[i].fence)
+                {
+                    glDeleteSync(m_slots[i].fence);
+                }
+                glDeleteBuffers(1, &m_slots[i].buffer);
+            }
+            m_slots.clear();
+            m_next = 0;
+        }
+
+        inline bool isAsync() const { return !m_slots.empty(); }
+
+        // true if the next upload can be done without waiting for the GPU
+        bool isReady()
+        {
+            if (m_slots.empty() || !m_slots[m_next].fence)
+            {
+                return true;
+            }
+            const GLenum state = glClientWaitSync(m_slots[m_next].fence,
+                                                  GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+            return state == GL_ALREADY_SIGNALED || state == GL_CONDITION_SATISFIED;
+        }
+
+        // glTexSubImage2D of w x h tightly packed RGB pixels into the texture
+        // bound to target, waits for the next buffer if it is still in use
+        void texSubImage2D(const GLenum target, const GLint level, const GLint x,
+                           const GLint y, const GLsizei w, const GLsizei h,
+                           const unsigned char *pixels)
+        {
+            const GLvoid *src = stage(pixels, (GLsizeiptr)w * h * 3);
+            glTexSubImage2D(target, level, x, y, w, h, GL_RGB, GL_UNSIGNED_BYTE, src);
+            unstage(src != pixels);
+        }
+
+        // the same for layer z of the 2D array texture bound to target
+        void texSubImage3D(const GLenum target, const GLint level, const GLint x,
+                           const GLint y, const GLint z, const GLsizei w,
+                           const GLsizei h, const unsigned char *pixels)
+        {
+            const GLvoid *src = stage(pixels, (GLsizeiptr)w * h * 3);
+            glTexSubImage3D(target, level, x, y, z, w, h, 1, GL_RGB,
+                            GL_UNSIGNED_BYTE, src);
+            unstage(src != pixels);
+        }
+
+        // glCompressedTexSubImage2D of bytes of compressed data
+        void compressedTexSubImage2D(const GLenum target, const GLint level,
+                                     const GLint x, const GLint y, const GLsizei w,
+                                     const GLsizei h, const GLenum format,
+                                     const GLsizei bytes, const unsigned char *data)
+        {
+            const GLvoid *src = stage(data, bytes);
+            glCompressedTexSubImage2D(target, level, x, y, w, h, format, bytes, src);
+            unstage(src != data);
+        }
+
+        // the same for layer z of the 2D array texture bound to target
+        void compressedTexSubImage3D(const GLenum target, const GLint level,
+                                     const GLint x, const GLint y, const GLint z,
+                                     const GLsizei w, const GLsizei h,
+                                     const GLenum format, const GLsizei bytes,
+                                     const unsigned char *data)
+        {
+            const GLvoid *src = stage(data, bytes);
+            glCompressedTexSubImage3D(target, level, x, y, z, w, h, 1, format, bytes,
+                                      src);
+            unstage(src != data);
+        }
+
+    private:
+        // copy the pixels (or compressed blocks) into the next buffer of
+        // the ring and leave it bound, returns the offset to specify the
+        // texture from or pixels if they have to be handed to the driver
+        // directly
+        const GLvoid *stage(const unsigned char *pixels, const GLsizeiptr bytes)
+        {
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            if (m_slots.empty())
+            {
+                return pixels;
+            }
+            Slot &s = m_slots[m_next];
+            if (s.fence)
+            {
+                while (glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                        1000000000) == GL_TIMEOUT_EXPIRED)
+                {
+                }
+                glDeleteSync(s.fence);
+                s.fence = 0;
+            }
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s.buffer);
+            if (bytes > s.size)
+            {
+                glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+                s.size = bytes;
+            }
+            // the fence has passed, nothing reads from the buffer anymore
+            void *dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+                                         GL_MAP_WRITE_BIT |
+                                             GL_MAP_INVALIDATE_BUFFER_BIT |
+                                             GL_MAP_UNSYNCHRONIZED_BIT);
+            if (!dst)
+            {
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                return pixels;
+            }
+            memcpy(dst, pixels, (size_t)bytes);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            return (const GLvoid *)0;
+        }
+
+        // after the texture was specified: fence the staged buffer and
+        // advance to the next one
+        void unstage(const bool staged)
+        {
+            if (!staged)
+            {
+                return;
+            }
+            m_slots[m_next].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            m_next = (m_next + 1) % m_slots.size();
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+    };
+
+    // true if mipmaps can be generated by the GPU
+    inline bool canGenerateMipmaps()
+    {
+        return GLEW_VERSION_3_0 || GLEW_ARB_framebuffer_object;
+    }
+
+    // a pixel unpack buffer that stays mapped for writing while the GPU reads
+    // from it (ARB_buffer_storage), so another thread can decode straight
+    // into it. Textures are specified from it with GL_UNPACK_ROW_LENGTH and
+    // GL_UNPACK_SKIP_* for sub-rectangles, without a copy on the CPU.
+    struct MappedBuffer
+    {
+        GLuint buffer;
+        unsigned char *pixels;   // the mapping, NULL if there is none
+        GLsizeiptr size;
+        GLsync fence;            // after the last command reading from it
+
+        MappedBuffer() : buffer(0), pixels(NULL), size(0), fence(0) {}
+
+        static bool isSupported()
+        {
+            return UploadRing::isSupported() && GLEW_ARB_buffer_storage;
+        }
+
+        bool create(const GLsizeiptr bytes)
+        {
+            release();
+            if (!isSupported())
+            {
+                return false;
+            }
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                                     GL_MAP_COHERENT_BIT;
+            glGenBuffers(1, &buffer);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, flags);
+            pixels = (unsigned char *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+                                                       bytes, flags);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            if (!pixels)
+            {
+                release();
+                return false;
+            }
+            size = bytes;
+            return true;
+        }
+
+        void release()
+        {
+            if (fence)
+            {
+                glDeleteSync(fence);
+            }
+            if (buffer)
+            {
+                // deleting a buffer unmaps it
+                glDeleteBuffers(1, &buffer);
+            }
+            buffer = 0;
+            pixels = NULL;
+            size = 0;
+            fence = 0;
+        }
+
+        // call after the last command reading from the buffer
+        void fenceReads()
+        {
+            if (fence)
+            {
+                glDeleteSync(fence);
+            }
+            fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
+
+        // true if the GPU is done reading, the buffer may be written again
+        bool isIdle()
+        {
+            if (!fence)
+            {
+                return true;
+            }
+            const GLenum state = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+            if (state != GL_ALREADY_SIGNALED && state != GL_CONDITION_SATISFIED)
+            {
+                return false;
+            }
+            glDeleteSync(fence);
+            fence = 0;
+            return true;
+        }
+
+        // glTexImage2D of the w x h block at (x,y) of an image with rowLength
+        // RGB pixels per row that starts at the beginning of the buffer
+        void texImage2D(const GLenum target, const GLint level, const GLint rowLength,
+                        const GLint x, const GLint y, const GLsizei w, const GLsizei h) const
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, rowLength);
+            glPixelStorei(GL_UNPACK_SKIP_PIXELS, x);
+            glPixelStorei(GL_UNPACK_SKIP_ROWS, y);
+            glTexImage2D(target, level, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE,
+                         (const GLvoid *)0);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+            glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+    };
+
+} // namespace GLUTIL
+
+#endif
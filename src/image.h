@@ -25,7 +25,7 @@
 
         inline const unsigned int rgb(const int x, const int y)
         {
-           unsigned int offset = (y*W + x) * (BPP/8);
+           const size_t offset = ((size_t)y * W + x) * (BPP/8);
            assert(offset < pdata.size());
            return pdata[offset]|(pdata[offset+1]<<8)|(pdata[offset+2]<<16);
         }
@@ -37,7 +37,7 @@
         inline int chan()  const { return BPP / (sizeof(T)* 8); }
         inline const T *data() const { return &pdata[0]; }
         inline const std::vector<T>& getData() const { return pdata; }
-        inline long long buffersize() const {  return W*H*chan();  }
+        inline long long buffersize() const {  return (long long)W*H*chan();  }
 
         inline std::vector<T>& unsafeData() { return pdata; }
 
@@ -46,7 +46,7 @@
             W = width;
             H = height;
             BPP = bpp;
-            pdata.resize((unsigned)buffersize());
+            pdata.resize((size_t)buffersize());
         }
 
         inline void resize(int width, int height, int channels = 3)
@@ -54,10 +54,24 @@
            W   = width;
            H   = height;
            BPP = channels * (sizeof(T)*8);
-           const unsigned bsize = (unsigned) buffersize();
+           const size_t bsize = (size_t) buffersize();
            pdata.resize(bsize);
         }
 
+        // become a copy of the w x h block at (l,t) of src, row by row
+        inline void copyRegion(const ImageT &src, const int l, const int t,
+                               const int w, const int h)
+        {
+            assert(l >= 0 && t >= 0 && l + w <= src.width() && t + h <= src.height());
+            resize(w, h, src.chan());
+            const size_t rowsize = (size_t)w * src.chan();
+            for (int y = 0; y < h; ++y)
+            {
+                memcpy(&pdata[y * rowsize], &src.pdata[((size_t)(t + y) * src.W + l) * src.chan()],
+                       rowsize * sizeof(T));
+            }
+        }
+
         // blit image
         inline void drawImage(const int l, const int t, const ImageT &img)
         {
@@ -85,28 +99,70 @@
         {
             if(x>=0 && x<W && y>=0 && y<H)
             {
-                pdata[(y * W + x) * BPP / (sizeof(T)*8) + ch] = value;
+                pdata[((size_t)y * W + x) * chan() + ch] = value;
             }
         }
 
         inline T &operator()(int x, int y, int ch = 0) 
         { 
             assert(x >= 0 && x<(int)W && y >= 0 && y<(int)H);
-            return pdata[(y * W + x) * BPP / (sizeof(T)*8) + ch];
+            return pdata[((size_t)y * W + x) * chan() + ch];
         }
 
         inline const T &operator()(int x, int y, int ch = 0) const 
         { 
             assert(x >= 0 && x<(int)W && y >= 0 && y<(int)H);
-            return pdata[(y * W + x) * BPP / (sizeof(T)*8) + ch];
+            return pdata[((size_t)y * W + x) * chan() + ch];
         }
         void clear(T value = 0) 
         {
-            memset(&pdata[0], value, W*H*BPP/(sizeof(T)*8));
+            memset(&pdata[0], value, (size_t)W*H*chan());
         }
     };
 
     typedef ImageT<unsigned char> Image;
     typedef ImageT<float> ImageF;
 
+  // image in memory owned by someone else, e.g. a mapped pixel buffer, for
+  // decoders that write into an image. resize() only sets the size, which
+  // has to fit into the memory.
+  template <class T>
+    struct ImageViewT
+    {
+    protected:
+        T *pdata;
+        size_t capacity;   // in elements
+        unsigned int W;
+        unsigned int H;
+        unsigned int BPP;
+    public:
+
+        ImageViewT(T *data, const size_t size) : pdata(data), capacity(size), W(0), H(0), BPP(0)
+        {
+        }
+
+        inline bool isValid()  const { return W != 0 && H != 0 && BPP != 0; }
+        inline int width()     const { return W;   }
+        inline int height()    const { return H;   }
+        inline int bpp()       const { return BPP; }
+        inline int chan()  const { return BPP / (sizeof(T)* 8); }
+        inline T *data() { return pdata; }
+
+        inline void resize(int width, int height, int channels = 3)
+        {
+            assert((size_t)width * height * channels <= capacity);
+            W   = width;
+            H   = height;
+            BPP = channels * (sizeof(T)*8);
+        }
+
+        inline T &operator()(int x, int y, int ch = 0)
+        {
+            assert(x >= 0 && x<(int)W && y >= 0 && y<(int)H);
+            return pdata[((size_t)y * W + x) * chan() + ch];
+        }
+    };
+
+    typedef ImageViewT<unsigned char> ImageView;
+
 #endif
@@ -4,8 +4,14 @@
 // wrapper for jpeglib
 //  Ulrich Krispel        uli@krispel.net
 
+#include <cstdio>
+#include <csetjmp>
 #include "image.h"
 #include "jpeglib.h"
+#include "jpgstream.h"
+#include "jpgindex.h"
+#include "mappedfile.h"
+#include "parallel.h"
 
 #include <map>
 #include <string>
@@ -15,32 +21,286 @@
 
 namespace IMG
 {
+    // libjpeg error handling for decoders that report failure instead of
+    // ending the process: errors jump back to setjmp(jump), which has to be
+    // called after jpeg_create_decompress, and warnings about corrupt data
+    // (libjpeg fills the rest of the rows with grey) are counted. Buffers
+    // that change after setjmp come from libjpeg's pools, so that the jump
+    // skips no destructors.
+    struct JPEGErrors
+    {
+        struct jpeg_error_mgr pub;   // cinfo.err = &pub
+        jmp_buf jump;
+
+        JPEGErrors()
+        {
+            jpeg_std_error(&pub);
+            pub.error_exit = &exitDecoder;
+        }
+
+        // the decoded pixels are not those of the file
+        inline bool damaged() const { return pub.num_warnings > 0; }
+
+    private:
+        JPEGErrors(const JPEGErrors &);
+        JPEGErrors &operator=(const JPEGErrors &);
+
+        static void exitDecoder(j_common_ptr cinfo)
+        {
+            (*cinfo->err->output_message)(cinfo);
+            longjmp(reinterpret_cast<JPEGErrors *>(cinfo->err)->jump, 1);
+        }
+    };
+
+    // prepare src with a stream for MCU rows [row0,rowEnd) of a JPEG with
+    // restart markers, row0 has to start at a restart interval whose index
+    // is a multiple of 8, so that the first marker inside is RST0 again.
+    // libjpeg reads the original header with patched image height, the
+    // entropy coded data of the rows and EOI. height has to stay valid
+    // while src is in use. Returns the first pixel row.
+    inline int restartRowsSource(const unsigned char *data, const STREAM::Layout &L,
+                                 const std::vector<size_t> &rst, const size_t scanEnd,
+                                 const int row0, const int rowEnd,
+                                 unsigned char height[2], STREAM::ChunkSource &src)
+    {
+        const long long Ri = L.restartInterval;
+        const long long numIntervals = ((long long)L.mcusPerRow * L.mcuRows + Ri - 1) / Ri;
+        const long long i0 = (long long)row0 * L.mcusPerRow / Ri;
+        const long long i1 = ((long long)rowEnd * L.mcusPerRow + Ri - 1) / Ri;
+        const size_t start = (i0 == 0) ? L.scanStart : rst[i0 - 1] + 2;
+        const size_t end = (i1 >= numIntervals) ? scanEnd : rst[i1 - 1];
+
+        const int y0 = row0 * L.mcuHeight;
+        const int yEnd = std::min(rowEnd * L.mcuHeight, L.height);
+        height[0] = (unsigned char)((yEnd - y0) >> 8);
+        height[1] = (unsigned char)((yEnd - y0) & 0xFF);
+        static const unsigned char EOI[2] = { 0xFF, STREAM::EOI };
+
+        // SOF: FF Cx Lh Ll P Yh Yl Xh Xl ...
+        src.add(data, L.sofOffset + 5);
+        src.add(height, 2);
+        src.add(data + L.sofOffset + 7, L.scanStart - L.sofOffset - 7);
+        src.add(data + start, end - start);
+        src.add(EOI, 2);
+        return y0;
+    }
+
+    // decode the band in src, which starts at MCU row row0 (pixel row y0),
+    // into the rows of img that belong to MCU rows [row0,row1).
+    // Fancy upsampling of subsampled chroma needs the neighbouring rows, so
+    // a band decodes one MCU row past its end and writes the first pixel row
+    // of the next band, while its own first pixel row is left to the band
+    // before. This makes the result identical to a sequential decode.
+    // False if the data of the band is damaged.
     template <class IMGTYPE>
-    bool loadJPEG(const char *fname, IMGTYPE &img)
+    bool decodeBand(STREAM::ChunkSource &src, const STREAM::Layout &L, const int y0,
+                    const int row0, const int row1, IMGTYPE &img, const int scale)
     {
         struct jpeg_decompress_struct cinfo;
-        struct jpeg_error_mgr jerr;
-
-        cinfo.err = jpeg_std_error(&jerr);
+        JPEGErrors errors;
+        cinfo.err = &errors.pub;
         jpeg_create_decompress(&cinfo);
+        if (setjmp(errors.jump))
+        {
+            jpeg_destroy_decompress(&cinfo);
+            return false;
+        }
+        src.attach(&cinfo);
+        jpeg_read_header(&cinfo, TRUE);
+        cinfo.scale_num = 1;
+        cinfo.scale_denom = scale;
+        jpeg_start_decompress(&cinfo);
+
+        // output rows, MCU rows are a multiple of 8 pixels so they scale exactly
+        const int oy0 = y0 / scale;
+        const int oy1 = (row1 >= L.mcuRows) ? img.height() : row1 * L.mcuHeight / scale;
+
+        // rows owned by other bands go to a scratch row
+        JSAMPARRAY scratch = (*cinfo.mem->alloc_sarray)(
+            (j_common_ptr)&cinfo, JPOOL_IMAGE, cinfo.output_width * cinfo.output_components, 1);
+        JSAMPARRAY rowptr = (JSAMPARRAY)(*cinfo.mem->alloc_large)(
+            (j_common_ptr)&cinfo, JPOOL_IMAGE, cinfo.output_height * sizeof(JSAMPROW));
+        for (unsigned int i = 0; i < cinfo.output_height; ++i)
+        {
+            const int y = oy0 + i;
+            const bool own = (y > oy0 || row0 == 0) &&
+                             (y < oy1 || (y == oy1 && oy1 < img.height()));
+            rowptr[i] = own ? (&img(0, y)) : scratch[0];
+        }
+        while (cinfo.output_scanline < cinfo.output_height)
+        {
+            jpeg_read_scanlines(&cinfo, &rowptr[cinfo.output_scanline],
+                                cinfo.output_height - cinfo.output_scanline);
+        }
+        // the extension may end inside a restart interval, so the stream is
+        // not finished regularly to avoid warnings about extraneous data
+        jpeg_destroy_decompress(&cinfo);
+        return !errors.damaged();
+    }
 
-        FILE *infile = fopen(fname, "rb");
+    // decode MCU rows [row0,row1) of a JPEG with restart markers into the
+    // corresponding rows of img, see restartRowsSource and decodeBand
+    template <class IMGTYPE>
+    bool decodeRestartBand(const unsigned char *data, const STREAM::Layout &L,
+                           const std::vector<size_t> &rst, const size_t scanEnd,
+                           const int row0, const int row1, IMGTYPE &img,
+                           const int scale = 1)
+    {
+        const int rowEnd = std::min(row1 + 1, L.mcuRows);
+        unsigned char bandHeight[2];
+        STREAM::ChunkSource src;
+        const int y0 = restartRowsSource(data, L, rst, scanEnd, row0, rowEnd, bandHeight, src);
+        return y0 >= 0 && decodeBand(src, L, y0, row0, row1, img, scale);
+    }
+
+    // decode MCU rows [row0,row1) of an indexed JPEG into the corresponding
+    // rows of img, see JIDX::indexRowsSource and decodeBand
+    template <class IMGTYPE>
+    bool decodeIndexedBand(const unsigned char *data, const STREAM::Layout &L,
+                           const JIDX::Index &index, const int row0, const int row1,
+                           IMGTYPE &img, const int scale = 1)
+    {
+        const int rowEnd = std::min(row1 + 1, L.mcuRows);
+        JIDX::RowsStream buf;
+        STREAM::ChunkSource src;
+        const int y0 = JIDX::indexRowsSource(data, L, index, row0, rowEnd, buf, src);
+        return y0 >= 0 && decodeBand(src, L, y0, row0, row1, img, scale);
+    }
 
-        if (infile == NULL || ferror(infile)) 
+    // first MCU row of up to maxBands bands of whole units of unitRows rows,
+    // plus the end row. Empty if there would be less than two bands.
+    inline std::vector<int> splitBands(const int mcuRows, const long long unitRows,
+                                       const int maxBands)
+    {
+        std::vector<int> bands;
+        const long long numUnits = (mcuRows + unitRows - 1) / unitRows;
+        if (numUnits < 2 || maxBands < 2)
+        {
+            return bands;
+        }
+        const long long numBands = std::min<long long>(numUnits, maxBands);
+        for (long long i = 0; i < numBands; ++i)
+        {
+            bands.push_back((int)std::min<long long>(i * numUnits / numBands * unitRows, mcuRows));
+        }
+        bands.push_back(mcuRows);
+        return bands;
+    }
+
+    // true if the entropy coded data of a JPEG can be cut at its restart
+    // markers, rst has to hold the offsets of all markers
+    inline bool canSplitAtRestarts(const STREAM::Layout &L, const std::vector<size_t> &rst)
+    {
+        if (!L.valid || L.progressive || L.arithmetic || L.restartInterval == 0 ||
+            L.scanComponents != L.numComponents || L.numComponents != 3)
         {
-            fprintf(stderr, "can't open %s\n", fname);
             return false;
         }
-        jpeg_stdio_src(&cinfo, infile);
+        const long long Ri = L.restartInterval;
+        const long long numIntervals = ((long long)L.mcusPerRow * L.mcuRows + Ri - 1) / Ri;
+        return (long long)rst.size() == numIntervals - 1;
+    }
+
+    // smallest number of MCU rows a split stream can start at: the start
+    // has to be on a MCU row and on every 8th restart interval
+    inline int restartUnitRows(const STREAM::Layout &L)
+    {
+        const long long Ri = L.restartInterval;
+        long long a = L.mcusPerRow, b = 8 * Ri;
+        while (b != 0) { const long long t = a % b; a = b; b = t; }
+        return (int)std::min<long long>(8 * Ri / a, L.mcuRows);   // lcm / mcusPerRow
+    }
+
+    // split a JPEG with restart markers into bands that can be decoded
+    // independently. Returns the first MCU row of every band plus the end
+    // row, or an empty vector if the stream does not allow parallel decoding.
+    inline std::vector<int> restartBands(const STREAM::Layout &L,
+                                         const std::vector<size_t> &rst,
+                                         const int maxBands)
+    {
+        if (!canSplitAtRestarts(L, rst))
+        {
+            return std::vector<int>();
+        }
+        return splitBands(L.mcuRows, restartUnitRows(L), maxBands);
+    }
+
+    // decode a JPEG held in memory. If the file has restart markers, the
+    // entropy coded data is split at restart boundaries and horizontal bands
+    // are decoded on all cores, otherwise it is decoded on a single thread.
+    // A JPEG without restart markers is split the same way at MCU rows if
+    // an index of it is given, see jpgindex.h.
+    // threads: 0 = use all cores, 1 = force the single threaded decoder
+    // scale: 1, 2, 4 or 8, decode at 1/scale of the size by DCT scaling
+    // False if the file can not be decoded or its data is damaged.
+    template <class IMGTYPE>
+    bool loadJPEG(const unsigned char *data, const size_t size, IMGTYPE &img,
+                  unsigned int threads = 0, const int scale = 1,
+                  const JIDX::Index *index = NULL)
+    {
+        if (threads == 0) threads = PARALLEL::numThreads();
+
+        STREAM::Layout L;
+        if (threads > 1 && index && STREAM::parseLayout(data, size, L) &&
+            JIDX::matches(*index, L))
+        {
+            const std::vector<int> bands = splitBands(L.mcuRows, 1, 4 * threads);
+            if (!bands.empty())
+            {
+                img.resize((L.width + scale - 1) / scale, (L.height + scale - 1) / scale);
+                std::atomic<bool> ok(true);
+                PARALLEL::forEach((int)bands.size() - 1, [&](int b)
+                {
+                    if (!decodeIndexedBand(data, L, *index, bands[b], bands[b + 1], img, scale))
+                        ok = false;
+                }, threads);
+                return ok;
+            }
+        }
+        else if (threads > 1 && STREAM::parseLayout(data, size, L) && L.restartInterval > 0)
+        {
+            std::vector<size_t> rst;
+            const size_t scanEnd = STREAM::findRestartMarkers(data, size, L.scanStart, rst);
+            // some more bands than threads to balance uneven content
+            const std::vector<int> bands = (scanEnd + 1 < size && data[scanEnd + 1] == STREAM::EOI)
+                ? restartBands(L, rst, 4 * threads) : std::vector<int>();
+            if (!bands.empty())
+            {
+                img.resize((L.width + scale - 1) / scale, (L.height + scale - 1) / scale);
+                std::atomic<bool> ok(true);
+                PARALLEL::forEach((int)bands.size() - 1, [&](int b)
+                {
+                    if (!decodeRestartBand(data, L, rst, scanEnd, bands[b], bands[b + 1], img, scale))
+                        ok = false;
+                }, threads);
+                return ok;
+            }
+        }
+
+        struct jpeg_decompress_struct cinfo;
+        JPEGErrors errors;
+
+        cinfo.err = &errors.pub;
+        jpeg_create_decompress(&cinfo);
+        if (setjmp(errors.jump))
+        {
+            jpeg_destroy_decompress(&cinfo);
+            return false;
+        }
+
+        jpeg_mem_src(&cinfo, (unsigned char *)data, (unsigned long)size);
         jpeg_read_header(&cinfo, TRUE);
+        cinfo.scale_num = 1;
+        cinfo.scale_denom = scale;
+        jpeg_start_decompress(&cinfo);
 
         // assume RGB
-        img.resize(cinfo.image_width, cinfo.image_height);
-        jpeg_start_decompress(&cinfo);
+        img.resize(cinfo.output_width, cinfo.output_height);
 
-        // create vector with scanline start ptrs
-        std::vector<JSAMPROW> rowptr(cinfo.image_height);
-        for (unsigned int i=0; i<cinfo.image_height; ++i) 
+        // scanline start ptrs
+        JSAMPARRAY rowptr = (JSAMPARRAY)(*cinfo.mem->alloc_large)(
+            (j_common_ptr)&cinfo, JPOOL_IMAGE, cinfo.output_height * sizeof(JSAMPROW));
+        for (unsigned int i=0; i<cinfo.output_height; ++i) 
         { 
             rowptr[i]=( &img(0,i) ); //     &m_data[i * cinfo.image_width * m_channels]
         }
@@ -53,10 +313,284 @@ namespace IMG
     
         jpeg_finish_decompress(&cinfo);
         jpeg_destroy_decompress(&cinfo);
-        fclose(infile);
 
-        return true;
-   }
+        return !errors.damaged();
+    }
+
+    template <class IMGTYPE>
+    bool loadJPEG(const char *fname, IMGTYPE &img, const unsigned int threads = 0,
+                  const int scale = 1, const JIDX::Index *index = NULL)
+    {
+        MappedFile file;
+        if (!file.open(fname))
+        {
+            return false;
+        }
+        return loadJPEG(file.data(), file.size(), img, threads, scale, index);
+    }
+
+    // incremental decoder: the image is read band by band, so the
+    // caller never needs to hold the whole decoded image in memory
+    class JPEGReader
+    {
+        struct jpeg_decompress_struct cinfo;
+        struct jpeg_error_mgr jerr;
+        MappedFile file;   // compressed file content if opened by name
+        bool isOpen;
+        int W, H, next;
+
+        JPEGReader(const JPEGReader &);
+        JPEGReader &operator=(const JPEGReader &);
+
+        bool start(const unsigned char *data, const size_t size)
+        {
+            jpeg_mem_src(&cinfo, (unsigned char *)data, (unsigned long)size);
+            jpeg_read_header(&cinfo, TRUE);
+            jpeg_start_decompress(&cinfo);
+            W = cinfo.output_width;
+            H = cinfo.output_height;
+            next = 0;
+            isOpen = true;
+            return true;
+        }
+    public:
+        JPEGReader() : isOpen(false), W(0), H(0), next(0)
+        {
+            cinfo.err = jpeg_std_error(&jerr);
+            jpeg_create_decompress(&cinfo);
+        }
+        ~JPEGReader()
+        {
+            close();
+            jpeg_destroy_decompress(&cinfo);
+        }
+
+        bool open(const char *fname)
+        {
+            close();
+            if (!file.open(fname))
+            {
+                return false;
+            }
+            return start(file.data(), file.size());
+        }
+
+        // decode from memory owned by the caller, it has to stay valid
+        // until all rows are read or the reader is closed
+        bool open(const unsigned char *data, const size_t size)
+        {
+            close();
+            return start(data, size);
+        }
+
+        void close()
+        {
+            if (isOpen)
+            {
+                jpeg_abort_decompress(&cinfo);
+                isOpen = false;
+            }
+            file.close();
+        }
+
+        inline int width()   const { return W; }
+        inline int height()  const { return H; }
+        // index of the next row that will be decoded
+        inline int nextRow() const { return next; }
+
+        // decode the next rows into img, which is resized to width x rows
+        // (less at the end of the image). Returns the number of rows read.
+        template <class IMGTYPE>
+        int readRows(IMGTYPE &img, int rows)
+        {
+            if (!isOpen) return 0;
+            rows = std::min(rows, height() - nextRow());
+            if (rows <= 0) return 0;
+            img.resize(width(), rows);
+            std::vector<JSAMPROW> rowptr(rows);
+            for (int i = 0; i < rows; ++i)
+            {
+                rowptr[i] = (&img(0, i));
+            }
+            int read = 0;
+            while (read < rows)
+            {
+                read += jpeg_read_scanlines(&cinfo, &rowptr[read], rows - read);
+            }
+            next += read;
+            if (next == H)
+            {
+                // done, release the compressed data early
+                jpeg_finish_decompress(&cinfo);
+                isOpen = false;
+                file.close();
+            }
+            return read;
+        }
+    };
+
+    // random access to pixel rectangles of a JPEG held in memory. If the
+    // stream can be split at restart markers or an index of it is given, only
+    // the MCU rows around the rectangle are decoded, otherwise decoding
+    // starts at the top and the rows above are skipped. With libjpeg-turbo decoding is also limited
+    // to the iMCU columns of the rectangle (jpeg_crop_scanline) and skipped
+    // rows bypass IDCT and color conversion (jpeg_skip_scanlines).
+    // read() does not change the reader and may be called from several threads.
+    class JPEGRegionReader
+    {
+        const unsigned char *m_data;
+        size_t m_size;
+        STREAM::Layout L;
+        std::vector<size_t> m_rst;
+        size_t m_scanEnd;
+        int m_unitRows;   // split granularity in MCU rows, 0 if none
+        JIDX::Index m_index;   // used if there are no restart markers
+
+    public:
+        JPEGRegionReader() : m_data(NULL), m_size(0), m_scanEnd(0), m_unitRows(0) {}
+
+        // the data has to stay valid while the reader is used, the index
+        // is copied
+        bool open(const unsigned char *data, const size_t size,
+                  const JIDX::Index *index = NULL)
+        {
+            m_data = NULL;
+            m_rst.clear();
+            m_unitRows = 0;
+            m_index = JIDX::Index();
+            if (!STREAM::parseLayout(data, size, L))
+            {
+                return false;
+            }
+            if (L.restartInterval > 0)
+            {
+                m_scanEnd = STREAM::findRestartMarkers(data, size, L.scanStart, m_rst);
+                if (m_scanEnd + 1 < size && data[m_scanEnd + 1] == STREAM::EOI &&
+                    canSplitAtRestarts(L, m_rst))
+                {
+                    m_unitRows = restartUnitRows(L);
+                }
+            }
+            else if (index && JIDX::matches(*index, L))
+            {
+                m_index = *index;
+                m_unitRows = 1;
+            }
+            m_data = data;
+            m_size = size;
+            return true;
+        }
+
+        inline bool isOpen() const { return m_data != NULL; }
+        inline int width()   const { return L.width; }
+        inline int height()  const { return L.height; }
+        // true if reading a rectangle does not decode the rows above it
+        inline bool hasRandomAccess() const { return m_unitRows > 0; }
+        // true if only the columns of a rectangle are decoded
+        static inline bool cropsColumns()
+        {
+#ifdef LIBJPEG_TURBO_VERSION
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        // decode the rectangle (x,y,w,h), clipped to the image, into img,
+        // false if its data is damaged
+        template <class IMGTYPE>
+        bool read(int x, int y, int w, int h, IMGTYPE &img) const
+        {
+            const int x1 = std::min(x + w, L.width), y1 = std::min(y + h, L.height);
+            x = std::max(x, 0);
+            y = std::max(y, 0);
+            if (m_data == NULL || x >= x1 || y >= y1)
+            {
+                return false;
+            }
+            w = x1 - x;
+            h = y1 - y;
+            img.resize(w, h);
+
+            STREAM::ChunkSource src;
+            unsigned char bandHeight[2];
+            JIDX::RowsStream indexed;
+            struct jpeg_decompress_struct cinfo;
+            JPEGErrors errors;
+            cinfo.err = &errors.pub;
+            jpeg_create_decompress(&cinfo);
+            if (setjmp(errors.jump))
+            {
+                jpeg_destroy_decompress(&cinfo);
+                return false;
+            }
+            int firstRow = 0;   // image row of the first decoded row
+            if (m_unitRows > 0)
+            {
+                // like decodeRestartBand: start above y and end one MCU row
+                // below the rectangle, so that the chroma upsampling of all
+                // rows inside sees the same neighbours as a full decode
+                const int above = (y == 0) ? 0 : (y - 1) / L.mcuHeight;
+                const int row0 = above / m_unitRows * m_unitRows;
+                const int rowEnd = std::min((y1 - 1) / L.mcuHeight + 2, L.mcuRows);
+                firstRow = m_index.isValid()
+                    ? JIDX::indexRowsSource(m_data, L, m_index, row0, rowEnd, indexed, src)
+                    : restartRowsSource(m_data, L, m_rst, m_scanEnd, row0, rowEnd,
+                                        bandHeight, src);
+                if (firstRow < 0)
+                {
+                    jpeg_destroy_decompress(&cinfo);
+                    return false;
+                }
+                src.attach(&cinfo);
+            }
+            else
+            {
+                jpeg_mem_src(&cinfo, (unsigned char *)m_data, (unsigned long)m_size);
+            }
+            jpeg_read_header(&cinfo, TRUE);
+            jpeg_start_decompress(&cinfo);
+
+            JDIMENSION cropX = 0, cropW = cinfo.output_width;
+            JDIMENSION skip = y - firstRow;
+#ifdef LIBJPEG_TURBO_VERSION
+            // one MCU more on each side keeps the horizontal upsampling
+            // context, libjpeg-turbo widens the crop to iMCU boundaries
+            cropX = std::max(x - L.mcuWidth, 0);
+            cropW = std::min(x1 + L.mcuWidth, L.width) - cropX;
+            jpeg_crop_scanline(&cinfo, &cropX, &cropW);
+            skip -= jpeg_skip_scanlines(&cinfo, skip);
+#endif
+            JSAMPROW rowptr = (*cinfo.mem->alloc_sarray)(
+                (j_common_ptr)&cinfo, JPOOL_IMAGE, cropW * cinfo.output_components, 1)[0];
+            while (skip > 0)
+            {
+                skip -= jpeg_read_scanlines(&cinfo, &rowptr, 1);
+            }
+            const size_t offset = (size_t)(x - cropX) * cinfo.output_components;
+            const size_t rowbytes = (size_t)w * cinfo.output_components;
+            for (int i = 0; i < h; )
+            {
+                if (jpeg_read_scanlines(&cinfo, &rowptr, 1) == 1)
+                {
+                    memcpy(&img(0, i++), rowptr + offset, rowbytes);
+                }
+            }
+            // the rows below are not needed
+            jpeg_destroy_decompress(&cinfo);
+            return !errors.damaged();
+        }
+    };
+
+    // decode the rectangle (x,y,w,h) of a JPEG held in memory into img
+    template <class IMGTYPE>
+    bool loadJPEGRegion(const unsigned char *data, const size_t size,
+                        const int x, const int y, const int w, const int h,
+                        IMGTYPE &img)
+    {
+        JPEGRegionReader reader;
+        return reader.open(data, size) && reader.read(x, y, w, h, img);
+    }
 
 
     template <class IMGTYPE>
@@ -68,27 +602,27 @@ namespace IMG
         JSAMPROW row_pointer[1];
         int row_stride;
 
-        cinfo.err = jpeg_std_error(&jerr);
-        jpeg_create_compress(&cinfo);
-
         if ((outfile = fopen(fname, "wb")) == NULL) {
             fprintf(stderr, "error opening file %s for writing\n", fname);
             return false;
         }
+
+        cinfo.err = jpeg_std_error(&jerr);
+        jpeg_create_compress(&cinfo);
         jpeg_stdio_dest(&cinfo, outfile);
 
         cinfo.image_width = img.width();
         cinfo.image_height = img.height();
-        cinfo.input_components = img.channels();
-        cinfo.in_color_space = img.channels() == 3 ? JCS_RGB : JCS_GRAYSCALE;
+        cinfo.input_components = img.chan();
+        cinfo.in_color_space = img.chan() == 3 ? JCS_RGB : JCS_GRAYSCALE;
 
         jpeg_set_defaults(&cinfo);
         jpeg_set_quality(&cinfo, quality, TRUE);
         jpeg_start_compress(&cinfo, TRUE);
 
-        row_stride = img.width() * img.channels();
+        row_stride = img.width() * img.chan();
         while (cinfo.next_scanline < cinfo.image_height) {
-            row_pointer[0] = (JSAMPROW)&img.getData()[cinfo.next_scanline * row_stride];
+            row_pointer[0] = (JSAMPROW)&img.getData()[(size_t)cinfo.next_scanline * row_stride];
             (void)jpeg_write_scanlines(&cinfo, row_pointer, 1);
         }
 
@@ -260,157 +794,174 @@ namespace IMG
         };
 
         
+        // parse EXIF tags from a JPEG file held in memory, all reads are
+        // done on the byte span, offsets are relative to the TIFF header
         template <typename RESULT>
-        RESULT parseExif(const std::string &filename) 
+        RESULT parseExif(const unsigned char *data, const size_t size)
         {
-            std::streamoff EXIFSTART;
+            size_t EXIFSTART = 0;
             RESULT result;
-            bool BE;
+            bool BE = false;
+
+            if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+                return result;
 
-            Marker marker;
-            std::ifstream infile(filename.c_str(), std::ios::binary | std::ios::in);
-            //long long offset = 0;
-            if (infile.is_open())
+            // true if n bytes at offset (relative to EXIFSTART) are inside the data
+            auto inside = [&EXIFSTART, size](size_t off, size_t n)
             {
-                unsigned char FFD8[2];
-                infile.read((char *)FFD8, 2);
-                
-                if (FFD8[0] != 0xFF || FFD8[1] != 0xD8)
-                    return result;
+                return off <= size && n <= size && EXIFSTART + off + n <= size;
+            };
 
-                auto insertTag = [&result,&BE,&infile,&EXIFSTART](const IFDEntry &e)
+            auto insertTag = [&result,&BE,&inside,&EXIFSTART,data](const IFDEntry &e)
+            {
+                std::ostringstream os;
+                switch (e.format.value(BE))
                 {
-                    std::ostringstream os;
-                    switch (e.format.value(BE))
-                    {
-                    case UnsignedByte:
-                        os << (unsigned char)e.data.value(BE);
-                        result[e.tag.value(BE)] = os.str();
-                        break;
-                    case AsciiStrings:
-                    {
-                        std::streamoff cur = infile.tellg();
-                        int ifdoff = e.data.value(BE);
-                        infile.seekg(EXIFSTART + ifdoff);
-                        std::vector<char> thestring(e.numcomponents.value(BE)+1);
-                        infile.read((char *)&thestring[0], e.numcomponents.value(BE));
-                        thestring.at(e.numcomponents.value(BE)) = 0;
-                        result[e.tag.value(BE)] = std::string(&thestring[0]);
-                        infile.seekg(cur);
-                    }
-                        break;
-                    case UnsignedShort:
-                        os << (unsigned short)e.data.value(BE);
-                        result[e.tag.value(BE)] = os.str();
-                        break;
-                    case UnsignedLong:
-                        os << (unsigned long)e.data.value(BE);
-                        result[e.tag.value(BE)] = os.str();
-                        break;
-                    case UnsignedRational:
-                        break;
-                    case SignedByte:
-                        os << (char)e.data.value(BE);
-                        result[e.tag.value(BE)] = os.str();
+                case UnsignedByte:
+                    os << (unsigned char)e.data.value(BE);
+                    result[e.tag.value(BE)] = os.str();
+                    break;
+                case AsciiStrings:
+                {
+                    // up to 4 characters are stored in the value itself
+                    const size_t len = e.numcomponents.value(BE);
+                    const size_t ifdoff = e.data.value(BE);
+                    const char *str = (len <= 4) ? (const char *)&e.data
+                                                 : (const char *)&data[EXIFSTART + ifdoff];
+                    if (len > 4 && !inside(ifdoff, len))
                         break;
-                    case Undefined:
+                    result[e.tag.value(BE)] = std::string(str, strnlen(str, len));
+                }
+                    break;
+                case UnsignedShort:
+                    os << (unsigned short)e.data.value(BE);
+                    result[e.tag.value(BE)] = os.str();
+                    break;
+                case UnsignedLong:
+                    os << (unsigned long)e.data.value(BE);
+                    result[e.tag.value(BE)] = os.str();
+                    break;
+                case UnsignedRational:
+                    break;
+                case SignedByte:
+                    os << (char)e.data.value(BE);
+                    result[e.tag.value(BE)] = os.str();
+                    break;
+                case Undefined:
+                {
+                    if (e.tag.value(BE) == 0x9286)  // parse UserComment
                     {
-                        if (e.tag.value(BE) == 0x9286)  // parse UserComment
-                        {
-                            std::streamoff cur = infile.tellg();
-                            int ifdoff = e.data.value(BE);
-                            infile.seekg(EXIFSTART + ifdoff);
-                            char format[8];
-                            infile.read(format, 8);
-                            int stsize = e.numcomponents.value(BE);
-                            assert(stsize > 8);
-                            // assume ascii
-                            std::vector<char> thestring(stsize + 1 - 8);
-                            infile.read((char *)&thestring[0], stsize -8);
-                            thestring.at(e.numcomponents.value(BE)-8) = 0;
-                            result[e.tag.value(BE)] = std::string(&thestring[0]);
-                            infile.seekg(cur);
-                        }
+                        // 8 bytes character code, assume ascii
+                        const size_t stsize = e.numcomponents.value(BE);
+                        const size_t ifdoff = e.data.value(BE);
+                        if (stsize <= 8 || !inside(ifdoff, stsize))
+                            break;
+                        const char *str = (const char *)&data[EXIFSTART + ifdoff + 8];
+                        result[e.tag.value(BE)] = std::string(str, strnlen(str, stsize - 8));
                     }
-                        break;
-                    case SignedShort:
-                        os << (short)e.data.value(BE);
-                        break;
-                    case SignedLong:
-                        os << (long)e.data.value(BE);
-                        break;
-                    case SingleFloat:
-                        os << (float)e.data.value(BE);
-                        break;
-                    case DoubleFloat:
-                        os << (double)e.data.value(BE);
-                        break;
-                    default:
-                        std::cout << "[EXIF ERROR] unknown format value" << std::endl;
-                    }
-                };
-
+                }
+                    break;
+                case SignedShort:
+                    os << (short)e.data.value(BE);
+                    break;
+                case SignedLong:
+                    os << (long)e.data.value(BE);
+                    break;
+                case SingleFloat:
+                    os << (float)e.data.value(BE);
+                    break;
+                case DoubleFloat:
+                    os << (double)e.data.value(BE);
+                    break;
+                default:
+                    std::cout << "[EXIF ERROR] unknown format value" << std::endl;
+                }
+            };
 
-                std::function<void(void)> readDirectory = [&infile, &BE, &readDirectory, &insertTag, &EXIFSTART]()
+            std::function<void(size_t, int)> readDirectory =
+                [&BE, &readDirectory, &insertTag, &inside, &EXIFSTART, data](size_t offset, int depth)
+            {
+                if (depth > 4 || !inside(offset, 2))
+                    return;
+                const int numEntries = reinterpret_cast<const SHORT *>(&data[EXIFSTART + offset])->value(BE);
+                //std::cout << "Number of IFD entries:" << numEntries << std::endl;
+                if (!inside(offset + 2, numEntries * sizeof(IFDEntry)))
+                    return;
+                const IFDEntry *IFDDirectory = reinterpret_cast<const IFDEntry *>(&data[EXIFSTART + offset + 2]);
+                for (int n = 0; n < numEntries; ++n)
                 {
-                    SHORT entries;
-                    infile.read((char *)&entries, 2);
-                    const int numEntries = entries.value(BE);
-                    //std::cout << "Number of IFD entries:" << numEntries << std::endl;
-                    std::vector<IFDEntry> IFDDirectory;
-                    IFDDirectory.resize(numEntries);
-                    infile.read((char *)&IFDDirectory[0], numEntries * 12);
-                    //int n = 0;
-                    for (const IFDEntry &e : IFDDirectory)
-                    {
-                        //std::cout << n++ << " : TAG:" << e.tag.value(BE)
-                        //          << " FORMAT:" << e.format.value(BE)
-                        //          << " NUMCOMPONENTS:" << e.numcomponents.value(BE)
-                        //          << " VALUE:" << e.data.value(BE) << std::endl;
-
-                        if (e.tag.value(BE) == ExifIFDPointer)  // sub IFD
-                        {
-                            int ifdoff = e.data.value(BE);
-                            infile.seekg(EXIFSTART + ifdoff);
-                            readDirectory();
-                        }
-                        else
-                        {
-                            insertTag(e);
-                        }
-                    }
-                };
+                    const IFDEntry &e = IFDDirectory[n];
+                    //std::cout << n << " : TAG:" << e.tag.value(BE)
+                    //          << " FORMAT:" << e.format.value(BE)
+                    //          << " NUMCOMPONENTS:" << e.numcomponents.value(BE)
+                    //          << " VALUE:" << e.data.value(BE) << std::endl;
 
-                while (!infile.eof()) {
-                    infile.read((char *)&marker, sizeof(Marker));
-                    if (marker.FF != 0xFF)
+                    if (e.tag.value(BE) == ExifIFDPointer)  // sub IFD
                     {
-                        result.clear();
-                        return result;
+                        readDirectory(e.data.value(BE), depth + 1);
                     }
-                    //assert(marker.FF == 0xFF);
-                    //std::cout << "Marker: " << std::hex << (int)marker.FF << ":" << (int)marker.type << " size:" << marker.size.value(true) << std::endl;
-                    if (marker.type == 0xE1)
+                    else
                     {
-                        //std::cout << "EXIF header found:" << std::endl;
+                        insertTag(e);
+                    }
+                }
+            };
+
+            size_t pos = 2;
+            while (pos + sizeof(Marker) <= size) {
+                const Marker &marker = *reinterpret_cast<const Marker *>(&data[pos]);
+                if (marker.FF != 0xFF)
+                {
+                    result.clear();
+                    return result;
+                }
+                //std::cout << "Marker: " << std::hex << (int)marker.FF << ":" << (int)marker.type << " size:" << marker.size.value(true) << std::endl;
+                if (marker.type == 0xDA)
+                {
+                    // start of scan, no EXIF data in this file
+                    return result;
+                }
+                if (marker.type == 0xE1 && pos + sizeof(Marker) + 14 <= size &&
+                    memcmp(&data[pos + sizeof(Marker)], "Exif\0\0", 6) == 0)
+                {
+                    //std::cout << "EXIF header found:" << std::endl;
 
-                        char exif[6];
-                        char exifheader[8];
-                        infile.read((char *)exif, 6);
-                        EXIFSTART = infile.tellg();
-                        infile.read((char *)exifheader, 8);
-                        BE = exifheader[0] == 0x4D;
+                    // TIFF header: byte order, 42, offset of IFD0
+                    EXIFSTART = pos + sizeof(Marker) + 6;
+                    BE = data[EXIFSTART] == 0x4D;
 
-                        readDirectory();
-                        return result;
-                    }
-                    else {
-                        infile.seekg(marker.size.value(true) - 2, std::ios_base::cur);
-                    }
+                    readDirectory(8, 0);
+                    return result;
                 }
+                pos += 2 + marker.size.value(true);
             }
             return result;
         }
+
+        template <typename RESULT>
+        RESULT parseExif(const std::string &filename)
+        {
+            MappedFile file;
+            if (!file.open(filename.c_str()))
+                return RESULT();
+            return parseExif<RESULT>(file.data(), file.size());
+        }
+
+        // field of view from a hugin style user comment ("FOV: 360 x 180"),
+        // azimuth and elevation are left unchanged if there is none
+        inline bool readFieldOfView(const unsigned char *data, const size_t size,
+                                    double &azimuth, double &elevation)
+        {
+            EXIFTAGS exiftags = parseExif<EXIFTAGS>(data, size);
+            if (exiftags.find(UserComment) == exiftags.end())
+            {
+                return false;
+            }
+            const std::string &UC = exiftags[UserComment];
+            std::string token = UC.substr(UC.find_first_of("FOV") + 4, UC.find_first_of("Ev") - 4);
+            std::sscanf(token.c_str(), "%lf x %lf", &azimuth, &elevation);
+            return true;
+        }
     }
 
 }
@@ -0,0 +1,779 @@
+#ifndef _JPGCOEF_H_
+#define _JPGCOEF_H_
+
+// resident DCT coefficients of a JPEG
+//
+// The entropy decoded coefficients of all blocks are kept in memory, so that
+// any rectangle can be turned into pixels again at 1/1, 1/2, 1/4 or 1/8 scale
+// without Huffman decoding: only the IDCT, upsampling and color conversion
+// are done per request.
+//
+// A block is packed as a 64 bit mask of its nonzero coefficients followed by
+// their quantized values, one byte each or ESCAPE and two bytes for larger
+// ones. For photographic content this is about 0.5 to 1 byte per pixel,
+// where RGB needs 3 and libjpeg's coefficient arrays 3 (4:2:0) to 6 (4:4:4).
+//
+// The scaled IDCT works like libjpeg's: a block gives n x n samples that are
+// the means of the full size IDCT over 8/n x 8/n samples, and subsampled
+// chroma is transformed at a larger size where possible, so it needs no
+// upsampling. Upsampling by two uses the triangle filter of libjpeg's fancy
+// upsampling, and the color conversion uses its fixed point tables. The IDCT
+// is in floating point, so the pixels are not those of libjpeg's integer
+// IDCT: they differ by up to 3 levels for 4:4:4 and 4:2:0 files and up to 4
+// for 4:2:2 and 4:4:0 (measured on the test images, not a proven bound).
+
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+#include "imgjpg.h"
+
+namespace IMG
+{
+namespace COEF
+{
+    // blocks per entry in the offset table of a block row
+    const int GROUP = 32;
+    // marks a value that does not fit in a signed byte
+    const unsigned char ESCAPE = 0x80;
+
+    // packed blocks of one component
+    struct Component
+    {
+        int h, v;                   // sampling factors
+        int blocksW, blocksH;       // size in blocks
+        float quant[DCTSIZE2];      // quantization table, natural order
+        std::vector<unsigned char> data;   // block rows, top to bottom
+        std::vector<size_t> offset;        // of every GROUP-th block of a row
+
+        inline int groups() const { return (blocksW + GROUP - 1) / GROUP; }
+    };
+
+    // packed block rows of one component of a band while loading
+    struct Packed
+    {
+        std::vector<unsigned char> data;
+        std::vector<size_t> offset;
+    };
+
+    inline void packRow(const JBLOCKROW row, const int blocks, Packed &out)
+    {
+        unsigned char buf[8 + 3 * DCTSIZE2];
+        for (int b = 0; b < blocks; ++b)
+        {
+            if (b % GROUP == 0)
+            {
+                out.offset.push_back(out.data.size());
+            }
+            const JCOEF *coef = row[b];
+            uint64_t mask = 0;
+            unsigned char *p = buf + 8;
+            for (int k = 0; k < DCTSIZE2; ++k)
+            {
+                const int value = coef[k];
+                if (value == 0) continue;
+                mask |= (uint64_t)1 << k;
+                if (value >= -127 && value <= 127)
+                {
+                    *p++ = (unsigned char)(value & 0xFF);
+                }
+                else
+                {
+                    *p++ = ESCAPE;
+                    *p++ = (unsigned char)(value & 0xFF);
+                    *p++ = (unsigned char)((value >> 8) & 0xFF);
+                }
+            }
+            for (int i = 0; i < 8; ++i)
+            {
+                buf[i] = (unsigned char)(mask >> (8 * i));
+            }
+            out.data.insert(out.data.end(), buf, p);
+        }
+    }
+
+    inline const unsigned char *readValue(const unsigned char *p, int &value)
+    {
+        value = (signed char)p[0];
+        if (p[0] != ESCAPE)
+        {
+            return p + 1;
+        }
+        value = (short)(p[1] | (p[2] << 8));
+        return p + 3;
+    }
+
+    inline const unsigned char *skipBlock(const unsigned char *p)
+    {
+        uint64_t mask = 0;
+        for (int i = 0; i < 8; ++i) mask |= (uint64_t)p[i] << (8 * i);
+        p += 8;
+        for (; mask != 0; mask &= mask - 1)
+        {
+            p += (*p == ESCAPE) ? 3 : 1;
+        }
+        return p;
+    }
+
+    // IDCT basis for n = 1, 2, 4, 8 outputs: like libjpeg's reduced size
+    // IDCTs each output is the mean of 8/n neighbouring outputs of the full
+    // transform, of(n)[u * 8 + x] = c(u) / 2 * mean cos((2i + 1) u pi / 16)
+    // over i in [x * 8/n, (x + 1) * 8/n), c(0) = 1/sqrt(2).
+    struct Basis
+    {
+        float b[DCTSIZE + 1][DCTSIZE2];
+
+        Basis()
+        {
+            const double PI = 3.14159265358979323846;
+            memset(b, 0, sizeof(b));
+            for (int n = 1; n <= DCTSIZE; n *= 2)
+            {
+                const int k = DCTSIZE / n;
+                for (int u = 0; u < DCTSIZE; ++u)
+                {
+                    const double cu = (u == 0) ? sqrt(0.5) : 1.0;
+                    for (int x = 0; x < n; ++x)
+                    {
+                        double sum = 0.0;
+                        for (int i = x * k; i < (x + 1) * k; ++i)
+                        {
+                            sum += cos((2 * i + 1) * u * PI / 16.0);
+                        }
+                        b[n][u * DCTSIZE + x] = (float)(cu / 2.0 * sum / k);
+                    }
+                }
+            }
+        }
+        inline const float *of(const int n) const { return b[n]; }
+    };
+
+    inline const Basis &basis()
+    {
+        static const Basis B;
+        return B;
+    }
+
+    inline unsigned char clampSample(const float f)
+    {
+        const int i = (int)(f + 128.5f);
+        return (unsigned char)(i < 0 ? 0 : (i > 255 ? 255 : i));
+    }
+
+    // position of the lowest set bit of a byte
+    struct LowBit
+    {
+        unsigned char t[256];
+
+        LowBit()
+        {
+            t[0] = 8;
+            for (int i = 1; i < 256; ++i)
+            {
+                int k = 0;
+                while (!(i & (1 << k))) ++k;
+                t[i] = (unsigned char)k;
+            }
+        }
+    };
+
+    inline const LowBit &lowBit()
+    {
+        static const LowBit L;
+        return L;
+    }
+
+    // inverse transform of the packed block at p to N x N samples at out,
+    // returns the end of the block
+    template <int N>
+    const unsigned char *decodeBlock(const unsigned char *p, const float *quant,
+                                     unsigned char *out, const int stride)
+    {
+        uint64_t mask = 0;
+        for (int i = 0; i < 8; ++i) mask |= (uint64_t)p[i] << (8 * i);
+        p += 8;
+        if ((mask & ~(uint64_t)1) == 0)
+        {
+            // flat block, the most common case in smooth areas and chroma
+            int dc = 0;
+            if (mask) p = readValue(p, dc);
+            const unsigned char s = clampSample(dc * quant[0] / 8.0f);
+            for (int y = 0; y < N; ++y)
+            {
+                memset(out + y * stride, s, N);
+            }
+            return p;
+        }
+
+        // rows first, only rows with nonzero coefficients are transformed
+        const unsigned char *low = lowBit().t;
+        const float *bh = basis().of(N);
+        float tmp[DCTSIZE][N];
+        unsigned int usedRows = 0;
+        for (int v = 0; v < DCTSIZE; ++v)
+        {
+            unsigned int bits = (unsigned int)(mask >> (8 * v)) & 0xFF;
+            if (!bits) continue;
+            usedRows |= 1u << v;
+            float *t = tmp[v];
+            for (int x = 0; x < N; ++x) t[x] = 0.0f;
+            do
+            {
+                const int u = low[bits];
+                bits &= bits - 1;
+                int value;
+                p = readValue(p, value);
+                const float f = value * quant[v * DCTSIZE + u];
+                const float *b = bh + u * DCTSIZE;
+                for (int x = 0; x < N; ++x)
+                {
+                    t[x] += f * b[x];
+                }
+            } while (bits);
+        }
+        const float *bv = basis().of(N);
+        for (int y = 0; y < N; ++y)
+        {
+            float acc[N];
+            for (int x = 0; x < N; ++x) acc[x] = 0.0f;
+            for (int v = 0; v < DCTSIZE; ++v)
+            {
+                if (!(usedRows & (1u << v))) continue;
+                const float b = bv[v * DCTSIZE + y];
+                for (int x = 0; x < N; ++x)
+                {
+                    acc[x] += b * tmp[v][x];
+                }
+            }
+            unsigned char *o = out + y * stride;
+            for (int x = 0; x < N; ++x)
+            {
+                o[x] = clampSample(acc[x]);
+            }
+        }
+        return p;
+    }
+
+    inline const unsigned char *decodeBlock(const unsigned char *p, const float *quant,
+                                            const int n, unsigned char *out, const int stride)
+    {
+        switch (n)
+        {
+        case 1: return decodeBlock<1>(p, quant, out, stride);
+        case 2: return decodeBlock<2>(p, quant, out, stride);
+        case 4: return decodeBlock<4>(p, quant, out, stride);
+        default: return decodeBlock<8>(p, quant, out, stride);
+        }
+    }
+
+    // size of the IDCT of a component for output blocks of n samples: the
+    // largest of 1, 2, 4, 8 that exceeds the output resolution in neither
+    // direction, the same in both like libjpeg-turbo does
+    inline int idctSize(const int n, const int hmax, const int vmax, const int h, const int v)
+    {
+        int size = n;
+        while (size < DCTSIZE && 2 * size * h <= n * hmax && 2 * size * v <= n * vmax)
+        {
+            size *= 2;
+        }
+        return size;
+    }
+
+    // output pixel X takes w/4 of sample i0 and (4-w)/4 of sample i1
+    struct Tap
+    {
+        int i0, i1, w;
+    };
+
+    // tap of output pixel X, a component has num/den samples per output
+    // pixel and count samples in total. libjpeg upsamples with the triangle
+    // filter unless blocks are scaled to single samples.
+    inline Tap tapOf(const int X, const int num, const int den, const int count,
+                     const bool fancy)
+    {
+        Tap t;
+        t.w = 4;
+        if (num == den)
+        {
+            t.i0 = t.i1 = X;
+        }
+        else if (2 * num == den && fancy)
+        {
+            // triangle filter like libjpeg's fancy upsampling
+            t.i0 = X / 2;
+            t.i1 = (X & 1) ? t.i0 + 1 : t.i0 - 1;
+            t.w = 3;
+        }
+        else
+        {
+            t.i0 = t.i1 = (int)((long long)X * num / den);
+        }
+        t.i0 = std::max(0, std::min(t.i0, count - 1));
+        t.i1 = std::max(0, std::min(t.i1, count - 1));
+        return t;
+    }
+
+    // fixed point YCbCr to RGB tables like libjpeg's jdcolor.c, limit
+    // clamps results in [-256,512) to [0,255]
+    struct ColorTables
+    {
+        int crR[256], cbB[256], crG[256], cbG[256];
+        unsigned char range[3 * 256];
+        const unsigned char *limit;
+
+        ColorTables() : limit(range + 256)
+        {
+            for (int i = 0; i < 3 * 256; ++i)
+            {
+                range[i] = (unsigned char)std::max(0, std::min(i - 256, 255));
+            }
+            const int SHIFT = 16, HALF = 1 << (SHIFT - 1);
+            for (int i = 0; i < 256; ++i)
+            {
+                const int x = i - 128;
+                crR[i] = ((int)(1.40200 * (1 << SHIFT) + 0.5) * x + HALF) >> SHIFT;
+                cbB[i] = ((int)(1.77200 * (1 << SHIFT) + 0.5) * x + HALF) >> SHIFT;
+                crG[i] = -(int)(0.71414 * (1 << SHIFT) + 0.5) * x;
+                cbG[i] = -(int)(0.34414 * (1 << SHIFT) + 0.5) * x + HALF;
+            }
+        }
+    };
+
+    inline const ColorTables &colorTables()
+    {
+        static const ColorTables T;
+        return T;
+    }
+
+    class Store
+    {
+        int m_width, m_height;
+        int m_hmax, m_vmax;
+        bool m_ycc;   // YCbCr, otherwise RGB or grayscale
+        std::vector<Component> m_comp;
+
+        // samples of one component around a rectangle, and where the output
+        // pixels take them from
+        struct Plane
+        {
+            int stride;
+            bool identityX;
+            std::vector<unsigned char> pixels;
+            std::vector<Tap> x, y;   // per output column and row
+        };
+
+        // frame parameters from the header, false for color spaces and
+        // block sizes that are not supported
+        bool setup(jpeg_decompress_struct &cinfo)
+        {
+#if JPEG_LIB_VERSION >= 80
+            if (cinfo.block_size != DCTSIZE) return false;
+#endif
+            const bool gray = cinfo.num_components == 1 &&
+                              cinfo.jpeg_color_space == JCS_GRAYSCALE;
+            const bool color = cinfo.num_components == 3 &&
+                               (cinfo.jpeg_color_space == JCS_YCbCr ||
+                                cinfo.jpeg_color_space == JCS_RGB);
+            if (!gray && !color) return false;
+
+            m_width = cinfo.image_width;
+            m_height = cinfo.image_height;
+            m_hmax = cinfo.max_h_samp_factor;
+            m_vmax = cinfo.max_v_samp_factor;
+            m_ycc = cinfo.jpeg_color_space == JCS_YCbCr;
+            m_comp.resize(cinfo.num_components);
+            for (int c = 0; c < cinfo.num_components; ++c)
+            {
+                const jpeg_component_info &comp = cinfo.comp_info[c];
+                Component &C = m_comp[c];
+                C.h = comp.h_samp_factor;
+                C.v = comp.v_samp_factor;
+                C.blocksW = (int)comp.width_in_blocks;
+                C.blocksH = (int)comp.height_in_blocks;
+                std::fill(C.quant, C.quant + DCTSIZE2, 0.0f);
+            }
+            return true;
+        }
+
+        // read the coefficients of the stream attached to cinfo, which
+        // starts at MCU row row0, and pack its block rows. libjpeg errors
+        // jump to the caller, see JPEGErrors.
+        bool readBand(jpeg_decompress_struct &cinfo, const int row0, std::vector<Packed> &out)
+        {
+            jpeg_read_header(&cinfo, TRUE);
+            if (cinfo.num_components != (int)m_comp.size()) return false;
+            jvirt_barray_ptr *coef = jpeg_read_coefficients(&cinfo);
+            out.resize(m_comp.size());
+            for (int c = 0; c < cinfo.num_components; ++c)
+            {
+                const jpeg_component_info &comp = cinfo.comp_info[c];
+                Component &C = m_comp[c];
+                if ((int)comp.width_in_blocks != C.blocksW) return false;
+                if (row0 == 0)
+                {
+                    // latched tables of the first scan, the same for all bands
+                    for (int k = 0; k < DCTSIZE2; ++k)
+                    {
+                        C.quant[k] = comp.quant_table ? comp.quant_table->quantval[k] : 0.0f;
+                    }
+                }
+                const int by0 = row0 * C.v;
+                const int rows = std::min((int)comp.height_in_blocks, C.blocksH - by0);
+                for (int r = 0; r < rows; ++r)
+                {
+                    JBLOCKARRAY blocks = (*cinfo.mem->access_virt_barray)(
+                        (j_common_ptr)&cinfo, coef[c], (JDIMENSION)r, 1, FALSE);
+                    packRow(blocks[0], C.blocksW, out[c]);
+                }
+            }
+            return true;
+        }
+
+        // decode the blocks of component c around output rectangle
+        // [ox0,ox1) x [oy0,oy1) for output blocks of n samples
+        void preparePlane(const int c, const int n, const int ox0, const int oy0,
+                          const int ox1, const int oy1, Plane &P) const
+        {
+            const Component &C = m_comp[c];
+            const int size = idctSize(n, m_hmax, m_vmax, C.h, C.v);
+            // samples of the component at this scale, like libjpeg
+            const int countW = (int)(((long long)m_width * C.h * size + m_hmax * DCTSIZE - 1) /
+                                     (m_hmax * DCTSIZE));
+            const int countH = (int)(((long long)m_height * C.v * size + m_vmax * DCTSIZE - 1) /
+                                     (m_vmax * DCTSIZE));
+            P.identityX = C.h * size == m_hmax * n;
+            P.x.resize(ox1 - ox0);
+            P.y.resize(oy1 - oy0);
+            int xmin = countW, xmax = 0, ymin = countH, ymax = 0;
+            for (int X = ox0; X < ox1; ++X)
+            {
+                const Tap t = tapOf(X, C.h * size, m_hmax * n, countW, n > 1);
+                xmin = std::min(xmin, std::min(t.i0, t.i1));
+                xmax = std::max(xmax, std::max(t.i0, t.i1));
+                P.x[X - ox0] = t;
+            }
+            for (int Y = oy0; Y < oy1; ++Y)
+            {
+                const Tap t = tapOf(Y, C.v * size, m_vmax * n, countH, n > 1);
+                ymin = std::min(ymin, std::min(t.i0, t.i1));
+                ymax = std::max(ymax, std::max(t.i0, t.i1));
+                P.y[Y - oy0] = t;
+            }
+            const int bx0 = xmin / size, bx1 = std::min(xmax / size + 1, C.blocksW);
+            const int by0 = ymin / size, by1 = std::min(ymax / size + 1, C.blocksH);
+            for (size_t i = 0; i < P.x.size(); ++i)
+            {
+                P.x[i].i0 -= bx0 * size;
+                P.x[i].i1 -= bx0 * size;
+            }
+            for (size_t i = 0; i < P.y.size(); ++i)
+            {
+                P.y[i].i0 -= by0 * size;
+                P.y[i].i1 -= by0 * size;
+            }
+
+            P.stride = (bx1 - bx0) * size;
+            P.pixels.resize((size_t)P.stride * (by1 - by0) * size);
+            for (int by = by0; by < by1; ++by)
+            {
+                const unsigned char *p =
+                    &C.data[C.offset[(size_t)by * C.groups() + bx0 / GROUP]];
+                for (int bx = bx0 - bx0 % GROUP; bx < bx0; ++bx)
+                {
+                    p = skipBlock(p);
+                }
+                unsigned char *out = &P.pixels[(size_t)(by - by0) * size * P.stride];
+                for (int bx = bx0; bx < bx1; ++bx)
+                {
+                    p = decodeBlock(p, C.quant, size, out + (bx - bx0) * size, P.stride);
+                }
+            }
+        }
+
+        // output row of a component, sum is scratch space
+        static void sampleRow(const Plane &P, const int row, unsigned char *dst,
+                              std::vector<int> &sum)
+        {
+            const Tap &ty = P.y[row];
+            const unsigned char *r0 = &P.pixels[(size_t)ty.i0 * P.stride];
+            const unsigned char *r1 = &P.pixels[(size_t)ty.i1 * P.stride];
+            const int n = (int)P.x.size();
+            if (P.identityX && ty.w == 4)
+            {
+                memcpy(dst, r0 + P.x[0].i0, n);
+                return;
+            }
+            // vertical first, then horizontal on the sums
+            sum.resize(P.stride);
+            for (int i = 0; i < P.stride; ++i)
+            {
+                sum[i] = ty.w * r0[i] + (4 - ty.w) * r1[i];
+            }
+            for (int X = 0; X < n; ++X)
+            {
+                const Tap &tx = P.x[X];
+                dst[X] = (unsigned char)((tx.w * sum[tx.i0] + (4 - tx.w) * sum[tx.i1] + 8) >> 4);
+            }
+        }
+
+        // decode output rectangle [ox0,ox1) x [oy0,oy1) at 1/scale, pixel
+        // (X,Y) goes to img(X - ox0, Y - yOrigin)
+        template <class IMGTYPE>
+        void decodeRect(const int ox0, const int oy0, const int ox1, const int oy1,
+                        const int scale, IMGTYPE &img, const int yOrigin) const
+        {
+            const int n = DCTSIZE / scale;
+            const int nc = (int)m_comp.size();
+            const int ow = ox1 - ox0;
+            std::vector<Plane> planes(nc);
+            for (int c = 0; c < nc; ++c)
+            {
+                preparePlane(c, n, ox0, oy0, ox1, oy1, planes[c]);
+            }
+            const ColorTables &T = colorTables();
+            std::vector<unsigned char> rows((size_t)nc * ow);
+            std::vector<int> sum;
+            for (int Y = oy0; Y < oy1; ++Y)
+            {
+                for (int c = 0; c < nc; ++c)
+                {
+                    sampleRow(planes[c], Y - oy0, &rows[(size_t)c * ow], sum);
+                }
+                unsigned char *dst = &img(0, Y - yOrigin);
+                if (nc == 1)
+                {
+                    for (int X = 0; X < ow; ++X, dst += 3)
+                    {
+                        dst[0] = dst[1] = dst[2] = rows[X];
+                    }
+                }
+                else if (m_ycc)
+                {
+                    const unsigned char *y = &rows[0], *cb = &rows[ow], *cr = &rows[2 * ow];
+                    for (int X = 0; X < ow; ++X, dst += 3)
+                    {
+                        dst[0] = T.limit[y[X] + T.crR[cr[X]]];
+                        dst[1] = T.limit[y[X] + ((T.cbG[cb[X]] + T.crG[cr[X]]) >> 16)];
+                        dst[2] = T.limit[y[X] + T.cbB[cb[X]]];
+                    }
+                }
+                else
+                {
+                    for (int X = 0; X < ow; ++X, dst += 3)
+                    {
+                        dst[0] = rows[X];
+                        dst[1] = rows[ow + X];
+                        dst[2] = rows[2 * ow + X];
+                    }
+                }
+            }
+        }
+
+        static bool validScale(const int scale)
+        {
+            return scale == 1 || scale == 2 || scale == 4 || scale == 8;
+        }
+
+        Store(const Store &);
+        Store &operator=(const Store &);
+
+    public:
+        Store() : m_width(0), m_height(0), m_hmax(1), m_vmax(1), m_ycc(false) {}
+
+        inline bool isValid() const { return !m_comp.empty(); }
+        inline int width() const { return m_width; }
+        inline int height() const { return m_height; }
+
+        // memory held by the packed coefficients
+        size_t bytes() const
+        {
+            size_t n = 0;
+            for (size_t c = 0; c < m_comp.size(); ++c)
+            {
+                n += m_comp[c].data.capacity() + m_comp[c].offset.capacity() * sizeof(size_t);
+            }
+            return n;
+        }
+
+        void clear()
+        {
+            m_width = m_height = 0;
+            m_comp.clear();
+        }
+
+        // entropy decode a JPEG held in memory and keep its coefficients,
+        // the data is not needed afterwards. Files that loadJPEG decodes in
+        // parallel (restart markers or an index) are read in parallel bands,
+        // others in one pass, during which libjpeg holds the unpacked arrays.
+        // False if the file can not be read or its data is damaged.
+        bool load(const unsigned char *data, const size_t size,
+                  const JIDX::Index *index = NULL, unsigned int threads = 0)
+        {
+            clear();
+            if (threads == 0) threads = PARALLEL::numThreads();
+            {
+                struct jpeg_decompress_struct cinfo;
+                JPEGErrors errors;
+                cinfo.err = &errors.pub;
+                jpeg_create_decompress(&cinfo);
+                bool ok = false;
+                if (!setjmp(errors.jump))
+                {
+                    jpeg_mem_src(&cinfo, (unsigned char *)data, (unsigned long)size);
+                    jpeg_read_header(&cinfo, TRUE);
+                    ok = setup(cinfo);
+                }
+                jpeg_destroy_decompress(&cinfo);
+                if (!ok) return false;
+            }
+
+            STREAM::Layout L;
+            std::vector<size_t> rst;
+            size_t scanEnd = 0;
+            std::vector<int> bands;
+            const bool parsed = threads > 1 && STREAM::parseLayout(data, size, L);
+            const bool indexed = parsed && index && JIDX::matches(*index, L);
+            if (indexed)
+            {
+                bands = splitBands(L.mcuRows, 1, 4 * threads);
+            }
+            else if (parsed && L.restartInterval > 0)
+            {
+                scanEnd = STREAM::findRestartMarkers(data, size, L.scanStart, rst);
+                if (scanEnd + 1 < size && data[scanEnd + 1] == STREAM::EOI)
+                {
+                    bands = restartBands(L, rst, 4 * threads);
+                }
+            }
+
+            std::vector< std::vector<Packed> > parts(bands.empty() ? 1 : bands.size() - 1);
+            std::atomic<bool> ok(true);
+            if (bands.empty())
+            {
+                struct jpeg_decompress_struct cinfo;
+                JPEGErrors errors;
+                cinfo.err = &errors.pub;
+                jpeg_create_decompress(&cinfo);
+                if (setjmp(errors.jump))
+                {
+                    ok = false;
+                }
+                else
+                {
+                    jpeg_mem_src(&cinfo, (unsigned char *)data, (unsigned long)size);
+                    ok = readBand(cinfo, 0, parts[0]) && !errors.damaged();
+                }
+                jpeg_destroy_decompress(&cinfo);
+            }
+            else
+            {
+                PARALLEL::forEach((int)parts.size(), [&](int b)
+                {
+                    STREAM::ChunkSource src;
+                    unsigned char height[2];
+                    JIDX::RowsStream buf;
+                    const int y0 = indexed
+                        ? JIDX::indexRowsSource(data, L, *index, bands[b], bands[b + 1], buf, src)
+                        : restartRowsSource(data, L, rst, scanEnd, bands[b], bands[b + 1],
+                                            height, src);
+                    if (y0 < 0)
+                    {
+                        ok = false;
+                        return;
+                    }
+                    struct jpeg_decompress_struct cinfo;
+                    JPEGErrors errors;
+                    cinfo.err = &errors.pub;
+                    jpeg_create_decompress(&cinfo);
+                    // bands end inside the scan, they are not finished regularly
+                    if (setjmp(errors.jump))
+                    {
+                        ok = false;
+                    }
+                    else
+                    {
+                        src.attach(&cinfo);
+                        if (!readBand(cinfo, bands[b], parts[b]) || errors.damaged()) ok = false;
+                    }
+                    jpeg_destroy_decompress(&cinfo);
+                }, threads);
+            }
+
+            // join the bands, each part is released as soon as it is copied
+            for (size_t c = 0; ok && c < m_comp.size(); ++c)
+            {
+                Component &C = m_comp[c];
+                size_t total = 0;
+                for (size_t b = 0; b < parts.size(); ++b)
+                {
+                    total += parts[b][c].data.size();
+                }
+                C.data.reserve(total);
+                C.offset.reserve((size_t)C.blocksH * C.groups());
+                for (size_t b = 0; b < parts.size(); ++b)
+                {
+                    Packed &part = parts[b][c];
+                    const size_t base = C.data.size();
+                    C.data.insert(C.data.end(), part.data.begin(), part.data.end());
+                    for (size_t i = 0; i < part.offset.size(); ++i)
+                    {
+                        C.offset.push_back(base + part.offset[i]);
+                    }
+                    std::vector<unsigned char>().swap(part.data);
+                    std::vector<size_t>().swap(part.offset);
+                }
+                ok = C.offset.size() == (size_t)C.blocksH * C.groups();
+            }
+            if (!ok)
+            {
+                clear();
+            }
+            return ok;
+        }
+
+        // decode the rectangle of w x h pixels at (x0,y0) of the full size
+        // image at 1/scale (1, 2, 4 or 8) into img, which gets the size of
+        // the scaled rectangle. The result does not depend on how the image
+        // is cut into rectangles. May be called from several threads.
+        template <class IMGTYPE>
+        bool decode(const int x0, const int y0, const int w, const int h,
+                    const int scale, IMGTYPE &img) const
+        {
+            if (!isValid() || !validScale(scale) || x0 < 0 || y0 < 0 || w <= 0 || h <= 0 || x0 + w > m_width || y0 + h > m_height)
+            {
+                return false;
+            }
+            const int ox0 = x0 / scale, oy0 = y0 / scale;
+            const int ox1 = (x0 + w + scale - 1) / scale;
+            const int oy1 = (y0 + h + scale - 1) / scale;
+            img.resize(ox1 - ox0, oy1 - oy0);
+            decodeRect(ox0, oy0, ox1, oy1, scale, img, oy0);
+            return true;
+        }
+
+        // decode the whole image at 1/scale in bands on 'threads' cores
+        template <class IMGTYPE>
+        bool decodeImage(const int scale, IMGTYPE &img, const unsigned int threads = 0) const
+        {
+            if (!isValid() || !validScale(scale))
+            {
+                return false;
+            }
+            const int ow = (m_width + scale - 1) / scale;
+            const int oh = (m_height + scale - 1) / scale;
+            const int BAND = 64;
+            img.resize(ow, oh);
+            PARALLEL::forEach((oh + BAND - 1) / BAND, [&](int b)
+            {
+                decodeRect(0, b * BAND, ow, std::min(oh, (b + 1) * BAND), scale, img, 0);
+            }, threads);
+            return true;
+        }
+    };
+}
+}
+
+#endif
@@ -0,0 +1,757 @@
+#ifndef _JPGINDEX_H_
+#define _JPGINDEX_H_
+
+// JIDX - random access index for baseline JPEGs without restart markers
+//
+// A Huffman pre-scan records where every MCU row starts in the entropy
+// coded data (byte offset and bit) and the DC predictors at that point.
+// From an entry a stream for any range of MCU rows can be built that
+// libjpeg decodes like a complete file: the original header with patched
+// height, the entropy coded data realigned to a byte boundary, where the
+// first MCU carries absolute DC values since libjpeg starts with zero
+// predictors, and EOI. Decoding such row ranges in parallel or only around
+// a tile works like with restart markers, see imgjpg.h.
+//
+// The index is saved as a small sidecar file <image>.jidx (or in the tile
+// cache directory if the image directory is not writable or should not be
+// written to):
+//   Header
+//   RowEntry[mcuRows]
+// in native byte order.
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "jpgstream.h"
+#include "pvtfile.h"
+
+namespace IMG
+{
+namespace JIDX
+{
+    const char MAGIC[4] = { 'J', 'I', 'D', 'X' };
+    const uint32_t VERSION = 1;
+
+    struct Header
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t mcuRows;
+        uint32_t mcusPerRow;
+        uint64_t scanStart;   // first byte of entropy coded data
+        uint64_t scanEnd;     // marker after the entropy coded data
+        PVT::SourceKey source;
+    };
+    static_assert(sizeof(Header) == 56, "JIDX header layout");
+
+    // decoder state at the start of a MCU row
+    struct RowEntry
+    {
+        uint64_t offset;      // byte holding the next bit
+        int16_t pred[3];      // DC predictors in scan component order
+        uint8_t bit;          // bits of that byte already used
+        uint8_t reserved;
+    };
+    static_assert(sizeof(RowEntry) == 16, "JIDX row entry layout");
+
+    struct Index
+    {
+        Header header;
+        std::vector<RowEntry> rows;
+
+        Index() : header() {}
+        inline bool isValid() const { return !rows.empty(); }
+    };
+
+    // Huffman table with a 9 bit lookahead for decoding and the codes of
+    // all symbols for encoding, built like jpeg_make_d_derived_tbl
+    struct HuffTable
+    {
+        unsigned char counts[17];     // counts[l]: number of codes of length l
+        unsigned char symbols[256];
+        int numSymbols;
+        bool defined;
+
+        static const int LOOKAHEAD = 9;
+        unsigned char lookLen[1 << LOOKAHEAD];   // 0 if the code is longer
+        unsigned char lookSym[1 << LOOKAHEAD];
+        int maxcode[18];              // largest code of length l, -1 if none
+        int valoffset[17];
+        unsigned int code[256];       // per symbol, size 0 if not present
+        unsigned char size[256];
+
+        HuffTable() : numSymbols(0), defined(false) {}
+
+        bool set(const unsigned char *bits, const unsigned char *vals)
+        {
+            counts[0] = 0;
+            numSymbols = 0;
+            for (int l = 1; l <= 16; ++l)
+            {
+                counts[l] = bits[l - 1];
+                numSymbols += counts[l];
+            }
+            if (numSymbols > 256) return false;
+            memcpy(symbols, vals, numSymbols);
+            defined = true;
+            return derive();
+        }
+
+        // append a symbol with a 16 bit code, the codes of the others stay
+        bool append(const unsigned char symbol)
+        {
+            if (numSymbols >= 256) return false;
+            counts[16]++;
+            symbols[numSymbols++] = symbol;
+            return derive();
+        }
+
+        bool derive()
+        {
+            memset(lookLen, 0, sizeof(lookLen));
+            memset(size, 0, sizeof(size));
+            unsigned int c = 0;
+            int k = 0;
+            for (int l = 1; l <= 16; ++l)
+            {
+                valoffset[l] = k - (int)c;
+                for (int i = 0; i < counts[l]; ++i, ++k, ++c)
+                {
+                    const unsigned char s = symbols[k];
+                    code[s] = c;
+                    size[s] = (unsigned char)l;
+                    if (l <= LOOKAHEAD)
+                    {
+                        const int shift = LOOKAHEAD - l;
+                        for (int j = 0; j < (1 << shift); ++j)
+                        {
+                            lookLen[(c << shift) | j] = (unsigned char)l;
+                            lookSym[(c << shift) | j] = s;
+                        }
+                    }
+                }
+                maxcode[l] = counts[l] ? (int)c - 1 : -1;
+                // a complete code would need more than l bits
+                if (c > (1u << l)) return false;
+                c <<= 1;
+            }
+            maxcode[17] = 0x7FFFFFFF;
+            return true;
+        }
+    };
+
+    // reads the entropy coded data MSB first, removes stuffed zeros and
+    // returns zero bits after a marker like libjpeg does
+    class BitReader
+    {
+        const unsigned char *m_data;
+        size_t m_pos, m_end;
+        uint64_t m_acc;
+        int m_bits;
+        bool m_marker;
+        size_t m_offsets[16];   // file offsets of the last loaded bytes
+        uint64_t m_loaded, m_consumed;
+
+        void fill()
+        {
+            while (m_bits <= 56)
+            {
+                unsigned int b = 0;
+                m_offsets[m_loaded & 15] = m_pos;
+                if (!m_marker && m_pos < m_end)
+                {
+                    b = m_data[m_pos];
+                    if (b != 0xFF)
+                    {
+                        ++m_pos;
+                    }
+                    else if (m_pos + 1 < m_end && m_data[m_pos + 1] == 0x00)
+                    {
+                        m_pos += 2;
+                    }
+                    else
+                    {
+                        m_marker = true;
+                        b = 0;
+                    }
+                }
+                m_acc |= (uint64_t)b << (56 - m_bits);
+                m_bits += 8;
+                ++m_loaded;
+            }
+        }
+
+    public:
+        // start at bit 'bit' of the byte at 'offset', end is the first byte
+        // after the entropy coded data
+        BitReader(const unsigned char *data, const size_t offset, const int bit,
+                  const size_t end)
+            : m_data(data), m_pos(offset), m_end(end), m_acc(0), m_bits(0),
+              m_marker(false), m_loaded(0), m_consumed(0)
+        {
+            fill();
+            skip(bit);
+            m_consumed = 0;
+        }
+
+        inline unsigned int peek(const int n)
+        {
+            if (m_bits < n) fill();
+            return (unsigned int)(m_acc >> (64 - n));
+        }
+        inline void skip(const int n)
+        {
+            m_acc <<= n;
+            m_bits -= n;
+            m_consumed += n;
+        }
+        // n in [0,32]
+        inline unsigned int get(const int n)
+        {
+            if (n == 0) return 0;
+            const unsigned int v = peek(n);
+            skip(n);
+            return v;
+        }
+        // bits consumed since the start position
+        inline uint64_t consumed() const { return m_consumed; }
+        // bits loaded but not consumed yet, the data continues at nextByte()
+        inline int buffered() const { return m_bits; }
+        inline const unsigned char *nextByte() const { return m_data + m_pos; }
+
+        // byte holding the next bit and the number of its bits already used
+        void position(uint64_t &offset, int &bit)
+        {
+            if (m_bits == 0) fill();
+            offset = m_offsets[(m_loaded - (m_bits + 7) / 8) & 15];
+            bit = (8 - m_bits % 8) % 8;
+        }
+
+        // decode a symbol, code and len receive its bits. -1 on bad data
+        inline int decode(const HuffTable &h, unsigned int &code, int &len)
+        {
+            const unsigned int look = peek(HuffTable::LOOKAHEAD);
+            if (h.lookLen[look])
+            {
+                len = h.lookLen[look];
+                code = look >> (HuffTable::LOOKAHEAD - len);
+                skip(len);
+                return h.lookSym[look];
+            }
+            const unsigned int bits = peek(16);
+            for (len = HuffTable::LOOKAHEAD + 1; len <= 16; ++len)
+            {
+                code = bits >> (16 - len);
+                if ((int)code <= h.maxcode[len])
+                {
+                    skip(len);
+                    return h.symbols[h.valoffset[len] + code];
+                }
+            }
+            return -1;
+        }
+        inline int decode(const HuffTable &h)
+        {
+            unsigned int code;
+            int len;
+            return decode(h, code, len);
+        }
+    };
+
+    // writes bits MSB first and stuffs zeros after 0xFF into a buffer that
+    // has to be large enough, twice the number of bytes at most
+    class BitWriter
+    {
+        unsigned char *m_out;
+        uint64_t m_acc;
+        int m_bits;
+
+    public:
+        BitWriter(unsigned char *out) : m_out(out), m_acc(0), m_bits(0) {}
+
+        // n in [0,32]
+        inline void put(const unsigned int v, const int n)
+        {
+            if (n == 0) return;
+            m_acc = (m_acc << n) | (v & (0xFFFFFFFFu >> (32 - n)));
+            m_bits += n;
+            while (m_bits >= 8)
+            {
+                const unsigned char b = (unsigned char)(m_acc >> (m_bits - 8));
+                *m_out++ = b;
+                if (b == 0xFF) *m_out++ = 0x00;
+                m_bits -= 8;
+            }
+        }
+        // put count data bytes from p, skipping the stuffed zeros there.
+        // Returns the position after them.
+        const unsigned char *putBytes(const unsigned char *p, uint64_t count)
+        {
+            // locals, so that the byte stores do not force reloads
+            unsigned char *out = m_out;
+            uint64_t acc = m_acc;
+            const int bits = m_bits;
+            while (count > 0)
+            {
+                // runs without 0xFF are copied without looking at the data
+                const unsigned char *ff = (const unsigned char *)memchr(p, 0xFF, (size_t)count);
+                const size_t run = ff ? ff - p : (size_t)count;
+                for (size_t i = 0; i < run; ++i)
+                {
+                    acc = (acc << 8) | p[i];
+                    const unsigned char c = (unsigned char)(acc >> bits);
+                    *out++ = c;
+                    if (c == 0xFF) *out++ = 0x00;
+                }
+                p += run;
+                count -= run;
+                if (count > 0)
+                {
+                    // 0xFF and its stuffed zero
+                    acc = (acc << 8) | 0xFF;
+                    const unsigned char c = (unsigned char)(acc >> bits);
+                    *out++ = c;
+                    if (c == 0xFF) *out++ = 0x00;
+                    p += 2;
+                    --count;
+                }
+            }
+            m_out = out;
+            m_acc = acc;
+            return p;
+        }
+
+        // pad the last byte with ones like libjpeg
+        void flush()
+        {
+            if (m_bits > 0) put(0x7F, 8 - m_bits);
+        }
+        inline unsigned char *end() const { return m_out; }
+    };
+
+    // copy n data bits, which must not reach past the entropy coded data.
+    // After the bits buffered by the reader whole bytes are taken directly.
+    inline void copyBits(BitReader &in, BitWriter &out, uint64_t n)
+    {
+        while (n > 0 && in.buffered() > 0)
+        {
+            const int k = (int)std::min<uint64_t>(n, std::min(in.buffered(), 32));
+            out.put(in.get(k), k);
+            n -= k;
+        }
+        const unsigned char *p = out.putBytes(in.nextByte(), n / 8);
+        n %= 8;
+        if (n > 0)
+        {
+            out.put(*p >> (8 - n), (int)n);
+        }
+    }
+
+    // tables and component order of the first scan
+    struct ScanTables
+    {
+        HuffTable dc[4], ac[4];
+        int comps;              // components in the scan
+        int blocks[3];          // blocks per MCU of each scan component
+        int dcTable[3], acTable[3];
+    };
+
+    inline bool parseScanTables(const unsigned char *data, const STREAM::Layout &L,
+                                ScanTables &T)
+    {
+        size_t pos = 2;
+        while (pos < L.sosOffset)
+        {
+            while (data[pos + 1] == 0xFF) ++pos;
+            const int type = data[pos + 1];
+            if (type == STREAM::TEM || (type >= STREAM::RST0 && type <= STREAM::RST7))
+            {
+                pos += 2;
+                continue;
+            }
+            const int len = STREAM::readU16(&data[pos + 2]);
+            if (type == STREAM::DHT)
+            {
+                const unsigned char *p = &data[pos + 4], *end = &data[pos + 2 + len];
+                while (p + 17 <= end)
+                {
+                    const int tc = p[0] >> 4, th = p[0] & 0x0F;
+                    int n = 0;
+                    for (int i = 1; i <= 16; ++i) n += p[i];
+                    if (th > 3 || p + 17 + n > end) return false;
+                    HuffTable &h = tc ? T.ac[th] : T.dc[th];
+                    if (!h.set(p + 1, p + 17)) return false;
+                    p += 17 + n;
+                }
+            }
+            pos += 2 + len;
+        }
+        const unsigned char *seg = &data[L.sosOffset + 4];
+        T.comps = seg[0];
+        if (T.comps != 3) return false;
+        for (int i = 0; i < T.comps; ++i)
+        {
+            int c = 0;
+            while (c < L.numComponents && L.compId[c] != seg[1 + 2 * i]) ++c;
+            if (c == L.numComponents) return false;
+            T.blocks[i] = L.compH[c] * L.compV[c];
+            T.dcTable[i] = seg[2 + 2 * i] >> 4;
+            T.acTable[i] = seg[2 + 2 * i] & 0x0F;
+            if (T.dcTable[i] > 3 || T.acTable[i] > 3 ||
+                !T.dc[T.dcTable[i]].defined || !T.ac[T.acTable[i]].defined)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    inline int extend(const unsigned int v, const int s)
+    {
+        return (s == 0) ? 0 : ((v < (1u << (s - 1))) ? (int)v - (1 << s) + 1 : (int)v);
+    }
+
+    inline int category(int v)
+    {
+        v = v < 0 ? -v : v;
+        int s = 0;
+        while (v) { ++s; v >>= 1; }
+        return s;
+    }
+
+    // skip the AC coefficients of a block, the bits go to out if given
+    inline bool skipAC(BitReader &in, const HuffTable &ac, BitWriter *out)
+    {
+        for (int k = 1; k < 64; )
+        {
+            unsigned int code;
+            int len;
+            const int rs = in.decode(ac, code, len);
+            if (rs < 0) return false;
+            const int r = rs >> 4, s = rs & 15;
+            const unsigned int bits = in.get(s);
+            if (out)
+            {
+                out->put(code, len);
+                out->put(bits, s);
+            }
+            if (s)
+            {
+                k += r + 1;
+            }
+            else if (r == 15)
+            {
+                k += 16;
+            }
+            else
+            {
+                break;
+            }
+        }
+        return true;
+    }
+
+    // true if the JPEG is of the kind an index is made for: a single
+    // interleaved Huffman scan of 3 components without restart markers
+    inline bool isIndexable(const unsigned char *data, const STREAM::Layout &L)
+    {
+        return L.valid && !L.progressive && !L.arithmetic && L.restartInterval == 0 &&
+               L.numComponents == 3 && L.scanComponents == 3 &&
+               data[L.sofOffset + 4] == 8;
+    }
+
+    // the Huffman pre-scan, decodes all symbols but nothing else
+    inline bool buildIndex(const unsigned char *data, const size_t size, Index &index)
+    {
+        index = Index();
+        STREAM::Layout L;
+        ScanTables T;
+        if (!STREAM::parseLayout(data, size, L) || !isIndexable(data, L) ||
+            !parseScanTables(data, L, T))
+        {
+            return false;
+        }
+        std::vector<size_t> rst;
+        const size_t scanEnd = STREAM::findRestartMarkers(data, size, L.scanStart, rst);
+        if (!rst.empty()) return false;
+
+        std::vector<RowEntry> rows(L.mcuRows);
+        BitReader in(data, L.scanStart, 0, scanEnd);
+        int pred[3] = { 0, 0, 0 };
+        for (int row = 0; row < L.mcuRows; ++row)
+        {
+            RowEntry &e = rows[row];
+            int bit;
+            in.position(e.offset, bit);
+            // a row starting in the padding after the data is truncated
+            if (e.offset >= scanEnd) return false;
+            e.bit = (uint8_t)bit;
+            e.reserved = 0;
+            for (int i = 0; i < 3; ++i) e.pred[i] = (int16_t)pred[i];
+
+            for (int m = 0; m < L.mcusPerRow; ++m)
+            {
+                for (int i = 0; i < T.comps; ++i)
+                {
+                    const HuffTable &dc = T.dc[T.dcTable[i]], &ac = T.ac[T.acTable[i]];
+                    for (int b = 0; b < T.blocks[i]; ++b)
+                    {
+                        const int s = in.decode(dc);
+                        if (s < 0 || s > 15) return false;
+                        pred[i] += extend(in.get(s), s);
+                        if (!skipAC(in, ac, NULL)) return false;
+                    }
+                }
+            }
+        }
+        uint64_t offset;
+        int bit;
+        in.position(offset, bit);
+        if (offset > scanEnd) return false;
+
+        Header &h = index.header;
+        std::copy(MAGIC, MAGIC + 4, h.magic);
+        h.version = VERSION;
+        h.mcuRows = L.mcuRows;
+        h.mcusPerRow = L.mcusPerRow;
+        h.scanStart = L.scanStart;
+        h.scanEnd = scanEnd;
+        index.rows.swap(rows);
+        return true;
+    }
+
+    // true if the index was made for a file with this layout
+    inline bool matches(const Index &index, const STREAM::Layout &L)
+    {
+        return index.isValid() && index.header.mcuRows == (uint32_t)L.mcuRows &&
+               index.header.mcusPerRow == (uint32_t)L.mcusPerRow &&
+               index.header.scanStart == L.scanStart;
+    }
+
+    // buffers of a stream built by indexRowsSource
+    struct RowsStream
+    {
+        unsigned char height[2];
+        std::vector<unsigned char> dht;       // tables with appended DC codes
+        std::vector<unsigned char> entropy;   // realigned data and EOI
+    };
+
+    // prepare src with a stream for MCU rows [row0,rowEnd), the buffers
+    // have to stay valid while src is in use. Returns the first pixel row,
+    // -1 on damaged data.
+    inline int indexRowsSource(const unsigned char *data, const STREAM::Layout &L,
+                               const Index &index, const int row0, const int rowEnd,
+                               RowsStream &buf, STREAM::ChunkSource &src)
+    {
+        ScanTables T;
+        if (!parseScanTables(data, L, T)) return -1;
+        const size_t scanEnd = (size_t)index.header.scanEnd;
+        const RowEntry &first = index.rows[row0];
+        uint64_t endOffset = scanEnd;
+        int endBit = 0;
+        if (rowEnd < L.mcuRows)
+        {
+            endOffset = index.rows[rowEnd].offset;
+            endBit = index.rows[rowEnd].bit;
+        }
+        if (endOffset * 8 + endBit <= first.offset * 8 + first.bit) return -1;
+        // data bits of the rows, stuffed zeros do not count
+        uint64_t bits = (endOffset - first.offset) * 8 - first.bit + endBit;
+        for (const unsigned char *p = data + first.offset, *end = data + endOffset;
+             p < end && (p = (const unsigned char *)memchr(p, 0xFF, end - p)) != NULL; p += 2)
+        {
+            bits -= 8;
+        }
+
+        // read the first MCU to get its DC values and the categories they
+        // need, which may be missing from the DC tables
+        BitReader in(data, (size_t)first.offset, first.bit, scanEnd);
+        int dcValue[3];
+        for (int i = 0; i < T.comps; ++i)
+        {
+            const HuffTable &dc = T.dc[T.dcTable[i]];
+            for (int b = 0; b < T.blocks[i]; ++b)
+            {
+                const int s = in.decode(dc);
+                if (s < 0 || s > 15) return -1;
+                const int diff = extend(in.get(s), s);
+                if (b == 0) dcValue[i] = first.pred[i] + diff;
+                if (!skipAC(in, T.ac[T.acTable[i]], NULL)) return -1;
+            }
+        }
+        bool patched[4] = { false, false, false, false };
+        for (int i = 0; i < T.comps; ++i)
+        {
+            HuffTable &dc = T.dc[T.dcTable[i]];
+            const int s = category(dcValue[i]);
+            if (dc.size[s] == 0)
+            {
+                if (!dc.append((unsigned char)s)) return -1;
+                patched[T.dcTable[i]] = true;
+            }
+        }
+        buf.dht.clear();
+        for (int t = 0; t < 4; ++t)
+        {
+            if (!patched[t]) continue;
+            if (buf.dht.empty())
+            {
+                const unsigned char marker[4] = { 0xFF, STREAM::DHT, 0, 0 };
+                buf.dht.assign(marker, marker + 4);
+            }
+            buf.dht.push_back((unsigned char)t);
+            buf.dht.insert(buf.dht.end(), T.dc[t].counts + 1, T.dc[t].counts + 17);
+            buf.dht.insert(buf.dht.end(), T.dc[t].symbols, T.dc[t].symbols + T.dc[t].numSymbols);
+        }
+        if (!buf.dht.empty())
+        {
+            buf.dht[2] = (unsigned char)((buf.dht.size() - 2) >> 8);
+            buf.dht[3] = (unsigned char)((buf.dht.size() - 2) & 0xFF);
+        }
+
+        // rewrite the first MCU with absolute DC values, then copy the rest
+        // the first MCU may grow by the longer DC codes, 64 bytes per block
+        buf.entropy.resize(2 * (size_t)(bits / 8) + 64 * 10 + 16);
+        BitWriter out(&buf.entropy[0]);
+        BitReader again(data, (size_t)first.offset, first.bit, scanEnd);
+        for (int i = 0; i < T.comps; ++i)
+        {
+            const HuffTable &dc = T.dc[T.dcTable[i]];
+            for (int b = 0; b < T.blocks[i]; ++b)
+            {
+                unsigned int code;
+                int len;
+                const int s = again.decode(dc, code, len);
+                const unsigned int diff = again.get(s);
+                if (b == 0)
+                {
+                    const int v = dcValue[i], vs = category(v);
+                    out.put(dc.code[vs], dc.size[vs]);
+                    out.put((unsigned int)(v < 0 ? v - 1 : v), vs);
+                }
+                else
+                {
+                    out.put(code, len);
+                    out.put(diff, s);
+                }
+                skipAC(again, T.ac[T.acTable[i]], &out);
+            }
+        }
+        // truncated data reads as zeros and may run past the rows
+        if (again.consumed() > bits) return -1;
+        copyBits(again, out, bits - again.consumed());
+        out.flush();
+        unsigned char *end = out.end();
+        *end++ = 0xFF;
+        *end++ = STREAM::EOI;
+        buf.entropy.resize(end - &buf.entropy[0]);
+
+        const int y0 = row0 * L.mcuHeight;
+        const int yEnd = std::min(rowEnd * L.mcuHeight, L.height);
+        buf.height[0] = (unsigned char)((yEnd - y0) >> 8);
+        buf.height[1] = (unsigned char)((yEnd - y0) & 0xFF);
+
+        // SOF: FF Cx Lh Ll P Yh Yl Xh Xl ...
+        src.add(data, L.sofOffset + 5);
+        src.add(buf.height, 2);
+        src.add(data + L.sofOffset + 7, L.sosOffset - L.sofOffset - 7);
+        if (!buf.dht.empty()) src.add(&buf.dht[0], buf.dht.size());
+        src.add(data + L.sosOffset, L.scanStart - L.sosOffset);
+        src.add(&buf.entropy[0], buf.entropy.size());
+        return y0;
+    }
+
+    // name of the sidecar next to the image and in the cache directory
+    inline std::string sidecarName(const std::string &image)
+    {
+        return image + ".jidx";
+    }
+
+    inline std::string cacheName(const PVT::SourceKey &key)
+    {
+        const std::string dir = PVT::cacheDirectory();
+        if (dir.empty()) return "";
+        char name[64];
+        sprintf(name, "%016llx.jidx",
+                (unsigned long long)PVT::fnv1a((const unsigned char *)&key, sizeof(key)));
+        return dir + "/" + name;
+    }
+
+    inline bool load(const std::string &fname, const PVT::SourceKey &key, Index &index)
+    {
+        index = Index();
+        FILE *f = fopen(fname.c_str(), "rb");
+        if (!f) return false;
+        Header h;
+        bool ok = fread(&h, sizeof(h), 1, f) == 1 &&
+                  std::equal(MAGIC, MAGIC + 4, h.magic) && h.version == VERSION &&
+                  h.source == key && h.mcuRows > 0;
+        if (ok)
+        {
+            index.rows.resize(h.mcuRows);
+            ok = fread(&index.rows[0], sizeof(RowEntry), h.mcuRows, f) == h.mcuRows;
+        }
+        fclose(f);
+        if (!ok)
+        {
+            index = Index();
+            return false;
+        }
+        index.header = h;
+        return true;
+    }
+
+    inline bool save(const std::string &fname, const Index &index)
+    {
+        FILE *f = fopen(fname.c_str(), "wb");
+        if (!f) return false;
+        const bool ok = fwrite(&index.header, sizeof(Header), 1, f) == 1 &&
+                        fwrite(&index.rows[0], sizeof(RowEntry), index.rows.size(), f) ==
+                            index.rows.size();
+        if (fclose(f) != 0 || !ok)
+        {
+            remove(fname.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // the index of an image, read from its sidecar or built by a pre-scan
+    // and saved. Without writeSidecar an existing sidecar is still read, a
+    // new index only goes to the cache directory. Fails for images that
+    // need no index or cannot have one.
+    inline bool openIndex(const char *image, const unsigned char *data, const size_t size,
+                          Index &index, const bool writeSidecar = true)
+    {
+        STREAM::Layout L;
+        PVT::SourceKey key;
+        if (!STREAM::parseLayout(data, size, L) || !isIndexable(data, L) ||
+            !PVT::makeSourceKey(image, data, size, key))
+        {
+            return false;
+        }
+        const std::string sidecar = sidecarName(image), cached = cacheName(key);
+        if ((load(sidecar, key, index) || (!cached.empty() && load(cached, key, index))) &&
+            matches(index, L))
+        {
+            return true;
+        }
+        if (!buildIndex(data, size, index))
+        {
+            return false;
+        }
+        index.header.source = key;
+        if (!(writeSidecar && save(sidecar, index)) && !cached.empty())
+        {
+            save(cached, index);
+        }
+        return true;
+    }
+}
+}
+
+#endif
@@ -0,0 +1,220 @@
+#ifndef _JPGSPLIT_H_
+#define _JPGSPLIT_H_
+
+// lossless splitting of a JPEG into one JPEG per tile
+//
+// The DCT coefficient blocks of each tile are copied into a file of its own
+// like jpegtran -crop does, nothing is decoded or quantized again. Tiles have
+// to start at iMCU boundaries, so the tile size must be a multiple of the
+// iMCU size (8 or 16 pixels for the usual sampling factors).
+//
+// A tile set is a directory with the manifest MANIFEST
+//   PANOTILES 1
+//   size <width> <height>
+//   tilesize <tileSize>
+//   fov <azimuth> <elevation>
+// and the tiles <ty>_<tx>.jpg next to it, which are independent baseline
+// JPEGs that TiledImage decodes in parallel.
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+
+#include "jpeglib.h"
+#include "mappedfile.h"
+#include "parallel.h"
+#include "pvtfile.h"
+
+namespace IMG
+{
+namespace TILESET
+{
+    const char MANIFEST[] = "tiles.txt";
+    const int VERSION = 1;
+
+    struct Manifest
+    {
+        int width, height, tileSize;
+        double azimuth, elevation;
+        Manifest() : width(0), height(0), tileSize(0), azimuth(360.0), elevation(180.0) {}
+    };
+
+    // the manifest of a tile set given by its directory or manifest name
+    inline std::string manifestName(const std::string &path)
+    {
+        return PVT::isDirectory(path) ? path + "/" + MANIFEST : path;
+    }
+
+    inline std::string directoryOf(const std::string &manifest)
+    {
+        const size_t pos = manifest.find_last_of("/\\");
+        return pos == std::string::npos ? std::string(".") : manifest.substr(0, pos);
+    }
+
+    inline std::string tileName(const std::string &dir, const int tx, const int ty)
+    {
+        char name[32];
+        sprintf(name, "/%d_%d.jpg", ty, tx);
+        return dir + name;
+    }
+
+    inline bool readManifest(const std::string &path, Manifest &m)
+    {
+        FILE *f = fopen(manifestName(path).c_str(), "r");
+        if (!f)
+        {
+            return false;
+        }
+        int version = 0;
+        const bool ok = fscanf(f, "PANOTILES %d size %d %d tilesize %d fov %lf %lf",
+                               &version, &m.width, &m.height, &m.tileSize,
+                               &m.azimuth, &m.elevation) == 6;
+        fclose(f);
+        return ok && version == VERSION && m.width > 0 && m.height > 0 && m.tileSize > 0;
+    }
+
+    inline bool writeManifest(const std::string &dir, const Manifest &m)
+    {
+        FILE *f = fopen((dir + "/" + MANIFEST).c_str(), "w");
+        if (!f)
+        {
+            return false;
+        }
+        fprintf(f, "PANOTILES %d\nsize %d %d\ntilesize %d\nfov %g %g\n", VERSION,
+                m.width, m.height, m.tileSize, m.azimuth, m.elevation);
+        return fclose(f) == 0;
+    }
+
+    // write the w x h block at (x0,y0) of the coefficients of src as a JPEG,
+    // x0 and y0 are multiples of the iMCU size. The arrays of src are only
+    // read while 'srcLock' is held.
+    inline bool writeTile(j_decompress_ptr src, jvirt_barray_ptr *srcCoef,
+                          const int x0, const int y0, const int w, const int h,
+                          const std::string &fname, std::mutex &srcLock)
+    {
+        FILE *out = fopen(fname.c_str(), "wb");
+        if (!out)
+        {
+            std::cout << "can't write " << fname << std::endl;
+            return false;
+        }
+        struct jpeg_compress_struct dst;
+        struct jpeg_error_mgr jerr;
+        dst.err = jpeg_std_error(&jerr);
+        jpeg_create_compress(&dst);
+        jpeg_copy_critical_parameters(src, &dst);
+        dst.image_width = w;
+        dst.image_height = h;
+#if JPEG_LIB_VERSION >= 70
+        dst.jpeg_width = w;
+        dst.jpeg_height = h;
+#endif
+        // only the Huffman tables are new, this is still lossless
+        dst.optimize_coding = TRUE;
+
+        const int mcuW = src->max_h_samp_factor * DCTSIZE;
+        const int mcuH = src->max_v_samp_factor * DCTSIZE;
+        std::vector<jvirt_barray_ptr> coef(src->num_components);
+        std::vector<JDIMENSION> rows(src->num_components);
+        for (int c = 0; c < src->num_components; ++c)
+        {
+            const jpeg_component_info &comp = src->comp_info[c];
+            // blocks of the tile, padded to whole iMCUs like the library does
+            const JDIMENSION cols = (JDIMENSION)((w + mcuW - 1) / mcuW * comp.h_samp_factor);
+            rows[c] = (JDIMENSION)((h + mcuH - 1) / mcuH * comp.v_samp_factor);
+            coef[c] = (*dst.mem->request_virt_barray)((j_common_ptr)&dst, JPOOL_IMAGE, TRUE,
+                                                      cols, rows[c], comp.v_samp_factor);
+        }
+        (*dst.mem->realize_virt_arrays)((j_common_ptr)&dst);
+
+        {
+            std::lock_guard<std::mutex> lock(srcLock);
+            for (int c = 0; c < src->num_components; ++c)
+            {
+                const jpeg_component_info &comp = src->comp_info[c];
+                const JDIMENSION bx = (JDIMENSION)(x0 / mcuW * comp.h_samp_factor);
+                const JDIMENSION by = (JDIMENSION)(y0 / mcuH * comp.v_samp_factor);
+                const JDIMENSION cols = (JDIMENSION)((w + mcuW - 1) / mcuW * comp.h_samp_factor);
+                for (JDIMENSION r = 0; r < rows[c]; ++r)
+                {
+                    JBLOCKARRAY from = (*src->mem->access_virt_barray)((j_common_ptr)src, srcCoef[c],
+                                                                        by + r, 1, FALSE);
+                    JBLOCKARRAY to = (*dst.mem->access_virt_barray)((j_common_ptr)&dst, coef[c],
+                                                                     r, 1, TRUE);
+                    memcpy(to[0], from[0] + bx, cols * sizeof(JBLOCK));
+                }
+            }
+        }
+
+        jpeg_stdio_dest(&dst, out);
+        jpeg_write_coefficients(&dst, &coef[0]);
+        jpeg_finish_compress(&dst);
+        jpeg_destroy_compress(&dst);
+        return fclose(out) == 0;
+    }
+
+    // split a JPEG held in memory into tiles of tileSize in the directory
+    // dir, which is created if needed. The coefficients are read once,
+    // the tiles are written on 'threads' cores (0 = all).
+    inline bool splitJPEG(const unsigned char *data, const size_t size, const int tileSize,
+                          const std::string &dir, Manifest &m, const unsigned int threads = 0)
+    {
+        if (!PVT::makeDirectories(dir))
+        {
+            std::cout << "can't create " << dir << std::endl;
+            return false;
+        }
+        struct jpeg_decompress_struct src;
+        struct jpeg_error_mgr jerr;
+        src.err = jpeg_std_error(&jerr);
+        jpeg_create_decompress(&src);
+        jpeg_mem_src(&src, (unsigned char *)data, (unsigned long)size);
+        jpeg_read_header(&src, TRUE);
+
+        const int mcuW = src.max_h_samp_factor * DCTSIZE;
+        const int mcuH = src.max_v_samp_factor * DCTSIZE;
+        bool ok = tileSize % mcuW == 0 && tileSize % mcuH == 0;
+#if JPEG_LIB_VERSION >= 80
+        ok = ok && src.block_size == DCTSIZE;
+#endif
+        if (!ok)
+        {
+            std::cout << "tile size " << tileSize << " is not a multiple of the "
+                      << mcuW << "x" << mcuH << " iMCU size" << std::endl;
+            jpeg_destroy_decompress(&src);
+            return false;
+        }
+
+        jvirt_barray_ptr *coef = jpeg_read_coefficients(&src);
+        m.width = src.image_width;
+        m.height = src.image_height;
+        m.tileSize = tileSize;
+
+        const int tilesX = (m.width + tileSize - 1) / tileSize;
+        const int tilesY = (m.height + tileSize - 1) / tileSize;
+        std::mutex srcLock;
+        std::vector<char> written(tilesX * tilesY);
+        PARALLEL::forEach(tilesX * tilesY, [&](int i)
+        {
+            const int tx = i % tilesX, ty = i / tilesX;
+            const int x0 = tx * tileSize, y0 = ty * tileSize;
+            written[i] = writeTile(&src, coef, x0, y0, std::min(tileSize, m.width - x0),
+                                   std::min(tileSize, m.height - y0),
+                                   tileName(dir, tx, ty), srcLock);
+        }, threads);
+
+        jpeg_finish_decompress(&src);
+        jpeg_destroy_decompress(&src);
+
+        // the manifest comes last, a tile set without one is incomplete
+        return std::find(written.begin(), written.end(), 0) == written.end()
+               && writeManifest(dir, m);
+    }
+}
+}
+
+#endif
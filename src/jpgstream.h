@@ -0,0 +1,251 @@
+#ifndef _JPGSTREAM_H_
+#define _JPGSTREAM_H_
+
+// low level helpers to inspect a JPEG byte stream in memory and to feed
+// libjpeg from a list of memory chunks without copying
+
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cstring>
+#include "jpeglib.h"
+
+namespace IMG
+{
+namespace STREAM
+{
+    // JPEG markers used here
+    enum Marker {
+        SOF0 = 0xC0, SOF1 = 0xC1, SOF2 = 0xC2, SOF3 = 0xC3,
+        DHT = 0xC4, JPG = 0xC8, DAC = 0xCC,
+        RST0 = 0xD0, RST7 = 0xD7,
+        SOI = 0xD8, EOI = 0xD9, SOS = 0xDA, DQT = 0xDB, DRI = 0xDD,
+        TEM = 0x01
+    };
+
+    inline int readU16(const unsigned char *p) { return ((int)p[0] << 8) | p[1]; }
+
+    // structure of a JPEG file up to the first scan
+    struct Layout
+    {
+        bool valid;
+        bool progressive;     // SOF2/SOF6/SOF10/SOF14
+        bool arithmetic;      // SOF9..SOF15
+        int width, height;
+        int numComponents;
+        int compId[4], compH[4], compV[4], compTq[4];
+        int hmax, vmax;       // maximum sampling factors
+        int mcuWidth, mcuHeight;
+        int mcusPerRow, mcuRows;
+        int restartInterval;  // in MCUs, 0 if none
+        size_t sofOffset;     // offset of the 0xFF of the frame header
+        size_t sosOffset;     // offset of the 0xFF of the first scan header
+        size_t scanStart;     // first byte of entropy coded data
+        int scanComponents;   // number of components in the first scan
+
+        Layout() : valid(false), progressive(false), arithmetic(false),
+            width(0), height(0), numComponents(0), hmax(1), vmax(1),
+            mcuWidth(8), mcuHeight(8), mcusPerRow(0), mcuRows(0),
+            restartInterval(0), sofOffset(0), sosOffset(0), scanStart(0),
+            scanComponents(0) {}
+    };
+
+    // parse all marker segments up to the first SOS
+    inline bool parseLayout(const unsigned char *data, const size_t size, Layout &L)
+    {
+        L = Layout();
+        if (size < 4 || data[0] != 0xFF || data[1] != SOI) return false;
+
+        size_t pos = 2;
+        bool haveFrame = false;
+        while (pos + 4 <= size)
+        {
+            if (data[pos] != 0xFF) return false;
+            // skip fill bytes
+            while (pos + 1 < size && data[pos + 1] == 0xFF) ++pos;
+            if (pos + 4 > size) return false;
+            const int type = data[pos + 1];
+            if (type == TEM || (type >= RST0 && type <= RST7))
+            {
+                pos += 2;
+                continue;
+            }
+            const int len = readU16(&data[pos + 2]);
+            if (len < 2 || pos + 2 + len > size) return false;
+            const unsigned char *seg = &data[pos + 4];
+
+            if (type >= SOF0 && type <= 0xCF && type != DHT && type != JPG && type != DAC)
+            {
+                if (len < 8) return false;
+                L.sofOffset = pos;
+                L.progressive = (type & 0x03) == 0x02;
+                L.arithmetic = type >= 0xC9;
+                L.height = readU16(&seg[1]);
+                L.width = readU16(&seg[3]);
+                L.numComponents = seg[5];
+                if (L.numComponents < 1 || L.numComponents > 4 ||
+                    len < 8 + 3 * L.numComponents) return false;
+                L.hmax = L.vmax = 1;
+                for (int c = 0; c < L.numComponents; ++c)
+                {
+                    L.compId[c] = seg[6 + 3 * c];
+                    L.compH[c] = seg[7 + 3 * c] >> 4;
+                    L.compV[c] = seg[7 + 3 * c] & 0x0F;
+                    L.compTq[c] = seg[8 + 3 * c];
+                    if (L.compH[c] < 1 || L.compV[c] < 1) return false;
+                    L.hmax = std::max(L.hmax, L.compH[c]);
+                    L.vmax = std::max(L.vmax, L.compV[c]);
+                }
+                haveFrame = true;
+            }
+            else if (type == DRI)
+            {
+                if (len < 4) return false;
+                L.restartInterval = readU16(seg);
+            }
+            else if (type == SOS)
+            {
+                if (!haveFrame || L.width == 0 || L.height == 0) return false;
+                L.sosOffset = pos;
+                L.scanComponents = seg[0];
+                L.scanStart = pos + 2 + len;
+                // a single component scan is not interleaved, MCU is one block
+                if (L.scanComponents == 1)
+                {
+                    int c = 0;
+                    while (c < L.numComponents && L.compId[c] != seg[1]) ++c;
+                    if (c == L.numComponents) return false;
+                    const int cw = (L.width * L.compH[c] + L.hmax - 1) / L.hmax;
+                    const int ch = (L.height * L.compV[c] + L.vmax - 1) / L.vmax;
+                    L.mcuWidth = 8 * L.hmax / L.compH[c];
+                    L.mcuHeight = 8 * L.vmax / L.compV[c];
+                    L.mcusPerRow = (cw + 7) / 8;
+                    L.mcuRows = (ch + 7) / 8;
+                }
+                else
+                {
+                    L.mcuWidth = 8 * L.hmax;
+                    L.mcuHeight = 8 * L.vmax;
+                    L.mcusPerRow = (L.width + L.mcuWidth - 1) / L.mcuWidth;
+                    L.mcuRows = (L.height + L.mcuHeight - 1) / L.mcuHeight;
+                }
+                L.valid = true;
+                return true;
+            }
+            else if (type == EOI)
+            {
+                return false;
+            }
+            pos += 2 + len;
+        }
+        return false;
+    }
+
+    // scan entropy coded data starting at 'start' and record the offset of
+    // every RSTn marker. Returns the offset of the first marker that is not
+    // a restart marker (usually EOI), or size if the data is truncated.
+    inline size_t findRestartMarkers(const unsigned char *data, const size_t size,
+                                     const size_t start, std::vector<size_t> &rst)
+    {
+        size_t pos = start;
+        while (pos + 1 < size)
+        {
+            const unsigned char *ff =
+                (const unsigned char *)memchr(&data[pos], 0xFF, size - pos - 1);
+            if (ff == NULL) break;
+            pos = ff - data;
+            const unsigned char m = data[pos + 1];
+            if (m == 0x00 || m == 0xFF)
+            {
+                // stuffed zero or fill byte
+                pos += (m == 0x00) ? 2 : 1;
+            }
+            else if (m >= RST0 && m <= RST7)
+            {
+                rst.push_back(pos);
+                pos += 2;
+            }
+            else
+            {
+                return pos;
+            }
+        }
+        return size;
+    }
+
+    // libjpeg source manager reading from a list of memory chunks,
+    // this allows to patch parts of a stream without copying the rest
+    struct ChunkSource
+    {
+        struct jpeg_source_mgr pub;   // has to be the first member
+        std::vector< std::pair<const unsigned char *, size_t> > chunks;
+        size_t next;
+
+        ChunkSource() : next(0)
+        {
+            pub.init_source = &initSource;
+            pub.fill_input_buffer = &fillInputBuffer;
+            pub.skip_input_data = &skipInputData;
+            pub.resync_to_restart = &jpeg_resync_to_restart;
+            pub.term_source = &termSource;
+            pub.next_input_byte = NULL;
+            pub.bytes_in_buffer = 0;
+        }
+
+        void add(const unsigned char *p, const size_t n)
+        {
+            if (n > 0) chunks.push_back(std::make_pair(p, n));
+        }
+
+        // install as data source of cinfo, has to outlive the decompression
+        void attach(j_decompress_ptr cinfo)
+        {
+            next = 0;
+            pub.next_input_byte = NULL;
+            pub.bytes_in_buffer = 0;
+            cinfo->src = &pub;
+        }
+
+        static void initSource(j_decompress_ptr) {}
+        static void termSource(j_decompress_ptr) {}
+
+        static boolean fillInputBuffer(j_decompress_ptr cinfo)
+        {
+            static const JOCTET fakeEOI[2] = { 0xFF, EOI };
+            ChunkSource *src = reinterpret_cast<ChunkSource *>(cinfo->src);
+            if (src->next < src->chunks.size())
+            {
+                src->pub.next_input_byte = src->chunks[src->next].first;
+                src->pub.bytes_in_buffer = src->chunks[src->next].second;
+                ++src->next;
+            }
+            else
+            {
+                // premature end of data, behave like jdatasrc.c
+                src->pub.next_input_byte = fakeEOI;
+                src->pub.bytes_in_buffer = 2;
+            }
+            return TRUE;
+        }
+
+        static void skipInputData(j_decompress_ptr cinfo, long num_bytes)
+        {
+            struct jpeg_source_mgr *src = cinfo->src;
+            while (num_bytes > (long)src->bytes_in_buffer)
+            {
+                num_bytes -= (long)src->bytes_in_buffer;
+                fillInputBuffer(cinfo);
+            }
+            if (num_bytes > 0)
+            {
+                src->next_input_byte += num_bytes;
+                src->bytes_in_buffer -= num_bytes;
+            }
+        }
+    };
+
+} // namespace STREAM
+} // namespace IMG
+
+#endif
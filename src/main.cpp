@@ -13,10 +13,12 @@
 #include "camera.h"
 
 #include <sstream>
+#include <fstream>
+#include <iomanip>
 #include <chrono>
-#include <thread>
 
 #include "imgjpg.h"
+#include "rectilinear.h"
 #include "TiledImage.h"
 
 // font stuff
@@ -27,6 +29,7 @@
 #endif
 
 #include "glutil.h"
+#include "glprofile.h"
 
 #define PI 3.141592653589793238462643
 #define PIf 3.14159265358979323846264f
@@ -67,8 +70,47 @@ NavigationMode m_navmode = NAV_NONE;
 // DISPLAY
 bool m_showText = true, m_showHelp = false;
 
+// RENDER LOOP
+// frames are drawn on demand: input, resizes, loads and overlay updates set
+// m_redraw, the loop sleeps in glfwWaitEvents otherwise, the background
+// loader wakes it with an empty event for every tile or band it hands
+// over. Flying and uploads render continuously, paced by vsync.
+bool m_redraw = true;
+double m_overlayDue = -1.0; // glfwGetTime() of the next FPS update, if any
+
+// FRAME TIMING
+// CPU and GPU time of the stages of the last frames, see glprofile.h
+GLUTIL::FrameProfiler m_profiler;
+int m_stageFrame, m_stageClear, m_stageTiles, m_stageTile, m_stageText,
+    m_stageSwap;
+bool m_showTimes = false;
+std::string m_profilePath; // the times are written to it on exit, if set
+
 // PROGRAM MODES
 bool f_compatibilityMode = false;
+bool f_tileCulling = true;
+bool f_compressTiles = false; // BC1 tiles, a sixth of the video memory
+bool f_cubemap = false;        // show the panorama as a cube map
+bool f_zeroCopy = false;       // decode into mapped buffers, no cache
+int m_tilesDrawn, m_tilesTotal; // by the shader path in the last frame
+
+// COMPATIBILITY MODE MESHES
+// the sphere patches of the tiles of an image, made once per tile layout.
+// Every tile has quads over just its own part of the sphere, texture
+// coordinates and vertices interleaved (GL_T2F_V3F), in a vertex buffer
+// object with OpenGL 1.5 and in client memory otherwise.
+struct TileMesh {
+  GLuint buffer;             // 0 without vertex buffer objects
+  std::vector<GLfloat> data; // without vertex buffer objects
+  GLsizei vertices;
+  TileMesh() : buffer(0), vertices(0) {}
+};
+struct TileMeshes {
+  int width, height, tileSize, gutter; // the layout they were made for
+  std::vector<TileMesh> tiles;          // row by row
+  TileMeshes() : width(0), height(0), tileSize(0), gutter(0) {}
+};
+TileMeshes m_previewMeshes, m_tileMeshes;
 
 // SHADER VARIABLES
 
@@ -76,9 +118,18 @@ GLuint m_glslprogram;
 GLuint m_vertexshader;
 GLuint m_fragmentshader;
 
-GLint unLocTileBoundary;
+GLint unLocTileBoundary, unTexBoundary;
 GLint unTex;
 
+// single pass program for images with all tiles in one array texture
+GLuint m_arrayprogram;
+GLint unArrayTiles, unArrayMask, unArrayTiling, unArrayInset;
+bool m_drewArray; // instead of single tiles in the last frame
+
+// program for cube maps
+GLuint m_cubeprogram;
+GLint unCube;
+
 // Vertex Shader
 // calculates the screen position for the fragment shader (gl_Position)
 // plus states the world coordinate for each vertex as varying (position)
@@ -104,26 +155,40 @@ const std::string m_glsl_vertexshadersrc =
 // neglected
 //                                         since (x,y,z) is already normalized
 //
+// the texture covers the tile and its gutters (texboundary). With
+// ARB_shader_texture_lod the mipmap level is chosen from the gradients of
+// the continuous position, the jump of atan at 360 degrees would select the
+// smallest one otherwise.
 std::string m_glsl_fragmentshadersrc =
+    "#ifdef GL_ARB_shader_texture_lod\n"
+    "#extension GL_ARB_shader_texture_lod : enable\n"
+    "#endif\n"
     " const float pi = 3.141592653589793;"
     " varying vec3 position;"
     " uniform sampler2D tex;"
     " uniform vec4 tileboundary;"
+    " uniform vec4 texboundary;"
     "   void main() {"
     "   vec2 spherecoords;"
     "   vec3 spherepos = normalize(position);"
     "   spherecoords.x = (atan(spherepos.y, -spherepos.x)+pi)/(2.0*pi);"
     "   spherecoords.y = acos(spherepos.z)/(pi);"
+    "   vec2 scale = 1.0 / (texboundary.yw - texboundary.xz);"
+    "   vec2 dx = dFdx(spherecoords);"
+    "   vec2 dy = dFdy(spherecoords);"
+    "   dx.x -= floor(dx.x + 0.5);"
+    "   dy.x -= floor(dy.x + 0.5);"
     "   if ( (spherecoords.x >= tileboundary.x) && (spherecoords.x <= "
     "tileboundary.y) && "
     "        (spherecoords.y >= tileboundary.z) && (spherecoords.y <= "
     "tileboundary.w) ) { "
-    "           vec2 texpos;"
-    "           texpos.x = "
-    "(spherecoords.x-tileboundary.x)/(tileboundary.y-tileboundary.x); "
-    "           texpos.y = "
-    "(spherecoords.y-tileboundary.z)/(tileboundary.w-tileboundary.z); "
-    "           gl_FragColor = texture2D(tex,texpos);"
+    "           vec2 texpos = (spherecoords - texboundary.xz) * scale;\n"
+    "#ifdef GL_ARB_shader_texture_lod\n"
+    "           gl_FragColor = texture2DGradARB(tex, texpos, dx * scale,"
+    "                                           dy * scale);\n"
+    "#else\n"
+    "           gl_FragColor = texture2D(tex,texpos);\n"
+    "#endif\n"
     //"           gl_FragColor = vec4(1.0,0.0,0.0,1.0);"
     //"           gl_FragColor = vec4(position.x,position.y,position.z,1.0);"
     "   } else { "
@@ -133,6 +198,64 @@ std::string m_glsl_fragmentshadersrc =
     //"           gl_FragColor = vec4(1.0,0.0,0.0,1.0);"
     " }";
 
+// Single pass for tiles in an array texture: the position in units of tiles
+// gives the tile, its layer and the coordinates in it. Tiles that are not
+// loaded yet are discarded, so the preview drawn before shows through. The
+// gradients are those of the continuous position, tile borders and the
+// wrap around at 360 degrees would select the smallest mipmap otherwise.
+// A tile starts at inset.x in its layer and covers inset.y of it, the rest
+// are its gutters.
+const std::string m_glsl_arrayvertexshadersrc =
+    "#version 130\n"
+    " out vec3 position;"
+    " void main() {"
+    "   gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;"
+    "   position = gl_Vertex.xyz;"
+    " }";
+
+const std::string m_glsl_arrayfragmentshadersrc =
+    "#version 130\n"
+    " const float pi = 3.141592653589793;"
+    " in vec3 position;"
+    " uniform sampler2DArray tiles;"
+    " uniform sampler2D mask;"
+    " uniform vec4 tiling;" // image size in tiles, number of tiles
+    " uniform vec2 inset;"
+    " void main() {"
+    "   vec3 spherepos = normalize(position);"
+    "   vec2 spherecoords = vec2((atan(spherepos.y, -spherepos.x)+pi)/(2.0*pi),"
+    "                            acos(spherepos.z)/pi);"
+    "   vec2 t = spherecoords * tiling.xy;"
+    "   vec2 dx = dFdx(t);"
+    "   vec2 dy = dFdy(t);"
+    "   dx.x -= tiling.x * floor(dx.x / tiling.x + 0.5);"
+    "   dy.x -= tiling.x * floor(dy.x / tiling.x + 0.5);"
+    "   ivec2 tile = min(ivec2(t), ivec2(tiling.zw) - 1);"
+    "   if (texelFetch(mask, tile, 0).r == 0.0) {"
+    "     discard;"
+    "   }"
+    "   float layer = float(tile.y * int(tiling.z) + tile.x);"
+    "   vec2 texpos = inset.x + (t - vec2(tile)) * inset.y;"
+    "   gl_FragColor = textureGrad(tiles, vec3(texpos, layer), dx * inset.y,"
+    "                              dy * inset.y);"
+    " }";
+
+// Cube maps: the world position is the lookup direction, only with the
+// y and z axes swapped (world z is up, cube y is), see cubemap.h
+const std::string m_glsl_cubevertexshadersrc =
+    " varying vec3 position;"
+    " void main() {"
+    "   gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;"
+    "   position = gl_Vertex.xyz;"
+    " }";
+
+const std::string m_glsl_cubefragmentshadersrc =
+    " varying vec3 position;"
+    " uniform samplerCube cube;"
+    " void main() {"
+    "   gl_FragColor = textureCube(cube, position.xzy);"
+    " }";
+
 /*
 " const float pi = 3.141592653589793; \
 varying vec3 position;\
@@ -162,6 +285,34 @@ void cleanup() {
   //}
 }
 
+void printProgramInfoLog(GLuint obj);
+
+// compile and link a program, 0 if that fails
+GLuint createProgram(const std::string &vertexsrc,
+                     const std::string &fragmentsrc) {
+  const char *src[2] = {vertexsrc.c_str(), fragmentsrc.c_str()};
+  const GLenum types[2] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
+  GLuint program = glCreateProgram();
+  for (int i = 0; i < 2; ++i) {
+    GLuint shader = glCreateShader(types[i]);
+    glShaderSource(shader, 1, &src[i], NULL);
+    glCompileShader(shader);
+    glAttachShader(program, shader);
+    // deleted with the program
+    glDeleteShader(shader);
+  }
+  glLinkProgram(program);
+  checkGLError("create program");
+  int param = 0;
+  glGetProgramiv(program, GL_LINK_STATUS, &param);
+  if (param != GL_TRUE) {
+    printProgramInfoLog(program);
+    glDeleteProgram(program);
+    return 0;
+  }
+  return program;
+}
+
 void printProgramInfoLog(GLuint obj) {
   int infologLength = 0;
   int charsWritten = 0;
@@ -207,6 +358,8 @@ void generateDummyTexture(ImageT<unsigned char> &img) {
   }
 }
 
+bool draw();
+
 bool setupGL() {
   checkGLError("enter setupGL");
   m_fps = -1;
@@ -246,6 +399,16 @@ bool setupGL() {
 
   glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexSize);
   panodata.setTileSize(2048);
+  // neighbour pixels around the tiles for seamless trilinear filtering,
+  // mipmaps down to 1/16
+  panodata.setGutter(16);
+  panodata.setStreaming(true);
+  panodata.setPreview(true);
+  panodata.setCache(true);
+  panodata.setOnDemand(true);
+  panodata.setIndexing(true);
+  // tiles are loaded in the background and uploaded by the main loop
+  panodata.setUploadBudget(4.0);
   glGetIntegerv(GL_MAX_TEXTURE_UNITS, &iUnits);
   {
     // std::ostringstream os;
@@ -280,21 +443,6 @@ bool setupGL() {
     font.initialize();
   }
 
-  // load pano and register textures
-  panodata.loadFromJPEG(m_image_path);
-  if (!panodata.isValid()) {
-    panodata.generateDummyTexture();
-  }
-
-  {
-    std::cout << "Image size is " << panodata.width() << "x"
-              << panodata.height() << " OpenGL reports maximum texture size of "
-              << maxTexSize << "px." << std::endl;
-    std::cout << "Tile size is " << panodata.getTileSize() << ", using "
-              << panodata.numTilesX() << "x" << panodata.numTilesY()
-              << " tiles." << std::endl;
-  }
-
   // select modulate to mix texture with color for shading
   glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
   //// when texture area is small, bilinear filter the closest mipmap
@@ -349,6 +497,7 @@ bool setupGL() {
       checkGLError("use program");
 
       unLocTileBoundary = glGetUniformLocation(m_glslprogram, "tileboundary");
+      unTexBoundary = glGetUniformLocation(m_glslprogram, "texboundary");
       checkGLError("get uniform tileboundary location");
       unTex = glGetUniformLocation(m_glslprogram, "tex");
       checkGLError("get uniform texture");
@@ -361,11 +510,67 @@ bool setupGL() {
     }
   }
 
+  // all tiles in one array texture if it can be drawn
+  if (!f_compatibilityMode && m_arrayprogram == 0 && GLEW_VERSION_3_0) {
+    m_arrayprogram = createProgram(m_glsl_arrayvertexshadersrc,
+                                   m_glsl_arrayfragmentshadersrc);
+    if (m_arrayprogram != 0) {
+      unArrayTiles = glGetUniformLocation(m_arrayprogram, "tiles");
+      unArrayMask = glGetUniformLocation(m_arrayprogram, "mask");
+      unArrayTiling = glGetUniformLocation(m_arrayprogram, "tiling");
+      unArrayInset = glGetUniformLocation(m_arrayprogram, "inset");
+    }
+  }
+  if (!f_compatibilityMode && m_cubeprogram == 0) {
+    m_cubeprogram = createProgram(m_glsl_cubevertexshadersrc,
+                                  m_glsl_cubefragmentshadersrc);
+    if (m_cubeprogram != 0) {
+      unCube = glGetUniformLocation(m_cubeprogram, "cube");
+    }
+  }
+  panodata.setTextureArray(!f_compatibilityMode && m_arrayprogram != 0);
+  panodata.setCompression(f_compressTiles);
+  panodata.setZeroCopy(f_zeroCopy);
+  panodata.setCubemap(f_cubemap);
+  panodata.setCubeFilter(IMG::CUBE::BICUBIC);
+
   glDisable(GL_DEPTH_TEST);
   glPolygonMode(GL_FRONT, GL_FILL);
 
+  // load pano, the textures of its tiles are created by the main loop
+  panodata.setViewDirection(-camera.getZ());
+  if (TiledImage::isTileSet(m_image_path)) {
+    panodata.loadFromTileSet(m_image_path);
+  } else if (TiledImage::isCubeFaceSet(m_image_path)) {
+    panodata.loadFromCubeFaces(m_image_path);
+  } else {
+    panodata.loadFromJPEG(m_image_path);
+  }
+  if (!panodata.isValid()) {
+    panodata.generateDummyTexture();
+  }
+
+  {
+    std::cout << "Image size is " << panodata.width() << "x"
+              << panodata.height() << " OpenGL reports maximum texture size of "
+              << maxTexSize << "px." << std::endl;
+    if (panodata.hasCubeFaces()) {
+      std::cout << "Cube faces are " << panodata.getFaceSize() << "px";
+      if (panodata.numFaceTiles() > 0) {
+        std::cout << ", using " << panodata.numFaceTiles() << "x"
+                  << panodata.numFaceTiles() << " tiles per face";
+      }
+      std::cout << "." << std::endl;
+    } else {
+      std::cout << "Tile size is " << panodata.getTileSize() << ", using "
+                << panodata.numTilesX() << "x" << panodata.numTilesY()
+                << " tiles." << std::endl;
+    }
+  }
+
   checkGLError("exit setupGL");
 
+  m_redraw = true;
   return true;
 }
 
@@ -376,10 +581,370 @@ void setupViewport(const int left, const int top, const int width,
       (double)left, (double)top, (double)left + width, (double)top + height));
 }
 
+// largest angle between neighbouring vertices of the tile meshes
+const double MESH_STEP = PI / 45.0; // 4 degrees
+
+void releaseTileMeshes(TileMeshes &meshes) {
+  for (size_t i = 0; i < meshes.tiles.size(); ++i) {
+    if (meshes.tiles[i].buffer != 0) {
+      glDeleteBuffers(1, &meshes.tiles[i].buffer);
+    }
+  }
+  meshes = TileMeshes();
+}
+
+// make the meshes of the tiles of an image unless they were made for its
+// layout already. A tile is split into quads of at most MESH_STEP in both
+// angles, so small tiles get few quads and the whole sphere about the same
+// number for any tile size.
+void updateTileMeshes(const TiledImage &tiles, TileMeshes &meshes) {
+  const int ntx = tiles.numTilesX(), nty = tiles.numTilesY();
+  if (meshes.width == tiles.width() && meshes.height == tiles.height() &&
+      meshes.tileSize == tiles.getTileSize() &&
+      meshes.gutter == tiles.getGutter() &&
+      meshes.tiles.size() == (size_t)(ntx * nty)) {
+    return;
+  }
+  releaseTileMeshes(meshes);
+  meshes.width = tiles.width();
+  meshes.height = tiles.height();
+  meshes.tileSize = tiles.getTileSize();
+  meshes.gutter = tiles.getGutter();
+  meshes.tiles.resize(ntx * nty);
+  const bool vbo = GLEW_VERSION_1_5 != 0;
+  static const int corner[4][2] = {{0, 0}, {0, 1}, {1, 1}, {1, 0}};
+  std::vector<GLfloat> data;
+  for (int ty = 0; ty < nty; ++ty) {
+    for (int tx = 0; tx < ntx; ++tx) {
+      float xmin, xmax, ymin, ymax, texxmin, texxmax, texymin, texymax;
+      tiles.getNormalizedTileCoordinates(tx, ty, xmin, xmax, ymin, ymax);
+      tiles.getNormalizedTextureCoordinates(tx, ty, texxmin, texxmax, texymin,
+                                            texymax);
+      const int cols =
+          std::max(1, (int)ceil(2.0 * PI * (xmax - xmin) / MESH_STEP));
+      const int rows = std::max(1, (int)ceil(PI * (ymax - ymin) / MESH_STEP));
+      data.clear();
+      data.reserve(20 * cols * rows);
+      for (int j = 0; j < rows; ++j) {
+        for (int i = 0; i < cols; ++i) {
+          for (int k = 0; k < 4; ++k) {
+            const double u = xmin + (xmax - xmin) * (i + corner[k][0]) / cols;
+            const double v = ymin + (ymax - ymin) * (j + corner[k][1]) / rows;
+            // the inverse of the mapping of the fragment shader
+            const double theta = PI * v, phi = 2.0 * PI * u - PI;
+            data.push_back((GLfloat)((u - texxmin) / (texxmax - texxmin)));
+            data.push_back((GLfloat)((v - texymin) / (texymax - texymin)));
+            data.push_back((GLfloat)(-sin(theta) * cos(phi)));
+            data.push_back((GLfloat)(sin(theta) * sin(phi)));
+            data.push_back((GLfloat)cos(theta));
+          }
+        }
+      }
+      TileMesh &mesh = meshes.tiles[ty * ntx + tx];
+      mesh.vertices = (GLsizei)(data.size() / 5);
+      if (vbo) {
+        glGenBuffers(1, &mesh.buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.buffer);
+        glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(GLfloat), &data[0],
+                     GL_STATIC_DRAW);
+      } else {
+        mesh.data = data;
+      }
+    }
+  }
+  if (vbo) {
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+  checkGLError("make tile meshes");
+}
+
+// fixed function rendering of all tiles of an image, one draw call per
+// tile of its cached mesh
+void drawTilesCompatibility(const TiledImage &tiles, TileMeshes &meshes) {
+  updateTileMeshes(tiles, meshes);
+  glColor3f(1.0f, 1.0f, 1.0f);
+  bool bound = false; // a vertex buffer object
+  for (int ty = 0, tym = tiles.numTilesY(); ty < tym; ++ty) {
+    for (int tx = 0, txm = tiles.numTilesX(); tx < txm; ++tx) {
+      int texname = tiles.getTile(tx, ty);
+      if (texname == 0) {
+        continue; // not loaded yet
+      }
+      m_profiler.begin(m_stageTile);
+      glBindTexture(GL_TEXTURE_2D, texname);
+      checkGLError("bind tile texture");
+      const TileMesh &mesh = meshes.tiles[ty * txm + tx];
+      if (mesh.buffer != 0) {
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.buffer);
+        glInterleavedArrays(GL_T2F_V3F, 0, 0);
+        bound = true;
+      } else {
+        glInterleavedArrays(GL_T2F_V3F, 0, &mesh.data[0]);
+      }
+      glDrawArrays(GL_QUADS, 0, mesh.vertices);
+      checkGLError("draw tile mesh");
+      m_profiler.end(m_stageTile);
+    }
+  }
+  // the other paths pass vertices from client memory
+  if (bound) {
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+// half angle of the view cone, from the view direction to the corners of
+// the frustum
+double viewConeAngle() {
+  const Camera<double>::ViewFrustum VF = camera.getViewFrustum();
+  const double x = std::max(-VF.min[0], VF.max[0]);
+  const double y = std::max(-VF.min[1], VF.max[1]);
+  return atan(sqrt(x * x + y * y) / VF.min[2]);
+}
+
+// rectangle on the near plane (camera coordinates) that contains the
+// projection of a tile, clipped to the frustum. False if the tile is not
+// visible. Tiles reaching behind the camera get the whole near plane.
+// border is scratch space for the samples of the tile border.
+bool tileNearPlaneBounds(const TiledImage &tiles, const int tx, const int ty,
+                         const double coneAngle, std::vector<Vec3d> &border,
+                         Vec2d &bmin, Vec2d &bmax) {
+  const Camera<double>::ViewFrustum VF = camera.getViewFrustum();
+  bmin.assign(VF.min[0], VF.min[1]);
+  bmax.assign(VF.max[0], VF.max[1]);
+  Vec3d center;
+  double radius;
+  tiles.getTileBounds(tx, ty, center, radius);
+  const double offAxis =
+      acos(std::max(-1.0, std::min(1.0, center * -camera.getZ())));
+  if (offAxis - radius > coneAngle) {
+    return false;
+  }
+  if (offAxis + radius > 0.49 * PI) {
+    return true;
+  }
+
+  // all of the tile is in front, its projection is bounded by the one of
+  // its border
+  tiles.getTileBorder(tx, ty, 16, border);
+  const double zn = VF.min[2];
+  Vec2d pmin(1e30, 1e30), pmax(-1e30, -1e30), last(0.0, 0.0);
+  double step = 0.0;
+  for (size_t i = 0; i <= border.size(); ++i) {
+    const Vec3d c = camera.world2cam(border[i % border.size()]);
+    const Vec2d p(c[0] * zn / -c[2], c[1] * zn / -c[2]);
+    for (int k = 0; k < 2; ++k) {
+      pmin[k] = std::min(pmin[k], p[k]);
+      pmax[k] = std::max(pmax[k], p[k]);
+    }
+    if (i > 0) {
+      step = std::max(step, sqrt((p - last) * (p - last)));
+    }
+    last = p;
+  }
+  // the projected border bulges out between the samples
+  for (int k = 0; k < 2; ++k) {
+    bmin[k] = std::max(bmin[k], pmin[k] - step / 8.0);
+    bmax[k] = std::min(bmax[k], pmax[k] + step / 8.0);
+  }
+  return bmin[0] < bmax[0] && bmin[1] < bmax[1];
+}
+
+// shader mode with an array texture: one pass over the screen for all tiles
+void drawTileArray(const TiledImage &tiles) {
+  const Camera<double>::ViewFrustum VF = camera.getViewFrustum();
+  const double z = VF.min[2] + 0.0001;
+  const double scale = z / VF.min[2];
+  const Vec3d quad[4] = {
+      camera.cam2world(Vec3d(VF.max[0] * scale, VF.min[1] * scale, -z)),
+      camera.cam2world(Vec3d(VF.max[0] * scale, VF.max[1] * scale, -z)),
+      camera.cam2world(Vec3d(VF.min[0] * scale, VF.max[1] * scale, -z)),
+      camera.cam2world(Vec3d(VF.min[0] * scale, VF.min[1] * scale, -z))};
+  glVertexPointer(3, GL_DOUBLE, 0, quad);
+  checkGLError("set vertexpointer");
+
+  glUseProgram(m_arrayprogram);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, tiles.getTileMask());
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, tiles.getTileArray());
+  checkGLError("activate tile array");
+  glUniform1i(unArrayTiles, 0);
+  glUniform1i(unArrayMask, 1);
+  const double ts = tiles.getTileSize();
+  glUniform4f(unArrayTiling, (float)(tiles.width() / ts),
+              (float)(tiles.height() / ts), (float)tiles.numTilesX(),
+              (float)tiles.numTilesY());
+  const double layer = ts + 2 * tiles.getGutter();
+  glUniform2f(unArrayInset, (float)(tiles.getGutter() / layer),
+              (float)(ts / layer));
+  checkGLError("set tiling");
+
+  glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+  checkGLError("draw arrays");
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+  glUseProgram(m_glslprogram);
+}
+
+// shader mode: one pass per visible tile over the part of the screen it
+// covers, the fragment shader maps the viewing ray to the tile
+void drawTilesShader(const TiledImage &tiles) {
+  const Camera<double>::ViewFrustum VF = camera.getViewFrustum();
+  const double coneAngle = viewConeAngle();
+  // the quads are just behind the near plane, scaled to keep their
+  // projection
+  const double z = VF.min[2] + 0.0001;
+  const double scale = z / VF.min[2];
+  float xmin, xmax, ymin, ymax;
+  std::vector<Vec3d> border;
+  for (int ty = 0, tym = tiles.numTilesY(); ty < tym; ++ty) {
+    for (int tx = 0, txm = tiles.numTilesX(); tx < txm; ++tx) {
+      // activate tile
+      int texname = tiles.getTile(tx, ty);
+      if (texname == 0) {
+        continue; // not loaded yet
+      }
+      ++m_tilesTotal;
+      Vec2d bmin(VF.min[0], VF.min[1]), bmax(VF.max[0], VF.max[1]);
+      if (f_tileCulling &&
+          !tileNearPlaneBounds(tiles, tx, ty, coneAngle, border, bmin,
+                               bmax)) {
+        continue;
+      }
+      ++m_tilesDrawn;
+      m_profiler.begin(m_stageTile);
+      const Vec3d quad[4] = {
+          camera.cam2world(Vec3d(bmax[0] * scale, bmin[1] * scale, -z)),
+          camera.cam2world(Vec3d(bmax[0] * scale, bmax[1] * scale, -z)),
+          camera.cam2world(Vec3d(bmin[0] * scale, bmax[1] * scale, -z)),
+          camera.cam2world(Vec3d(bmin[0] * scale, bmin[1] * scale, -z))};
+      glVertexPointer(3, GL_DOUBLE, 0, quad);
+      checkGLError("set vertexpointer");
+
+      glBindTexture(GL_TEXTURE_2D, texname);
+      checkGLError("activate tile texture");
+
+      // shader needs to know the tile position on the sphere
+      tiles.getNormalizedTileCoordinates(tx, ty, xmin, xmax, ymin, ymax);
+      // std::cout << " tx: " << tx << " ty: " << ty << " texname: " <<
+      // texname << " xmin: " << xmin << " xmax: " << xmax << " ymin:" << ymin
+      // << " ymax: " << ymax << std::endl;
+      glUniform4f(unLocTileBoundary, xmin, xmax, ymin, ymax);
+      tiles.getNormalizedTextureCoordinates(tx, ty, xmin, xmax, ymin, ymax);
+      glUniform4f(unTexBoundary, xmin, xmax, ymin, ymax);
+      checkGLError("set tile boundary");
+
+      glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+      checkGLError("draw arrays");
+      m_profiler.end(m_stageTile);
+    }
+  }
+}
+
+// shader mode with a cube map: one pass over the screen, one texture
+// lookup per pixel
+void drawCubemap(const TiledImage &cube) {
+  const Camera<double>::ViewFrustum VF = camera.getViewFrustum();
+  const double z = VF.min[2] + 0.0001;
+  const double scale = z / VF.min[2];
+  const Vec3d quad[4] = {
+      camera.cam2world(Vec3d(VF.max[0] * scale, VF.min[1] * scale, -z)),
+      camera.cam2world(Vec3d(VF.max[0] * scale, VF.max[1] * scale, -z)),
+      camera.cam2world(Vec3d(VF.min[0] * scale, VF.max[1] * scale, -z)),
+      camera.cam2world(Vec3d(VF.min[0] * scale, VF.min[1] * scale, -z))};
+  glVertexPointer(3, GL_DOUBLE, 0, quad);
+  checkGLError("set vertexpointer");
+
+  glUseProgram(m_cubeprogram);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_CUBE_MAP, cube.getCubemap());
+  glUniform1i(unCube, 0);
+  checkGLError("activate cube map");
+
+  glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+  checkGLError("draw arrays");
+  glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+  glUseProgram(m_glslprogram);
+}
+
+// fixed function rendering of the faces of a cube map as a box around the
+// camera, between the near and the far plane. A single cube map texture is
+// looked up by direction, tiled faces are drawn one quad per tile.
+void drawCubeFaces(const TiledImage &cube) {
+  const double BOX = 0.5;
+  const GLuint cubemap = cube.getCubemap();
+  const int tiles = cubemap != 0 ? 1 : cube.numFaceTiles();
+  const int n = cube.getFaceSize();
+  const int ts = cubemap != 0 ? n : cube.getFaceTileSize();
+  glColor3f(1.0f, 1.0f, 1.0f);
+  if (cubemap != 0) {
+    glDisable(GL_TEXTURE_2D);
+    glEnable(GL_TEXTURE_CUBE_MAP);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap);
+  }
+  for (int f = 0; f < 6; ++f) {
+    for (int ty = 0; ty < tiles; ++ty) {
+      for (int tx = 0; tx < tiles; ++tx) {
+        // the tile on the face in [-1,1]
+        const float s[2] = {2.0f * tx * ts / n - 1.0f,
+                            2.0f * std::min(n, (tx + 1) * ts) / n - 1.0f};
+        const float t[2] = {2.0f * ty * ts / n - 1.0f,
+                            2.0f * std::min(n, (ty + 1) * ts) / n - 1.0f};
+        m_profiler.begin(m_stageTile);
+        float u[2], v[2];
+        if (cubemap == 0) {
+          glBindTexture(GL_TEXTURE_2D, cube.getFaceTile(f, tx, ty));
+          cube.getFaceTileTextureCoordinates(tx, u[0], u[1]);
+          cube.getFaceTileTextureCoordinates(ty, v[0], v[1]);
+        }
+        glBegin(GL_QUADS);
+        static const int corner[4][2] = {{0, 0}, {0, 1}, {1, 1}, {1, 0}};
+        for (int k = 0; k < 4; ++k) {
+          const int i = corner[k][0], j = corner[k][1];
+          float d[3];
+          IMG::CUBE::faceDirection(f, s[i], t[j], d);
+          if (cubemap != 0) {
+            glTexCoord3fv(d);
+          } else {
+            glTexCoord2f(u[i], v[j]);
+          }
+          // cube to world coordinates
+          glVertex3d(BOX * d[0], BOX * d[2], BOX * d[1]);
+        }
+        glEnd();
+        m_profiler.end(m_stageTile);
+      }
+    }
+  }
+  if (cubemap != 0) {
+    glDisable(GL_TEXTURE_CUBE_MAP);
+    glEnable(GL_TEXTURE_2D);
+  }
+  checkGLError("draw cube faces");
+}
+
+// percentiles of the CPU and GPU time of a stage for the overlay
+std::string stageTimes(const int stage) {
+  const double p[3] = {50.0, 95.0, 99.0};
+  double cpu[3], gpu[3];
+  m_profiler.cpu(stage).percentiles(p, 3, cpu);
+  m_profiler.gpu(stage).percentiles(p, 3, gpu);
+  std::ostringstream os;
+  os << std::fixed << std::setprecision(2) << m_profiler.name(stage)
+     << "  cpu " << cpu[0] << " / " << cpu[1] << " / " << cpu[2];
+  if (m_profiler.gpu(stage).count() > 0) {
+    os << "  gpu " << gpu[0] << " / " << gpu[1] << " / " << gpu[2];
+  }
+  return os.str();
+}
+
 bool draw() {
   checkGLError("enter draw");
 
+  m_profiler.begin(m_stageClear);
   glClear(GL_COLOR_BUFFER_BIT); // Clear The Screen
+  m_profiler.end(m_stageClear);
   glDisable(GL_DEPTH_TEST);
 
   glMatrixMode(GL_MODELVIEW);
@@ -389,6 +954,7 @@ bool draw() {
   glMatrixMode(GL_PROJECTION); // Select The Projection Matrix
   glLoadMatrixd(camera.getProjection());
 
+  m_profiler.begin(m_stageTiles);
   if (f_compatibilityMode) {
 
     glEnable(GL_BLEND);
@@ -399,85 +965,23 @@ bool draw() {
     glEnable(GL_TEXTURE_2D);
     glActiveTexture(GL_TEXTURE0);
 
-    // patch coordinates
-    Vec3d lu, ru, ld, rd; // left up, right up, left down, right down
-
-    // compatibility mode: just draw quadratic patches on a sphere
-    const int SPHERESAMPLING = 30;
-    glColor3f(1.0f, 1.0f, 1.0f);
-
-    // manually calculate sphere patches and equirectangular texture coords
-    for (int ty = 0, tym = panodata.numTilesY(); ty < tym; ++ty) {
-      for (int tx = 0, txm = panodata.numTilesX(); tx < txm; ++tx) {
-        int texname = panodata.getTile(tx, ty);
-        glBindTexture(GL_TEXTURE_2D, texname);
-        checkGLError("bind tile texture");
-        float tilexmin, tilexmax, tileymin, tileymax;
-        panodata.getNormalizedTileCoordinates(tx, ty, tilexmin, tilexmax,
-                                              tileymin, tileymax);
-
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
-                        GL_CLAMP_TO_BORDER); // GL_CLAMP_TO_BORDER
-        // checkGLError();
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-        // checkGLError();
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        // checkGLError();
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        // checkGLError();
-        const float color[] = {0.0f, 0.0f, 0.0f, 0.0f};
-        glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, color);
-        // checkGLError();
-
-        glBegin(GL_QUADS); // Start Drawing Quads
-
-        for (int i_theta = 0; i_theta < SPHERESAMPLING; i_theta++) {
-          for (int i_phi = 0; i_phi < SPHERESAMPLING; i_phi++) {
-            const double theta = (double)i_theta / (SPHERESAMPLING);
-            const double theta1 = (double)(i_theta + 1) / SPHERESAMPLING;
-            const double phi = (double)i_phi / SPHERESAMPLING;
-            const double phi1 = (double)(i_phi + 1) / SPHERESAMPLING;
-
-            // calculate patch points
-            spherical_to_cartesian(PI * theta, 2.0 * PI * phi - PI, lu);
-            spherical_to_cartesian(PI * theta, 2.0 * PI * phi1 - PI, ru);
-            spherical_to_cartesian(PI * theta1, 2.0 * PI * phi - PI, ld);
-            spherical_to_cartesian(PI * theta1, 2.0 * PI * phi1 - PI, rd);
-
-            //
-            double tcx0 = (phi - tilexmin) / (tilexmax - tilexmin);
-            double tcx1 = (phi1 - tilexmin) / (tilexmax - tilexmin);
-            double tcy0 = (theta - tileymin) / (tileymax - tileymin);
-            double tcy1 = (theta1 - tileymin) / (tileymax - tileymin);
-
-            glTexCoord2d(tcx0, tcy0);
-            glVertex3dv(lu);
-            glTexCoord2d(tcx0, tcy1);
-            glVertex3dv(ld);
-            glTexCoord2d(tcx1, tcy1);
-            glVertex3dv(rd);
-            glTexCoord2d(tcx1, tcy0);
-            glVertex3dv(ru);
-          }
-        }
-        glEnd();
-        checkGLError("end quads");
-      }
+    // low resolution preview first, refined tiles are blended on top
+    if (panodata.getPreview()) {
+      drawTilesCompatibility(*panodata.getPreview(), m_previewMeshes);
+    }
+    if (panodata.hasCubeFaces()) {
+      drawCubeFaces(panodata);
+    } else {
+      drawTilesCompatibility(panodata, m_tileMeshes);
     }
 
   } else {
     glDisable(GL_BLEND);
     glDisable(GL_LIGHTING);
     glDisable(GL_DEPTH_TEST);
-    const Camera<double>::ViewFrustum VF = camera.getViewFrustum();
 
     checkGLError("enter fast rendering");
 
-    const Vec3d QuadWorld[4] = {
-        camera.cam2world(Vec3d(VF.max[0], VF.min[1], -VF.min[2] - 0.0001)),
-        camera.cam2world(Vec3d(VF.max[0], VF.max[1], -VF.min[2] - 0.0001)),
-        camera.cam2world(Vec3d(VF.min[0], VF.max[1], -VF.min[2] - 0.0001)),
-        camera.cam2world(Vec3d(VF.min[0], VF.min[1], -VF.min[2] - 0.0001))};
     glDisable(GL_TEXTURE_2D);
     glDisable(GL_LIGHTING);
 
@@ -490,32 +994,29 @@ bool draw() {
 
     glEnableClientState(GL_VERTEX_ARRAY);
     checkGLError("set vertexarray");
-    glVertexPointer(3, GL_DOUBLE, 0, QuadWorld);
-    checkGLError("set vertexpointer");
-
-    float xmin, xmax, ymin, ymax;
-    for (int ty = 0, tym = panodata.numTilesY(); ty < tym; ++ty) {
-      for (int tx = 0, txm = panodata.numTilesX(); tx < txm; ++tx) {
-        // activate tile
-        int texname = panodata.getTile(tx, ty);
-        glBindTexture(GL_TEXTURE_2D, texname);
-        checkGLError("activate tile texture");
-
-        // shader needs to know the tile position on the sphere
-        panodata.getNormalizedTileCoordinates(tx, ty, xmin, xmax, ymin, ymax);
-        // std::cout << " tx: " << tx << " ty: " << ty << " texname: " <<
-        // texname << " xmin: " << xmin << " xmax: " << xmax << " ymin:" << ymin
-        // << " ymax: " << ymax << std::endl;
-        glUniform4f(unLocTileBoundary, xmin, xmax, ymin, ymax);
-        checkGLError("set tile boundary");
-
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-        checkGLError("draw arrays");
-      }
+
+    // low resolution preview first, refined tiles are drawn on top
+    m_tilesDrawn = m_tilesTotal = 0;
+    if (panodata.getPreview()) {
+      drawTilesShader(*panodata.getPreview());
+    }
+    m_drewArray = panodata.getTileArray() != 0;
+    if (panodata.getCubemap() != 0 && m_cubeprogram != 0) {
+      drawCubemap(panodata);
+    } else if (panodata.hasCubeFaces()) {
+      glUseProgram(0);
+      glEnable(GL_TEXTURE_2D);
+      drawCubeFaces(panodata);
+      glDisable(GL_TEXTURE_2D);
+    } else if (m_drewArray) {
+      drawTileArray(panodata);
+    } else {
+      drawTilesShader(panodata);
     }
 
     glUseProgram(0);
   }
+  m_profiler.end(m_stageTiles);
 
 #if 0
       // bind texture
@@ -594,12 +1095,31 @@ bool draw() {
     m_fps = m_framecounter;
     m_framecounter = 0;
     lastT = T;
+    dt = dsec(0.0);
   }
+  // the frame rate is updated once more after the last frame
+  m_overlayDue = (m_showText && m_framecounter > 0)
+                     ? glfwGetTime() + 1.0 - dt.count()
+                     : -1.0;
 
   // ON SCREEN FONT DISPLAY
   if ((m_fps >= 0) && font.valid() && m_showText) {
+    m_profiler.begin(m_stageText);
     std::ostringstream os;
     os << "FPS:" << m_fps;
+    if (panodata.hasCubeFaces()) {
+      os << " cube map";
+    } else if (!f_compatibilityMode && m_drewArray) {
+      os << " tiles: array";
+    } else if (!f_compatibilityMode) {
+      os << " tiles:" << m_tilesDrawn << "/" << m_tilesTotal;
+    }
+    if (panodata.hasCompressedTiles()) {
+      os << " BC1";
+    }
+    if (panodata.isMapped()) {
+      os << " zero copy";
+    }
 
     glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
 
@@ -624,12 +1144,29 @@ bool draw() {
       else
         s.append("OFF)");
       printLine(s);
+      printLine(f_tileCulling ? "T : disable tile culling (ON)"
+                              : "T : enable tile culling (OFF)");
+      printLine(f_compressTiles ? "B : disable tile compression (ON)"
+                                : "B : enable tile compression (OFF)");
+      printLine(f_zeroCopy ? "Z : disable zero copy loading (ON)"
+                           : "Z : enable zero copy loading (OFF)");
+      printLine(f_cubemap ? "M : show as equirectangular tiles (cube map)"
+                          : "M : show as cube map (equirectangular tiles)");
+      printLine(m_showTimes ? "P : hide frame times (ON)"
+                            : "P : show frame times (OFF)");
       printLine("SPACE: en-/disable all on-screen text");
     } else {
       printLine("press 'h' for help.");
     }
+    if (m_showTimes) {
+      printLine("p50 / p95 / p99 ms of the last frames:");
+      for (int i = 0; i < m_profiler.numStages(); ++i) {
+        printLine(stageTimes(i));
+      }
+    }
     font.finishGL();
     checkGLError("after font print");
+    m_profiler.end(m_stageText);
   }
 
   if (m_navmode == NAV_FLY) {
@@ -652,6 +1189,7 @@ void onKeyPress(GLFWwindow *w, int key, int scancode, int action, int mods) {
   //    break;
   case GLFW_PRESS:
   case GLFW_REPEAT: {
+    m_redraw = true;
     switch (key) {
     // up/down
     case GLFW_KEY_W: {
@@ -689,11 +1227,34 @@ void onKeyPress(GLFWwindow *w, int key, int scancode, int action, int mods) {
       m_showHelp = !m_showHelp;
       break;
     }
+    case GLFW_KEY_T: {
+      f_tileCulling = !f_tileCulling;
+      break;
+    }
     case GLFW_KEY_C: {
       f_compatibilityMode = !f_compatibilityMode;
       setupGL();
       break;
     }
+    case GLFW_KEY_B: {
+      f_compressTiles = !f_compressTiles;
+      setupGL();
+      break;
+    }
+    case GLFW_KEY_M: {
+      f_cubemap = !f_cubemap;
+      setupGL();
+      break;
+    }
+    case GLFW_KEY_Z: {
+      f_zeroCopy = !f_zeroCopy;
+      setupGL();
+      break;
+    }
+    case GLFW_KEY_P: {
+      m_showTimes = !m_showTimes;
+      break;
+    }
     default:
       // nope
       break;
@@ -714,6 +1275,7 @@ void onMouseMove(GLFWwindow *w, double x, double y) {
     m_mousepos.assign(x, y);
     camera.pitch((float)delta[1] * (2.6 / 360.0 * PIf * camera.getFOV()));
     camera.rotateAxis(Vec3d(0, 0, 1), delta[0] * (2.6 / 360.0 * PIf * camera.getFOV() ));
+    m_redraw = true;
   } break;
   case NAV_NONE:
   default:
@@ -738,6 +1300,7 @@ void onMouseButton(GLFWwindow *w, int button, int action, int mods) {
 
   case GLFW_RELEASE: {
     m_navmode = NAV_NONE;
+    m_redraw = true;
   } break;
   }
 }
@@ -754,8 +1317,11 @@ void resizeCB(GLFWwindow *wnd, int x, int y) {
   font.screenw = x;
   font.screenh = y;
   setupViewport(0, 0, x, y);
+  m_redraw = true;
 }
 
+void refreshCB(GLFWwindow *wnd) { m_redraw = true; }
+
 void Main_Loop(void) {
   // this just loops as long as the program runs
   while (!glfwWindowShouldClose(window)) {
@@ -763,17 +1329,54 @@ void Main_Loop(void) {
     if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
       break;
 
-    draw();
-
-    // swap back and front buffers
-    std::this_thread::sleep_for(std::chrono::milliseconds(10));
-    glfwSwapBuffers(window);
-    glfwPollEvents();
+    // upload tiles that finished decoding in the background within the
+    // time budget, the ones in view are decoded first
+    panodata.setViewDirection(-camera.getZ());
+    if (panodata.update()) {
+      m_redraw = true;
+    }
+    const bool overlay = m_overlayDue >= 0.0 && glfwGetTime() >= m_overlayDue;
+
+    // flying turns the camera every frame
+    if (m_redraw || overlay || m_navmode == NAV_FLY) {
+      m_redraw = false;
+      m_profiler.beginFrame();
+      m_profiler.begin(m_stageFrame);
+      draw();
+      // swap back and front buffers, waits for vsync
+      m_profiler.begin(m_stageSwap);
+      glfwSwapBuffers(window);
+      m_profiler.end(m_stageSwap);
+      m_profiler.end(m_stageFrame);
+      m_profiler.endFrame();
+      glfwPollEvents();
+    } else if (panodata.isUploading()) {
+      // uploads wait for the GPU, look at them again soon
+      glfwWaitEventsTimeout(0.002);
+    } else if (m_overlayDue >= 0.0) {
+      glfwWaitEventsTimeout(std::max(0.0, m_overlayDue - glfwGetTime()));
+    } else {
+      glfwWaitEvents();
+    }
   }
 }
 
 
 
+// the stages timed in every frame, the tile stage is inside the tile loop
+void setupProfiler() {
+  m_profiler.initialize();
+  if (m_profiler.numStages() == 0) {
+    m_stageFrame = m_profiler.addStage("frame");
+    m_stageClear = m_profiler.addStage("clear");
+    m_stageTiles = m_profiler.addStage("tile loop");
+    m_stageTile = m_profiler.addStage("tile");
+    m_stageText = m_profiler.addStage("text");
+    // waits for vsync, its GPU time would be the idle time
+    m_stageSwap = m_profiler.addStage("swap", false);
+  }
+}
+
 void Shut_Down(int return_code) {
   glfwTerminate();
   exit(return_code);
@@ -804,7 +1407,10 @@ void Init() {
   camera.setOrientation(Vec3d(1, 0, 0), Vec3d(0, 0, 1), Vec3d(0, -1, 0));
 
   glfwMakeContextCurrent(window);
+  // continuous rendering is paced by the display
+  glfwSwapInterval(1);
   glfwSetWindowSizeCallback(window, &resizeCB);
+  glfwSetWindowRefreshCallback(window, &refreshCB);
   glfwSetCursorPosCallback(window, onMouseMove);
   glfwSetMouseButtonCallback(window, onMouseButton);
   glfwSetKeyCallback(window, onKeyPress);
@@ -815,15 +1421,165 @@ void Init() {
     std::cout << "could not initialize GLEW" << std::endl;
     Shut_Down(1);
   }
+  setupProfiler();
+  // the main loop sleeps until the loader has something for it, set once
+  // before any loader thread runs
+  panodata.setWakeCallback([]() { glfwPostEmptyEvent(); });
   setupGL();
 }
 
+// one still of the batch mode, angles in degrees like IMG::viewCamera
+struct BatchView {
+  double yaw, pitch, roll, fov;
+  int width, height;
+  std::string filename;
+  double render, save; // seconds
+};
+
+// true for /path, \\server\path and C:\path
+bool isAbsolutePath(const std::string &path) {
+  return (!path.empty() && (path[0] == '/' || path[0] == '\\')) ||
+         (path.size() > 1 && path[1] == ':');
+}
+
+// reads lines "yaw pitch roll fov width height [file.jpg]", empty lines
+// and lines starting with # are skipped. Unnamed views are numbered,
+// relative names are in outdir.
+bool readBatchViews(const std::string &filename, const std::string &outdir,
+                    std::vector<BatchView> &views) {
+  std::ifstream in(filename.c_str());
+  if (!in) {
+    std::cout << "can not open " << filename << std::endl;
+    return false;
+  }
+  std::string line;
+  for (int n = 1; std::getline(in, line); ++n) {
+    std::istringstream ss(line);
+    const int first = (ss >> std::ws).peek();
+    if (first == EOF || first == '#') {
+      continue;
+    }
+    BatchView v;
+    if (!(ss >> v.yaw >> v.pitch >> v.roll >> v.fov >> v.width >> v.height) ||
+        v.width <= 0 || v.height <= 0 || v.fov <= 0.0 || v.fov >= 180.0) {
+      std::cout << filename << ":" << n << ": invalid view: " << line
+                << std::endl;
+      return false;
+    }
+    if (!(ss >> v.filename)) {
+      std::ostringstream name;
+      name << "view_" << std::setw(4) << std::setfill('0') << views.size()
+           << ".jpg";
+      v.filename = name.str();
+    }
+    if (!isAbsolutePath(v.filename)) {
+      v.filename = outdir + "/" + v.filename;
+    }
+    v.render = v.save = 0.0;
+    views.push_back(v);
+  }
+  return true;
+}
+
+// renders every view of a list to a JPEG file without opening a window:
+// the panorama is decoded once, then the views are rendered on the CPU,
+// one per core at a time
+int Batch_Render(const std::string &pano, const std::string &list,
+                 const std::string &outdir) {
+  typedef std::chrono::high_resolution_clock clock;
+  typedef std::chrono::duration<double> dsec;
+  std::vector<BatchView> views;
+  if (!readBatchViews(list, outdir, views)) {
+    return 1;
+  }
+
+  const clock::time_point T0 = clock::now();
+  IMG::MappedFile file;
+  Image img;
+  // a new index goes to the cache directory, not next to the panorama
+  IMG::JIDX::Index indexData;
+  const IMG::JIDX::Index *index = NULL;
+  if (file.open(pano.c_str()) &&
+      IMG::JIDX::openIndex(pano.c_str(), file.data(), file.size(), indexData,
+                           false)) {
+    index = &indexData;
+  }
+  if (!file.isOpen() ||
+      !IMG::loadJPEG(file.data(), file.size(), img, 0, 1, index)) {
+    std::cout << "can not load " << pano << std::endl;
+    return 1;
+  }
+  const double decode = dsec(clock::now() - T0).count();
+  std::cout << pano << ": " << img.width() << "x" << img.height()
+            << " decoded in " << decode * 1000.0 << " ms, " << views.size()
+            << " views" << std::endl;
+
+  // views are spread over the cores, a view uses the cores that are left
+  // if there are fewer views than cores
+  const int count = (int)views.size();
+  const unsigned int cores = PARALLEL::numThreads();
+  const unsigned int perView =
+      std::max(1u, cores / (unsigned int)std::max(1, count));
+  std::vector<char> ok(views.size(), 0);
+  // views that differ only in yaw share the panorama positions of their
+  // pixels
+  IMG::RemapCache remap(4);
+  const clock::time_point T1 = clock::now();
+  PARALLEL::forEach(count, [&](int i) {
+    BatchView &v = views[i];
+    Image view;
+    const clock::time_point R0 = clock::now();
+    IMG::renderRectilinear(img, remap, v.yaw, v.pitch, v.roll, v.fov, v.width,
+                           v.height, view, perView);
+    const clock::time_point R1 = clock::now();
+    ok[i] = IMG::saveJPEG(v.filename.c_str(), view, 90);
+    v.render = dsec(R1 - R0).count();
+    v.save = dsec(clock::now() - R1).count();
+  });
+  const double total = dsec(clock::now() - T1).count();
+
+  double mpix = 0.0;
+  int failed = 0;
+  for (int i = 0; i < count; ++i) {
+    const BatchView &v = views[i];
+    const double m = (double)v.width * v.height / 1e6;
+    mpix += m;
+    failed += ok[i] ? 0 : 1;
+    std::cout << v.filename << ": " << v.width << "x" << v.height
+              << " render " << v.render * 1000.0 << " ms ("
+              << m / v.render << " MPixel/s), save " << v.save * 1000.0
+              << " ms" << (ok[i] ? "" : " FAILED") << std::endl;
+  }
+  std::cout << count << " views in " << total << " s on " << cores
+            << " threads: " << count / total << " views/s, " << mpix / total
+            << " MPixel/s" << std::endl;
+  return failed ? 1 : 0;
+}
+
 int main(int argc, char *argv[]) {
-  if (argc >= 2) {
-    m_image_path = argv[1];
+  if (argc >= 4 && std::string(argv[1]) == "--batch") {
+    return Batch_Render(argv[2], argv[3], argc >= 5 ? argv[4] : ".");
+  }
+  int arg = 1;
+  if (argc >= 3 && std::string(argv[1]) == "--profile") {
+    m_profilePath = argv[2];
+    arg = 3;
+  }
+  if (argc > arg) {
+    m_image_path = argv[arg];
   }
   Init();
   Main_Loop();
+  if (!m_profilePath.empty()) {
+    if (m_profiler.writeCSV(m_profilePath)) {
+      std::cout << "frame times written to " << m_profilePath << std::endl;
+    } else {
+      std::cout << "can not write " << m_profilePath << std::endl;
+    }
+  }
+  m_profiler.release();
+  releaseTileMeshes(m_previewMeshes);
+  releaseTileMeshes(m_tileMeshes);
   if (window)
     glfwDestroyWindow(window);
   Shut_Down(0);
@@ -0,0 +1,144 @@
+#ifndef _MAPPEDFILE_H_
+#define _MAPPEDFILE_H_
+
+// read only memory mapped file, falls back to reading the file into
+// memory if it can not be mapped
+
+#include <cstdio>
+#include <vector>
+#include <fstream>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace IMG
+{
+    class MappedFile
+    {
+        const unsigned char *m_data;
+        size_t m_size;
+        bool m_mapped;
+        std::vector<unsigned char> m_buffer;   // fallback
+#ifdef _WIN32
+        HANDLE m_file, m_mapping;
+#endif
+
+        MappedFile(const MappedFile &);
+        MappedFile &operator=(const MappedFile &);
+
+        bool readFallback(const char *fname)
+        {
+            std::ifstream infile(fname, std::ios::binary | std::ios::in);
+            if (!infile.is_open()) return false;
+            infile.seekg(0, std::ios::end);
+            const std::streamoff size = infile.tellg();
+            infile.seekg(0, std::ios::beg);
+            if (size <= 0) return false;
+            m_buffer.resize((size_t)size);
+            infile.read((char *)&m_buffer[0], size);
+            if (infile.fail())
+            {
+                std::vector<unsigned char>().swap(m_buffer);
+                return false;
+            }
+            m_data = &m_buffer[0];
+            m_size = m_buffer.size();
+            return true;
+        }
+
+    public:
+        MappedFile() : m_data(NULL), m_size(0), m_mapped(false)
+#ifdef _WIN32
+            , m_file(INVALID_HANDLE_VALUE), m_mapping(NULL)
+#endif
+        {
+        }
+        ~MappedFile() { close(); }
+
+        inline bool isOpen() const { return m_data != NULL; }
+        inline const unsigned char *data() const { return m_data; }
+        inline size_t size() const { return m_size; }
+
+        bool open(const char *fname)
+        {
+            close();
+#ifdef _WIN32
+            m_file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                 OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (m_file != INVALID_HANDLE_VALUE)
+            {
+                LARGE_INTEGER fsize;
+                if (GetFileSizeEx(m_file, &fsize) && fsize.QuadPart > 0)
+                {
+                    m_mapping = CreateFileMapping(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+                    if (m_mapping != NULL)
+                    {
+                        m_data = (const unsigned char *)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+                        m_size = (size_t)fsize.QuadPart;
+                    }
+                }
+                if (m_data == NULL)
+                {
+                    close();
+                }
+            }
+#else
+            const int fd = ::open(fname, O_RDONLY);
+            if (fd >= 0)
+            {
+                struct stat st;
+                if (fstat(fd, &st) == 0 && st.st_size > 0)
+                {
+                    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (p != MAP_FAILED)
+                    {
+                        m_data = (const unsigned char *)p;
+                        m_size = (size_t)st.st_size;
+                    }
+                }
+                ::close(fd);   // the mapping stays valid
+            }
+#endif
+            m_mapped = m_data != NULL;
+            if (!m_mapped && !readFallback(fname))
+            {
+                fprintf(stderr, "can't open %s\n", fname);
+                return false;
+            }
+            return true;
+        }
+
+        void close()
+        {
+            if (m_mapped)
+            {
+#ifdef _WIN32
+                UnmapViewOfFile(m_data);
+#else
+                munmap((void *)m_data, m_size);
+#endif
+            }
+#ifdef _WIN32
+            if (m_mapping != NULL) CloseHandle(m_mapping);
+            if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+            m_mapping = NULL;
+            m_file = INVALID_HANDLE_VALUE;
+#endif
+            std::vector<unsigned char>().swap(m_buffer);
+            m_data = NULL;
+            m_size = 0;
+            m_mapped = false;
+        }
+    };
+}
+
+#endif
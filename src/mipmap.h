@@ -0,0 +1,175 @@
+#ifndef _MIPMAP_H_
+#define _MIPMAP_H_
+
+// mipmap generation for RGB images with a 2x2 box filter
+//
+// Level l of a w x h image is max(1,w>>l) x max(1,h>>l) like OpenGL
+// expects, an odd last row or column is dropped. Each output pixel is the
+// rounded mean of a 2x2 block that is aligned to the level below, so the
+// levels of a tile whose origin is a multiple of 2^l equal the matching
+// part of the levels of the whole image, there are no seams between tiles.
+
+#include <vector>
+#include "image.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMG_MIPMAP_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace IMG
+{
+    // number of levels down to 1x1 for a w x h image
+    inline int fullMipLevels(int w, int h)
+    {
+        int levels = 1;
+        while (w > 1 || h > 1)
+        {
+            w >>= 1;
+            h >>= 1;
+            ++levels;
+        }
+        return levels;
+    }
+
+    // number of levels whose 2x2 blocks do not cross the borders of tiles
+    // of size tileSize, level l needs tileSize to be a multiple of 2^l.
+    // This is the full chain for a power of two.
+    inline int seamlessMipLevels(const int tileSize)
+    {
+        int levels = 1;
+        for (int s = tileSize; s > 1 && (s & 1) == 0; s >>= 1)
+        {
+            ++levels;
+        }
+        return levels;
+    }
+
+    // sum two rows of n bytes into 16 bit values
+    inline void addRows(const unsigned char *r0, const unsigned char *r1,
+                        const int n, unsigned short *sum)
+    {
+        int i = 0;
+#ifdef IMG_MIPMAP_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16)
+        {
+            const __m128i a = _mm_loadu_si128((const __m128i *)&r0[i]);
+            const __m128i b = _mm_loadu_si128((const __m128i *)&r1[i]);
+            const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+            const __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+            _mm_storeu_si128((__m128i *)&sum[i], lo);
+            _mm_storeu_si128((__m128i *)&sum[i + 8], hi);
+        }
+#endif
+        for (; i < n; ++i)
+        {
+            sum[i] = (unsigned short)(r0[i] + r1[i]);
+        }
+    }
+
+    // add horizontal pixel pairs of the row sums and round, 3 channels
+    inline void addPairsRGB(const unsigned short *sum, const int dw, const int srcw,
+                            unsigned char *dst)
+    {
+        if (srcw == 1)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                dst[c] = (unsigned char)((2 * sum[c] + 2) >> 2);
+            }
+            return;
+        }
+        int x = 0;
+#ifdef IMG_MIPMAP_SSE2
+        // 4 output pixels per step, each pair sum is formed in the lowest
+        // 3 lanes of a register and the four results are packed together
+        const __m128i two = _mm_set1_epi16(2);
+        const __m128i m1 = _mm_set_epi16(0, 0, 0, 0, 0, 0, 0, -1);
+        const __m128i m3 = _mm_set_epi16(0, 0, 0, 0, 0, -1, -1, -1);
+        for (; x + 4 <= dw; x += 4)
+        {
+            __m128i q[4];
+            for (int k = 0; k < 4; ++k)
+            {
+                const unsigned short *p = &sum[6 * (x + k)];
+                q[k] = _mm_add_epi16(_mm_loadu_si128((const __m128i *)&p[0]),
+                                     _mm_loadu_si128((const __m128i *)&p[3]));
+            }
+            // lanes: q0.rgb q1.rgb q2.rg | q2.b q3.rgb
+            __m128i lo = _mm_or_si128(_mm_and_si128(q[0], m3),
+                                      _mm_slli_si128(_mm_and_si128(q[1], m3), 6));
+            lo = _mm_or_si128(lo, _mm_slli_si128(q[2], 12));
+            __m128i hi = _mm_or_si128(_mm_and_si128(_mm_srli_si128(q[2], 4), m1),
+                                      _mm_slli_si128(_mm_and_si128(q[3], m3), 2));
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+            const __m128i packed = _mm_packus_epi16(lo, hi);
+            _mm_storel_epi64((__m128i *)&dst[3 * x], packed);
+            const int last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+            memcpy(&dst[3 * x + 8], &last, 4);
+        }
+#endif
+        for (; x < dw; ++x)
+        {
+            const unsigned short *s = &sum[6 * x];
+            dst[3 * x + 0] = (unsigned char)((s[0] + s[3] + 2) >> 2);
+            dst[3 * x + 1] = (unsigned char)((s[1] + s[4] + 2) >> 2);
+            dst[3 * x + 2] = (unsigned char)((s[2] + s[5] + 2) >> 2);
+        }
+    }
+
+    // dst = src reduced by a factor of two with a 2x2 box filter, RGB only
+    inline void downsample2x2(const Image &src, Image &dst)
+    {
+        const int sw = src.width(), sh = src.height();
+        const int dw = std::max(1, sw >> 1), dh = std::max(1, sh >> 1);
+        dst.resize(dw, dh, 3);
+        std::vector<unsigned short> sum((size_t)sw * 3 + 8);
+        for (int y = 0; y < dh; ++y)
+        {
+            const unsigned char *r0 = &src(0, std::min(2 * y, sh - 1));
+            const unsigned char *r1 = &src(0, std::min(2 * y + 1, sh - 1));
+            addRows(r0, r1, sw * 3, &sum[0]);
+            addPairsRGB(&sum[0], dw, sw, &dst(0, y));
+        }
+    }
+
+    // copy src into the middle of a w x h image with a border of g pixels,
+    // that repeats the nearest pixels of src. If src is larger than the
+    // middle (a level of a tile narrower than 2^level) it is cut.
+    inline void padImage(const Image &src, const int g, const int w, const int h,
+                         Image &dst)
+    {
+        dst.resize(w, h, 3);
+        const int sw = src.width(), sh = src.height();
+        const int n = std::max(0, std::min(sw, w - 2 * g)); // copied as they are
+        for (int y = 0; y < h; ++y)
+        {
+            const unsigned char *s = &src(0, std::max(0, std::min(y - g, sh - 1)));
+            unsigned char *d = &dst(0, y);
+            for (int x = 0; x < g; ++x)
+            {
+                memcpy(&d[3 * x], s, 3);
+            }
+            memcpy(&d[3 * g], s, (size_t)n * 3);
+            for (int x = g + n; x < w; ++x)
+            {
+                memcpy(&d[3 * x], &s[3 * (sw - 1)], 3);
+            }
+        }
+    }
+
+    // levels[0] has to hold the full resolution image, levels 1..count-1
+    // are computed from it
+    inline void buildMipChain(std::vector<Image> &levels, const int count)
+    {
+        levels.resize(count);
+        for (int l = 1; l < count; ++l)
+        {
+            downsample2x2(levels[l - 1], levels[l]);
+        }
+    }
+}
+
+#endif
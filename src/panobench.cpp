@@ -0,0 +1,545 @@
+// PANOBENCH - timing of the CPU side building blocks of PanoViewer
+//
+// usage: PanoBench jpeg <file.jpg> [runs]
+//        compares single threaded decoding with the parallel decoder that
+//        splits the stream at restart markers (e.g. jpegtran -restart 1),
+//        or at MCU rows found by an index pre-scan for files without them,
+//        checks that they decode the same pixels, and decoding from
+//        resident DCT coefficients at all scales
+//        PanoBench tiles <width> <height> [tileSize] [runs]
+//        throughput of cutting an RGB image into tiles: per pixel accessor
+//        vs. row copies on one core and on all cores
+//        PanoBench bc1 <file.jpg> [runs]
+//        BC1 texture compression of the decoded image on one core and on
+//        all cores, and its PSNR
+//        PanoBench render <file.jpg> [runs]
+//        CPU reference rendering of a 1920x1080 rectilinear view on one
+//        core and on all cores, and of a turntable with remap tables
+//        PanoBench sphere <count> [runs]
+//        equirectangular positions of random directions with the SSE2 batch
+//        sphere math vs. libm atan2/acos, and the largest error
+//        PanoBench cube <file.jpg> [runs]
+//        conversion of the decoded panorama to six cube faces with bilinear
+//        and bicubic resampling on one core and on all cores
+//        PanoBench large <file.jpg> [width] [height]
+//        writes a synthetic panorama of 19200x9600 by default, larger than
+//        the 178 MPixel where 32 bit pixel offsets wrap, and checks that the
+//        single threaded, indexed and coefficient decoders reproduce it
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cmath>
+
+#include "imgjpg.h"
+#include "jpgcoef.h"
+#include "bc1.h"
+#include "rectilinear.h"
+#include "cubemap.h"
+
+typedef std::chrono::duration<double> dsec;
+
+static void usage() {
+  std::cout << "usage: PanoBench jpeg <file.jpg> [runs]" << std::endl;
+  std::cout << "       PanoBench tiles <width> <height> [tileSize] [runs]"
+            << std::endl;
+  std::cout << "       PanoBench bc1 <file.jpg> [runs]" << std::endl;
+  std::cout << "       PanoBench render <file.jpg> [runs]" << std::endl;
+  std::cout << "       PanoBench sphere <count> [runs]" << std::endl;
+  std::cout << "       PanoBench cube <file.jpg> [runs]" << std::endl;
+  std::cout << "       PanoBench large <file.jpg> [width] [height]"
+            << std::endl;
+}
+
+// largest difference of two images in any channel, -1 if their sizes differ
+static int maxDifference(const Image &a, const Image &b) {
+  if (a.width() != b.width() || a.height() != b.height() ||
+      a.chan() != b.chan()) {
+    return -1;
+  }
+  const std::vector<unsigned char> &pa = a.getData(), &pb = b.getData();
+  int diff = 0;
+  for (size_t i = 0; i < pa.size(); ++i) {
+    diff = std::max(diff, std::abs((int)pa[i] - (int)pb[i]));
+  }
+  return diff;
+}
+
+static void printDifference(const Image &a, const Image &b) {
+  const int diff = maxDifference(a, b);
+  std::cout << "  vs. single     : ";
+  if (diff < 0)
+    std::cout << "size differs" << std::endl;
+  else if (diff == 0)
+    std::cout << "identical" << std::endl;
+  else
+    std::cout << "max difference " << diff << std::endl;
+}
+
+// return best time of 'runs' calls of fn in seconds
+template <class FN> static double bestOf(int runs, FN fn) {
+  double best = 1e30;
+  for (int r = 0; r < runs; ++r) {
+    auto T0 = std::chrono::high_resolution_clock::now();
+    fn();
+    dsec dt = std::chrono::high_resolution_clock::now() - T0;
+    best = std::min(best, dt.count());
+  }
+  return best;
+}
+
+static int benchJPEG(const std::string &filename, int runs) {
+  IMG::MappedFile data;
+  if (!data.open(filename.c_str())) {
+    return 1;
+  }
+
+  IMG::STREAM::Layout L;
+  if (!IMG::STREAM::parseLayout(data.data(), data.size(), L)) {
+    std::cout << "not a supported JPEG file: " << filename << std::endl;
+    return 1;
+  }
+  std::vector<size_t> rst;
+  IMG::STREAM::findRestartMarkers(data.data(), data.size(), L.scanStart, rst);
+  const std::vector<int> bands =
+      IMG::restartBands(L, rst, 4 * PARALLEL::numThreads());
+
+  std::cout << filename << ": " << L.width << "x" << L.height << ", "
+            << rst.size() << " restart markers (interval " << L.restartInterval
+            << " MCUs), ";
+  if (bands.empty() && IMG::JIDX::isIndexable(data.data(), L))
+    std::cout << "split with an index" << std::endl;
+  else if (bands.empty())
+    std::cout << "no parallel decoding possible" << std::endl;
+  else
+    std::cout << bands.size() - 1 << " bands on " << PARALLEL::numThreads()
+              << " threads" << std::endl;
+
+  Image img, reference;
+  const double mpix = (double)L.width * L.height / 1e6;
+  const double single = bestOf(runs, [&]() {
+    IMG::loadJPEG(data.data(), data.size(), reference, 1);
+  });
+  std::cout << "single threaded : " << single * 1000.0 << " ms, "
+            << mpix / single << " MPixel/s" << std::endl;
+  const double parallel =
+      bestOf(runs, [&]() { IMG::loadJPEG(data.data(), data.size(), img, 0); });
+  std::cout << "parallel        : " << parallel * 1000.0 << " ms, "
+            << mpix / parallel << " MPixel/s, speedup " << single / parallel
+            << std::endl;
+  printDifference(img, reference);
+
+  // without restart markers: cost of the Huffman pre-scan and the parallel
+  // decode it enables
+  IMG::JIDX::Index index;
+  if (bands.empty() && IMG::JIDX::buildIndex(data.data(), data.size(), index)) {
+    const double scan = bestOf(runs, [&]() {
+      IMG::JIDX::buildIndex(data.data(), data.size(), index);
+    });
+    std::cout << "index pre-scan  : " << scan * 1000.0 << " ms, "
+              << data.size() / 1e6 / scan << " MB/s, "
+              << index.rows.size() * sizeof(IMG::JIDX::RowEntry) +
+                     sizeof(IMG::JIDX::Header)
+              << " bytes" << std::endl;
+    const double indexed = bestOf(runs, [&]() {
+      IMG::loadJPEG(data.data(), data.size(), img, 0, 1, &index);
+    });
+    std::cout << "indexed parallel: " << indexed * 1000.0 << " ms, "
+              << mpix / indexed << " MPixel/s, speedup " << single / indexed
+              << std::endl;
+  }
+
+  // resident coefficients: one entropy decoding pass, then IDCT only
+  IMG::COEF::Store coef;
+  const IMG::JIDX::Index *idx = index.isValid() ? &index : NULL;
+  const double read = bestOf(runs, [&]() {
+    coef.load(data.data(), data.size(), idx);
+  });
+  if (!coef.isValid()) {
+    std::cout << "coefficients    : not supported" << std::endl;
+    return 0;
+  }
+  std::cout << "coefficients    : " << read * 1000.0 << " ms, "
+            << (double)coef.bytes() / ((double)L.width * L.height)
+            << " bytes/pixel" << std::endl;
+  for (int scale = 1; scale <= 8; scale *= 2) {
+    const double libjpeg = bestOf(runs, [&]() {
+      IMG::loadJPEG(data.data(), data.size(), img, 0, scale, idx);
+    });
+    const double idct =
+        bestOf(runs, [&]() { coef.decodeImage(scale, img); });
+    std::cout << "  1/" << scale << " from coefficients: " << idct * 1000.0
+              << " ms, decode " << libjpeg * 1000.0 << " ms" << std::endl;
+  }
+  return 0;
+}
+
+static int benchTiles(const int width, const int height, const int tileSize,
+                      int runs) {
+  if (width <= 0 || height <= 0 || tileSize <= 0) {
+    usage();
+    return 1;
+  }
+  Image img;
+  img.resize(width, height);
+  std::vector<unsigned char> &pixels = img.unsafeData();
+  for (size_t i = 0; i < pixels.size(); ++i) {
+    pixels[i] = (unsigned char)(i * 7);
+  }
+  const int tilesX = (width + tileSize - 1) / tileSize;
+  const int tilesY = (height + tileSize - 1) / tileSize;
+  const int numTiles = tilesX * tilesY;
+  std::vector<Image> tiles(numTiles);
+  auto tileRect = [&](int i, int &x0, int &y0, int &w, int &h) {
+    x0 = (i % tilesX) * tileSize;
+    y0 = (i / tilesX) * tileSize;
+    w = std::min(tileSize, width - x0);
+    h = std::min(tileSize, height - y0);
+  };
+  auto cut = [&](int i) {
+    int x0, y0, w, h;
+    tileRect(i, x0, y0, w, h);
+    tiles[i].copyRegion(img, x0, y0, w, h);
+  };
+
+  std::cout << width << "x" << height << " RGB, " << numTiles << " tiles of "
+            << tileSize << ", " << PARALLEL::numThreads() << " threads"
+            << std::endl;
+  const double gb = (double)width * height * 3 / 1e9;
+  // every byte through the bounds checked accessor
+  const double perPixel = bestOf(runs, [&]() {
+    for (int i = 0; i < numTiles; ++i) {
+      int x0, y0, w, h;
+      tileRect(i, x0, y0, w, h);
+      Image &tile = tiles[i];
+      tile.resize(w, h);
+      for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x)
+          for (int c = 0; c < 3; ++c)
+            tile(x, y, c) = img(x0 + x, y0 + y, c);
+    }
+  });
+  std::cout << "per pixel       : " << perPixel * 1000.0 << " ms, "
+            << gb / perPixel << " GB/s" << std::endl;
+  const double rows = bestOf(runs, [&]() {
+    for (int i = 0; i < numTiles; ++i) {
+      cut(i);
+    }
+  });
+  std::cout << "row copies      : " << rows * 1000.0 << " ms, " << gb / rows
+            << " GB/s" << std::endl;
+  const double parallel =
+      bestOf(runs, [&]() { PARALLEL::forEach(numTiles, cut); });
+  std::cout << "parallel rows   : " << parallel * 1000.0 << " ms, "
+            << gb / parallel << " GB/s, speedup " << rows / parallel
+            << std::endl;
+  return 0;
+}
+
+static int benchBC1(const std::string &filename, int runs) {
+  IMG::MappedFile data;
+  Image img;
+  if (!data.open(filename.c_str()) ||
+      !IMG::loadJPEG(data.data(), data.size(), img, 0)) {
+    std::cout << "can not load " << filename << std::endl;
+    return 1;
+  }
+  std::cout << filename << ": " << img.width() << "x" << img.height() << ", "
+            << PARALLEL::numThreads() << " threads" << std::endl;
+
+  IMG::BC1::Blocks blocks;
+  const double mpix = (double)img.width() * img.height() / 1e6;
+  const double single =
+      bestOf(runs, [&]() { IMG::BC1::compress(img, blocks, 1); });
+  std::cout << "single threaded : " << single * 1000.0 << " ms, "
+            << mpix / single << " MPixel/s" << std::endl;
+  const double parallel =
+      bestOf(runs, [&]() { IMG::BC1::compress(img, blocks, 0); });
+  std::cout << "parallel        : " << parallel * 1000.0 << " ms, "
+            << mpix / parallel << " MPixel/s, speedup " << single / parallel
+            << std::endl;
+
+  Image decoded;
+  IMG::BC1::decompress(blocks, decoded);
+  const std::vector<unsigned char> &a = img.unsafeData();
+  const std::vector<unsigned char> &b = decoded.unsafeData();
+  double sse = 0.0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    const double d = (double)a[i] - b[i];
+    sse += d * d;
+  }
+  const double mse = sse / a.size();
+  std::cout << "PSNR            : ";
+  if (mse > 0.0)
+    std::cout << 10.0 * std::log10(255.0 * 255.0 / mse) << " dB";
+  else
+    std::cout << "lossless";
+  std::cout << ", " << blocks.size() / 1e6 << " MB compressed" << std::endl;
+  return 0;
+}
+
+static int benchRender(const std::string &filename, int runs) {
+  IMG::MappedFile data;
+  Image pano;
+  if (!data.open(filename.c_str()) ||
+      !IMG::loadJPEG(data.data(), data.size(), pano, 0)) {
+    std::cout << "can not load " << filename << std::endl;
+    return 1;
+  }
+  std::cout << filename << ": " << pano.width() << "x" << pano.height()
+            << ", " << PARALLEL::numThreads() << " threads" << std::endl;
+
+  // the viewer's start view with a 90 degree field of view
+  const Camera<double> camera = IMG::viewCamera(0.0, 0.0, 0.0, 90.0, 1920, 1080);
+
+  Image view;
+  const double mpix = 1920.0 * 1080.0 / 1e6;
+  const double single = bestOf(
+      runs, [&]() { IMG::renderRectilinear(pano, camera, view, 1); });
+  std::cout << "single threaded : " << single * 1000.0 << " ms, "
+            << mpix / single << " MPixel/s" << std::endl;
+  const double parallel = bestOf(
+      runs, [&]() { IMG::renderRectilinear(pano, camera, view, 0); });
+  std::cout << "parallel        : " << parallel * 1000.0 << " ms, "
+            << mpix / parallel << " MPixel/s, speedup " << single / parallel
+            << std::endl;
+
+  // turntable of 36 views 10 degrees apart, from the camera or from a
+  // cached remap table shifted by the yaw
+  const int steps = 36;
+  const double direct = bestOf(runs, [&]() {
+    for (int i = 0; i < steps; ++i)
+      IMG::renderRectilinear(
+          pano, IMG::viewCamera(10.0 * i, 10.0, 0.0, 90.0, 1920, 1080), view,
+          0);
+  });
+  std::cout << "turntable direct: " << direct * 1000.0 / steps
+            << " ms per view" << std::endl;
+  IMG::RemapCache cache;
+  const double table = bestOf(runs, [&]() {
+    for (int i = 0; i < steps; ++i)
+      IMG::renderRectilinear(pano, cache, 10.0 * i, 10.0, 0.0, 90.0, 1920,
+                             1080, view, 0);
+  });
+  std::cout << "turntable remap : " << table * 1000.0 / steps
+            << " ms per view, speedup " << direct / table << std::endl;
+  return 0;
+}
+
+static int benchSphere(const int count, int runs) {
+  if (count <= 0) {
+    usage();
+    return 1;
+  }
+  // random directions in a cube, a fixed sequence
+  std::vector<float> x(count), y(count), z(count), u(count), v(count);
+  unsigned int seed = 12345;
+  auto next = [&seed]() {
+    seed = seed * 1664525u + 1013904223u;
+    return (float)(seed >> 8) / 8388608.0f - 1.0f;
+  };
+  for (int i = 0; i < count; ++i) {
+    x[i] = next();
+    y[i] = next();
+    z[i] = next();
+  }
+  const double mdir = count / 1e6;
+  const double scalar = bestOf(runs, [&]() {
+    SPHERE::toEquirectScalar(&x[0], &y[0], &z[0], count, &u[0], &v[0]);
+  });
+  std::cout << "libm atan2/acos : " << scalar * 1000.0 << " ms, "
+            << mdir / scalar << " M directions/s" << std::endl;
+  const double batch = bestOf(runs, [&]() {
+    SPHERE::toEquirect(&x[0], &y[0], &z[0], count, &u[0], &v[0]);
+  });
+  std::cout << "batch           : " << batch * 1000.0 << " ms, "
+            << mdir / batch << " M directions/s, speedup " << scalar / batch
+            << std::endl;
+
+  // error in texels of a 65536 x 32768 panorama against double precision
+  const double pi = 3.141592653589793;
+  double du = 0.0, dv = 0.0;
+  for (int i = 0; i < count; ++i) {
+    const double len = std::sqrt((double)x[i] * x[i] + (double)y[i] * y[i] +
+                                 (double)z[i] * z[i]);
+    const double ru = (std::atan2((double)y[i], -(double)x[i]) + pi) / (2 * pi);
+    const double rv = std::acos(z[i] / len) / pi;
+    const double e = std::abs(u[i] - ru);
+    du = std::max(du, std::min(e, 1.0 - e) * 65536.0);
+    dv = std::max(dv, std::abs(v[i] - rv) * 32768.0);
+  }
+  std::cout << "max error       : " << du << " / " << dv
+            << " texels at 65536 x 32768" << std::endl;
+  return 0;
+}
+
+static int benchCube(const std::string &filename, int runs) {
+  IMG::MappedFile data;
+  Image pano;
+  if (!data.open(filename.c_str()) ||
+      !IMG::loadJPEG(data.data(), data.size(), pano, 0)) {
+    std::cout << "can not load " << filename << std::endl;
+    return 1;
+  }
+  const int size = IMG::CUBE::faceSize(pano.width());
+  std::cout << filename << ": " << pano.width() << "x" << pano.height()
+            << " to 6x" << size << "x" << size << ", "
+            << PARALLEL::numThreads() << " threads" << std::endl;
+
+  Image faces[6];
+  const double mpix = 6.0 * size * size / 1e6;
+  const char *names[2] = {"bilinear", "bicubic "};
+  for (int filter = IMG::CUBE::BILINEAR; filter <= IMG::CUBE::BICUBIC;
+       ++filter) {
+    const IMG::CUBE::Filter f = (IMG::CUBE::Filter)filter;
+    const double single = bestOf(
+        runs, [&]() { IMG::CUBE::fromEquirect(pano, size, faces, f, 1); });
+    std::cout << names[filter] << " single: " << single * 1000.0 << " ms, "
+              << mpix / single << " MPixel/s" << std::endl;
+    const double parallel = bestOf(
+        runs, [&]() { IMG::CUBE::fromEquirect(pano, size, faces, f, 0); });
+    std::cout << names[filter] << " all   : " << parallel * 1000.0 << " ms, "
+              << mpix / parallel << " MPixel/s, speedup "
+              << single / parallel << std::endl;
+  }
+  return 0;
+}
+
+// smooth pattern that differs in every row and column
+static unsigned char largePixel(const int x, const int y, const int c,
+                                const int width, const int height) {
+  switch (c) {
+  case 0:
+    return (unsigned char)((long long)x * 255 / width);
+  case 1:
+    return (unsigned char)((long long)y * 255 / height);
+  default:
+    return (unsigned char)std::abs((x + y) / 16 % 510 - 255);
+  }
+}
+
+// first row of img whose mean difference to the pattern is above 4, -1 if
+// all match
+static int firstBadRow(const Image &img, const int width, const int height) {
+  if (img.width() != width || img.height() != height || img.chan() != 3)
+    return 0;
+  for (int y = 0; y < height; ++y) {
+    long long sum = 0;
+    for (int x = 0; x < width; ++x)
+      for (int c = 0; c < 3; ++c)
+        sum += std::abs((int)img(x, y, c) -
+                        (int)largePixel(x, y, c, width, height));
+    if (sum > 4LL * width * 3)
+      return y;
+  }
+  return -1;
+}
+
+static void printRows(const char *name, const bool ok, const double seconds,
+                      const int bad) {
+  std::cout << name << ": ";
+  if (!ok)
+    std::cout << "failed" << std::endl;
+  else if (bad >= 0)
+    std::cout << "row " << bad << " differs from the source" << std::endl;
+  else
+    std::cout << seconds * 1000.0 << " ms, all rows match" << std::endl;
+}
+
+static int benchLarge(const std::string &filename, const int width,
+                      const int height) {
+  if (width <= 0 || height <= 0) {
+    usage();
+    return 1;
+  }
+  std::cout << filename << ": " << width << "x" << height << ", "
+            << (double)width * height / 1e6 << " MPixel" << std::endl;
+  {
+    Image source;
+    source.resize(width, height);
+    PARALLEL::forEach(height, [&](int y) {
+      for (int x = 0; x < width; ++x)
+        for (int c = 0; c < 3; ++c)
+          source(x, y, c) = largePixel(x, y, c, width, height);
+    });
+    if (!IMG::saveJPEG(filename.c_str(), source, 90)) {
+      return 1;
+    }
+  }
+  IMG::MappedFile data;
+  if (!data.open(filename.c_str())) {
+    return 1;
+  }
+
+  int failed = 0;
+  Image reference, img;
+  bool ok = false;
+  const double single = bestOf(1, [&]() {
+    ok = IMG::loadJPEG(data.data(), data.size(), reference, 1);
+  });
+  int bad = ok ? firstBadRow(reference, width, height) : 0;
+  printRows("single threaded ", ok, single, bad);
+  failed |= !ok || bad >= 0;
+
+  IMG::JIDX::Index index;
+  if (IMG::JIDX::buildIndex(data.data(), data.size(), index)) {
+    const double indexed = bestOf(1, [&]() {
+      ok = IMG::loadJPEG(data.data(), data.size(), img, 0, 1, &index);
+    });
+    bad = ok ? firstBadRow(img, width, height) : 0;
+    printRows("indexed parallel", ok, indexed, bad);
+    printDifference(img, reference);
+    failed |= !ok || bad >= 0 || maxDifference(img, reference) != 0;
+  }
+
+  IMG::COEF::Store coef;
+  const IMG::JIDX::Index *idx = index.isValid() ? &index : NULL;
+  const double idct = bestOf(1, [&]() {
+    ok = coef.load(data.data(), data.size(), idx) && coef.decodeImage(1, img);
+  });
+  bad = ok ? firstBadRow(img, width, height) : 0;
+  printRows("coefficients    ", ok, idct, bad);
+  failed |= !ok || bad >= 0;
+  return failed;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    usage();
+    return 1;
+  }
+  const std::string what = argv[1];
+  if (what == "jpeg") {
+    const int runs = (argc > 3) ? std::max(1, atoi(argv[3])) : 3;
+    return benchJPEG(argv[2], runs);
+  }
+  if (what == "tiles" && argc > 3) {
+    const int tileSize = (argc > 4) ? atoi(argv[4]) : 2048;
+    const int runs = (argc > 5) ? std::max(1, atoi(argv[5])) : 3;
+    return benchTiles(atoi(argv[2]), atoi(argv[3]), tileSize, runs);
+  }
+  if (what == "bc1") {
+    const int runs = (argc > 3) ? std::max(1, atoi(argv[3])) : 3;
+    return benchBC1(argv[2], runs);
+  }
+  if (what == "render") {
+    const int runs = (argc > 3) ? std::max(1, atoi(argv[3])) : 3;
+    return benchRender(argv[2], runs);
+  }
+  if (what == "sphere") {
+    const int runs = (argc > 3) ? std::max(1, atoi(argv[3])) : 3;
+    return benchSphere(atoi(argv[2]), runs);
+  }
+  if (what == "cube") {
+    const int runs = (argc > 3) ? std::max(1, atoi(argv[3])) : 3;
+    return benchCube(argv[2], runs);
+  }
+  if (what == "large") {
+    const int width = (argc > 3) ? atoi(argv[3]) : 19200;
+    const int height = (argc > 4) ? atoi(argv[4]) : width / 2;
+    return benchLarge(argv[2], width, height);
+  }
+  usage();
+  return 1;
+}
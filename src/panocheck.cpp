@@ -0,0 +1,172 @@
+// PANOCHECK - checks of the OpenGL side of PanoViewer against the driver
+//
+// usage: PanoCheck upload <file.jpg> [tileSize]
+//        loads the panorama with the tiles uploaded while loading, then
+//        with an upload budget through the ring of pixel buffers and with
+//        the pixels handed to the driver directly, each from the decoded
+//        image and streamed, and compares the texels of every tile level
+//        read back from the driver. Opens a hidden window.
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <thread>
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "TiledImage.h"
+#include "glupload.h"
+
+typedef std::chrono::duration<double> dsec;
+
+static void usage() {
+  std::cout << "usage: PanoCheck upload <file.jpg> [tileSize]" << std::endl;
+}
+
+// the texels of all levels of all tiles, tiles in row order
+static void readTiles(const TiledImage &img,
+                      std::vector<std::vector<unsigned char>> &levels) {
+  levels.clear();
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  for (int ty = 0; ty < img.numTilesY(); ++ty) {
+    for (int tx = 0; tx < img.numTilesX(); ++tx) {
+      glBindTexture(GL_TEXTURE_2D, img.getTile(tx, ty));
+      for (int l = 0; l < img.mipLevels(); ++l) {
+        GLint w = 0, h = 0;
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, l, GL_TEXTURE_WIDTH, &w);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, l, GL_TEXTURE_HEIGHT, &h);
+        levels.push_back(std::vector<unsigned char>((size_t)w * h * 3));
+        if (w > 0 && h > 0) {
+          glGetTexImage(GL_TEXTURE_2D, l, GL_RGB, GL_UNSIGNED_BYTE,
+                        &levels.back()[0]);
+        }
+      }
+    }
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// largest difference of two sets of levels, -1 if their sizes differ
+static int maxDifference(const std::vector<std::vector<unsigned char>> &a,
+                         const std::vector<std::vector<unsigned char>> &b) {
+  if (a.size() != b.size()) {
+    return -1;
+  }
+  int diff = 0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i].size() != b[i].size()) {
+      return -1;
+    }
+    for (size_t k = 0; k < a[i].size(); ++k) {
+      diff = std::max(diff, std::abs((int)a[i][k] - (int)b[i][k]));
+    }
+  }
+  return diff;
+}
+
+static int checkUpload(const std::string &filename, const int tileSize) {
+  if (tileSize <= 0) {
+    usage();
+    return 1;
+  }
+  std::cout << glGetString(GL_RENDERER) << ", " << glGetString(GL_VERSION)
+            << std::endl;
+  std::cout << "upload ring     : "
+            << (GLUTIL::UploadRing::isSupported() ? "supported"
+                                                  : "not supported")
+            << std::endl;
+
+  struct Mode {
+    const char *name;
+    double budget; // milliseconds
+    bool ring, streaming;
+  };
+  const Mode modes[] = {
+      {"while loading   ", 0.0, true, false},
+      {"ring            ", 4.0, true, false},
+      {"direct          ", 4.0, false, false},
+      {"ring, streamed  ", 4.0, true, true},
+      {"direct, streamed", 4.0, false, true},
+  };
+  std::vector<std::vector<unsigned char>> reference, levels;
+  int failed = 0;
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+    const Mode &mode = modes[m];
+    TiledImage img(tileSize);
+    img.setUploadBudget(mode.budget);
+    img.setUploadRing(mode.ring);
+    img.setStreaming(mode.streaming);
+    auto T0 = std::chrono::high_resolution_clock::now();
+    if (!img.loadFromJPEG(filename)) {
+      std::cout << "can not load " << filename << std::endl;
+      return 1;
+    }
+    int frames = 0;
+    while (img.isRefining()) {
+      if (!img.update()) {
+        std::this_thread::yield();
+      }
+      ++frames;
+    }
+    glFinish();
+    const dsec dt = std::chrono::high_resolution_clock::now() - T0;
+
+    readTiles(img, levels);
+    std::cout << mode.name << ": " << dt.count() * 1000.0 << " ms, "
+              << frames << " updates, ";
+    if (m == 0) {
+      reference.swap(levels);
+      std::cout << reference.size() << " levels read back" << std::endl;
+      continue;
+    }
+    const int diff = maxDifference(levels, reference);
+    if (diff < 0)
+      std::cout << "levels differ in size" << std::endl;
+    else if (diff == 0)
+      std::cout << "identical" << std::endl;
+    else
+      std::cout << "max difference " << diff << std::endl;
+    failed |= diff != 0;
+  }
+  const GLenum error = glGetError();
+  if (error != GL_NO_ERROR) {
+    std::cout << "OpenGL error " << error << std::endl;
+    failed = 1;
+  }
+  return failed;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    usage();
+    return 1;
+  }
+  const std::string what = argv[1];
+  if (what != "upload") {
+    usage();
+    return 1;
+  }
+  if (glfwInit() != GL_TRUE) {
+    return 1;
+  }
+  glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+  GLFWwindow *window = glfwCreateWindow(64, 64, "PanoCheck", NULL, NULL);
+  if (!window) {
+    std::cout << "could not open glfw window" << std::endl;
+    glfwTerminate();
+    return 1;
+  }
+  glfwMakeContextCurrent(window);
+  if (glewInit() != GLEW_OK) {
+    std::cout << "could not initialize GLEW" << std::endl;
+    glfwTerminate();
+    return 1;
+  }
+  const int tileSize = (argc > 3) ? atoi(argv[3]) : 512;
+  const int result = checkUpload(argv[2], tileSize);
+  glfwDestroyWindow(window);
+  glfwTerminate();
+  return result;
+}
@@ -0,0 +1,58 @@
+// PANOSPLIT - lossless split of a panorama JPEG into a tile set
+//
+// usage: PanoSplit <pano.jpg> <tileSize> <outdir>
+//        writes one JPEG per tile and the manifest tiles.txt to outdir,
+//        the tile set can be opened in PanoViewer instead of the JPEG.
+//        tileSize has to match the tile size of the viewer (2048).
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <cstdlib>
+
+#include "imgjpg.h"
+#include "jpgsplit.h"
+
+typedef std::chrono::duration<double> dsec;
+
+static void usage() {
+  std::cout << "usage: PanoSplit <pano.jpg> <tileSize> <outdir>" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 4) {
+    usage();
+    return 1;
+  }
+  const std::string filename = argv[1];
+  const int tileSize = atoi(argv[2]);
+  const std::string dir = argv[3];
+  if (tileSize <= 0) {
+    usage();
+    return 1;
+  }
+
+  auto T0 = std::chrono::high_resolution_clock::now();
+  IMG::MappedFile data;
+  if (!data.open(filename.c_str())) {
+    return 1;
+  }
+  IMG::TILESET::Manifest manifest;
+  IMG::EXIF::readFieldOfView(data.data(), data.size(), manifest.azimuth,
+                             manifest.elevation);
+  if (!IMG::TILESET::splitJPEG(data.data(), data.size(), tileSize, dir,
+                               manifest)) {
+    std::cout << "splitting " << filename << " failed" << std::endl;
+    return 1;
+  }
+  dsec dt = std::chrono::high_resolution_clock::now() - T0;
+
+  const int tilesX = (manifest.width + tileSize - 1) / tileSize;
+  const int tilesY = (manifest.height + tileSize - 1) / tileSize;
+  std::cout << filename << ": " << manifest.width << "x" << manifest.height
+            << ", " << tilesX << "x" << tilesY << " tiles of " << tileSize
+            << " written to " << dir << " in " << dt.count() * 1000.0
+            << " ms, " << data.size() / 1e6 / dt.count() << " MB/s"
+            << std::endl;
+  return 0;
+}
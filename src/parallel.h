@@ -0,0 +1,200 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+// minimal helpers to spread independent work items over all cores
+//
+// The work runs on a pool of persistent worker threads, so the many short
+// parallel loops (decoder bands, rows of tiles, cube faces) do not create
+// and join threads every time. The calling thread always takes part in
+// the work and picks up what no worker has started yet, so a loop finishes
+// even while all workers are busy with other loops.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace PARALLEL
+{
+    // number of worker threads to use, at least one
+    inline unsigned int numThreads()
+    {
+        const unsigned int n = std::thread::hardware_concurrency();
+        return n > 0 ? n : 1;
+    }
+
+    // numThreads() workers, started on first use and kept until the process
+    // ends. It is never destroyed: loops that still run while static objects
+    // are destroyed at exit keep their workers.
+    class Pool
+    {
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::deque< std::function<void()> > m_tasks;
+        const unsigned int m_size;
+
+        explicit Pool(const unsigned int size) : m_size(size)
+        {
+            for (unsigned int t = 0; t < size; ++t)
+            {
+                std::thread([this]() { work(); }).detach();
+            }
+        }
+
+        void work()
+        {
+            for (;;)
+            {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_wake.wait(lock, [this]() { return !m_tasks.empty(); });
+                    task.swap(m_tasks.front());
+                    m_tasks.pop_front();
+                }
+                task();
+            }
+        }
+
+    public:
+        static Pool &instance()
+        {
+            static Pool *pool = new Pool(numThreads());
+            return *pool;
+        }
+
+        inline unsigned int size() const { return m_size; }
+
+        void post(const std::function<void()> &task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_tasks.push_back(task);
+            }
+            m_wake.notify_one();
+        }
+    };
+
+    // call fn(i) for every i in [0,count), items are handed out dynamically
+    // so that uneven work sizes still balance. threads == 0 uses all cores,
+    // the calling thread takes part in the work, at most Pool::size() pool
+    // workers help.
+    template <class FN>
+    void forEach(const int count, FN fn, unsigned int threads = 0)
+    {
+        if (threads == 0) threads = numThreads();
+        if ((int)threads > count) threads = count > 0 ? count : 1;
+        if (threads <= 1)
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                fn(i);
+            }
+            return;
+        }
+
+        // shared with the helpers, which may only start after the loop is
+        // done and then find no item left
+        struct State
+        {
+            std::atomic<int> next, done;
+            std::mutex mutex;
+            std::condition_variable finished;
+            std::function<void(int)> fn;
+        };
+        const std::shared_ptr<State> state = std::make_shared<State>();
+        state->next = 0;
+        state->done = 0;
+        state->fn = [&fn](int i) { fn(i); };
+        auto worker = [count](State &s)
+        {
+            for (int i = s.next++; i < count; i = s.next++)
+            {
+                s.fn(i);
+                if (++s.done == count)
+                {
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    s.finished.notify_all();
+                }
+            }
+        };
+
+        Pool &pool = Pool::instance();
+        const unsigned int helpers = std::min(threads - 1, pool.size());
+        for (unsigned int t = 0; t < helpers; ++t)
+        {
+            pool.post([state, worker]() { worker(*state); });
+        }
+        worker(*state);
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->finished.wait(lock, [&state, count]() { return state->done == count; });
+    }
+
+    // fn run on a pool worker while the caller goes on, wait() returns once
+    // it is done. If no worker has started it by then, wait() runs it on the
+    // calling thread.
+    class Job
+    {
+        struct State
+        {
+            std::atomic<bool> claimed;
+            bool done;
+            std::mutex mutex;
+            std::condition_variable finished;
+            std::function<void()> fn;
+        };
+        std::shared_ptr<State> m_state;
+
+        static void run(State &s)
+        {
+            if (s.claimed.exchange(true))
+            {
+                return;
+            }
+            s.fn();
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.done = true;
+            s.finished.notify_all();
+        }
+
+        Job(const Job &);
+        Job &operator=(const Job &);
+
+    public:
+        Job() {}
+        ~Job() { wait(); }
+
+        void start(const std::function<void()> &fn)
+        {
+            wait();
+            m_state = std::make_shared<State>();
+            m_state->claimed = false;
+            m_state->done = false;
+            m_state->fn = fn;
+            const std::shared_ptr<State> state = m_state;
+            Pool::instance().post([state]() { run(*state); });
+        }
+
+        void wait()
+        {
+            if (!m_state)
+            {
+                return;
+            }
+            run(*m_state);
+            {
+                std::unique_lock<std::mutex> lock(m_state->mutex);
+                State &s = *m_state;
+                s.finished.wait(lock, [&s]() { return s.done; });
+            }
+            m_state.reset();
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,583 @@
+#ifndef _PVTFILE_H_
+#define _PVTFILE_H_
+
+// PVT - pre-tiled panorama container
+//
+// Stores the tiles of a panorama as raw RGB data that can be handed to
+// glTexImage2D directly from a memory mapping, so a panorama that has been
+// opened before is shown without decoding the JPEG again.
+//
+// Layout (native byte order):
+//   Header
+//   uint64 offset[tilesY][tilesX][levels]   start of each tile level
+//   tile data, each tile level starts at a multiple of ALIGNMENT
+// Level l of a w x h tile is max(1,w>>l) x max(1,h>>l) pixels, rows are
+// tightly packed.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#include <process.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+#include "image.h"
+#include "mappedfile.h"
+
+namespace IMG
+{
+namespace PVT
+{
+    const char MAGIC[4] = { 'P', 'V', 'T', '1' };
+    const uint32_t VERSION = 1;
+    const uint64_t ALIGNMENT = 4096;
+    const uint64_t DEFAULT_CACHE_MB = 4096;
+
+    // identifies the source image a container was made from
+    struct SourceKey
+    {
+        uint64_t size;
+        uint64_t mtime;
+        uint64_t hash;
+
+        SourceKey() : size(0), mtime(0), hash(0) {}
+        bool operator==(const SourceKey &o) const
+        {
+            return size == o.size && mtime == o.mtime && hash == o.hash;
+        }
+    };
+
+    struct Header
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t width, height;
+        uint32_t tileSize;
+        uint32_t channels;
+        uint32_t levels;
+        uint32_t tilesX, tilesY;
+        uint32_t reserved;
+        double azimuth, elevation;   // field of view in degrees
+        SourceKey source;
+    };
+    static_assert(sizeof(Header) == 80, "PVT header layout");
+
+    inline uint64_t alignUp(const uint64_t x)
+    {
+        return (x + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    inline int levelSize(const int size, const int level)
+    {
+        return std::max(1, size >> level);
+    }
+
+    // extent of tile t along an axis of 'size' pixels
+    inline int tileExtent(const int size, const int tileSize, const int t)
+    {
+        return std::min(tileSize, size - t * tileSize);
+    }
+
+    inline uint64_t fnv1a(const unsigned char *p, const size_t n,
+                          uint64_t h = 14695981039346656037ULL)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            h ^= p[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    // size and modification time from the file system, the content hash
+    // covers 16 evenly spaced 64 KiB samples so that large files are
+    // identified without reading them completely
+    inline bool makeSourceKey(const char *fname, const unsigned char *data,
+                              const size_t size, SourceKey &key)
+    {
+        struct stat st;
+        if (stat(fname, &st) != 0) return false;
+        key.size = size;
+        key.mtime = (uint64_t)st.st_mtime;
+
+        const size_t SAMPLES = 16, SAMPLE = 65536;
+        if (size <= SAMPLES * SAMPLE)
+        {
+            key.hash = fnv1a(data, size);
+        }
+        else
+        {
+            const size_t step = (size - SAMPLE) / (SAMPLES - 1);
+            key.hash = fnv1a(NULL, 0);
+            for (size_t i = 0; i < SAMPLES; ++i)
+            {
+                key.hash = fnv1a(&data[i * step], SAMPLE, key.hash);
+            }
+        }
+        return true;
+    }
+
+    inline bool isDirectory(const std::string &path)
+    {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 && (st.st_mode & S_IFDIR) != 0;
+    }
+
+    // create path and all missing parents
+    inline bool makeDirectories(const std::string &path)
+    {
+        for (size_t pos = 1; pos <= path.size(); ++pos)
+        {
+            if (pos == path.size() || path[pos] == '/' || path[pos] == '\\')
+            {
+                const std::string dir = path.substr(0, pos);
+                if (!isDirectory(dir))
+                {
+#ifdef _WIN32
+                    _mkdir(dir.c_str());
+#else
+                    mkdir(dir.c_str(), 0755);
+#endif
+                }
+            }
+        }
+        return isDirectory(path);
+    }
+
+    // $PANOVIEWER_CACHE, otherwise the per user cache directory,
+    // empty if there is none
+    inline std::string cacheDirectory()
+    {
+        std::string path;
+        const char *dir = getenv("PANOVIEWER_CACHE");
+        if (dir != NULL && *dir != 0)
+        {
+            path = dir;
+        }
+        else
+        {
+#ifdef _WIN32
+            const char *local = getenv("LOCALAPPDATA");
+            if (local == NULL) return "";
+            path = std::string(local) + "\\PanoViewer";
+#else
+            const char *xdg = getenv("XDG_CACHE_HOME");
+            const char *home = getenv("HOME");
+            if (xdg != NULL && *xdg != 0) path = std::string(xdg) + "/panoviewer";
+            else if (home != NULL) path = std::string(home) + "/.cache/panoviewer";
+            else return "";
+#endif
+        }
+        return makeDirectories(path) ? path : "";
+    }
+
+    // size limit of the cache in bytes, $PANOVIEWER_CACHE_SIZE in MB or
+    // DEFAULT_CACHE_MB. 0 turns writing to the cache off.
+    inline uint64_t cacheBudget()
+    {
+        const char *size = getenv("PANOVIEWER_CACHE_SIZE");
+        if (size != NULL && *size != 0)
+        {
+            return (uint64_t)(std::max(0.0, atof(size)) * 1024.0 * 1024.0);
+        }
+        return DEFAULT_CACHE_MB * 1024 * 1024;
+    }
+
+    struct CacheEntry
+    {
+        std::string path;
+        uint64_t size;
+        time_t time;   // of the last modification, see touch()
+    };
+
+    // the regular files in dir whose names end with suffix
+    inline std::vector<CacheEntry> listFiles(const std::string &dir,
+                                             const std::string &suffix)
+    {
+        std::vector<CacheEntry> files;
+#ifdef _WIN32
+        _finddatai64_t fd;
+        const intptr_t h = _findfirsti64((dir + "\\*" + suffix).c_str(), &fd);
+        if (h == -1) return files;
+        do
+        {
+            if ((fd.attrib & _A_SUBDIR) == 0)
+            {
+                const CacheEntry e = {dir + "\\" + fd.name, (uint64_t)fd.size, fd.time_write};
+                files.push_back(e);
+            }
+        } while (_findnexti64(h, &fd) == 0);
+        _findclose(h);
+#else
+        DIR *d = opendir(dir.c_str());
+        if (d == NULL) return files;
+        while (const dirent *entry = readdir(d))
+        {
+            const std::string name = entry->d_name;
+            const std::string path = dir + "/" + name;
+            struct stat st;
+            if (name.size() > suffix.size() &&
+                name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0 &&
+                stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            {
+                const CacheEntry e = {path, (uint64_t)st.st_size, st.st_mtime};
+                files.push_back(e);
+            }
+        }
+        closedir(d);
+#endif
+        return files;
+    }
+
+    // mark a container as used now. Eviction goes by the modification time,
+    // access times are often not kept (noatime, relatime).
+    inline void touch(const std::string &fname)
+    {
+#ifdef _WIN32
+        _utime(fname.c_str(), NULL);
+#else
+        utime(fname.c_str(), NULL);
+#endif
+    }
+
+    // make room in the cache for a new container of the given size: remove
+    // the containers of the same image with other tile sizes, temporary
+    // files older than a day (of writers that did not finish) and then the
+    // least recently used containers until all fit into cacheBudget().
+    // False if the new one alone does not.
+    inline bool reserveCache(const std::string &fname, const uint64_t bytes)
+    {
+        const uint64_t budget = cacheBudget();
+        if (bytes > budget) return false;
+        const size_t slash = fname.find_last_of("/\\");
+        if (slash == std::string::npos) return false;
+        const std::string dir = fname.substr(0, slash);
+        const std::string name = fname.substr(slash + 1);
+        // <hash>-<tileSize>.pvt
+        const std::string image = name.substr(0, name.find('-') + 1);
+
+        const time_t now = time(NULL);
+        const std::vector<CacheEntry> temp = listFiles(dir, ".tmp");
+        for (size_t i = 0; i < temp.size(); ++i)
+        {
+            if (now - temp[i].time > 24 * 60 * 60) remove(temp[i].path.c_str());
+        }
+
+        std::vector<CacheEntry> files = listFiles(dir, ".pvt");
+        std::vector<CacheEntry> kept;
+        uint64_t total = 0;
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            const std::string other = files[i].path.substr(slash + 1);
+            if (!image.empty() && other != name &&
+                other.compare(0, image.size(), image) == 0 &&
+                remove(files[i].path.c_str()) == 0)
+            {
+                continue;
+            }
+            total += files[i].size;
+            kept.push_back(files[i]);
+        }
+        std::sort(kept.begin(), kept.end(), [](const CacheEntry &a, const CacheEntry &b)
+        {
+            return a.time < b.time;
+        });
+        for (size_t i = 0; i < kept.size() && total + bytes > budget; ++i)
+        {
+            if (remove(kept[i].path.c_str()) == 0) total -= kept[i].size;
+        }
+        return total + bytes <= budget;
+    }
+
+    // name of the container for a source image and tile size
+    inline std::string cacheFileName(const SourceKey &key, const int tileSize)
+    {
+        const std::string dir = cacheDirectory();
+        if (dir.empty()) return "";
+        char name[64];
+        sprintf(name, "%016llx-%d.pvt",
+                (unsigned long long)fnv1a((const unsigned char *)&key, sizeof(key)),
+                tileSize);
+        return dir + "/" + name;
+    }
+
+    // offsets of all tile levels in file order, plus the file size
+    inline std::vector<uint64_t> layoutOffsets(const Header &h)
+    {
+        std::vector<uint64_t> offsets;
+        const size_t count = (size_t)h.tilesX * h.tilesY * h.levels;
+        uint64_t pos = alignUp(sizeof(Header) + count * sizeof(uint64_t));
+        for (uint32_t ty = 0; ty < h.tilesY; ++ty)
+        {
+            const int th = tileExtent(h.height, h.tileSize, ty);
+            for (uint32_t tx = 0; tx < h.tilesX; ++tx)
+            {
+                const int tw = tileExtent(h.width, h.tileSize, tx);
+                for (uint32_t l = 0; l < h.levels; ++l)
+                {
+                    offsets.push_back(pos);
+                    pos = alignUp(pos + (uint64_t)levelSize(tw, l) *
+                                  levelSize(th, l) * h.channels);
+                }
+            }
+        }
+        offsets.push_back(pos);
+        return offsets;
+    }
+
+    // read access to a container through a memory mapping
+    class File
+    {
+        MappedFile m_file;
+        const Header *m_header;
+        const uint64_t *m_offsets;
+
+        File(const File &);
+        File &operator=(const File &);
+
+    public:
+        File() : m_header(NULL), m_offsets(NULL) {}
+
+        bool open(const std::string &fname)
+        {
+            close();
+            // a missing file is the usual cache miss, fail quietly
+            struct stat st;
+            if (stat(fname.c_str(), &st) != 0 || !m_file.open(fname.c_str()))
+            {
+                return false;
+            }
+            const Header *h = (const Header *)m_file.data();
+            if (m_file.size() < sizeof(Header) ||
+                !std::equal(MAGIC, MAGIC + 4, h->magic) ||
+                h->version != VERSION || h->channels != 3 || h->levels < 1 ||
+                h->tileSize == 0 ||
+                h->tilesX != (h->width + h->tileSize - 1) / h->tileSize ||
+                h->tilesY != (h->height + h->tileSize - 1) / h->tileSize)
+            {
+                close();
+                return false;
+            }
+            // the layout is fixed by the header, anything else is damaged
+            const std::vector<uint64_t> expected = layoutOffsets(*h);
+            if (m_file.size() < expected.back() ||
+                !std::equal(expected.begin(), expected.end() - 1,
+                            (const uint64_t *)(m_file.data() + sizeof(Header))))
+            {
+                close();
+                return false;
+            }
+            m_header = h;
+            m_offsets = (const uint64_t *)(m_file.data() + sizeof(Header));
+            return true;
+        }
+
+        void close()
+        {
+            m_file.close();
+            m_header = NULL;
+            m_offsets = NULL;
+        }
+
+        inline bool isOpen() const { return m_header != NULL; }
+        inline const Header &header() const { return *m_header; }
+
+        inline int tileWidth(const int tx, const int level = 0) const
+        {
+            return levelSize(tileExtent(m_header->width, m_header->tileSize, tx), level);
+        }
+        inline int tileHeight(const int ty, const int level = 0) const
+        {
+            return levelSize(tileExtent(m_header->height, m_header->tileSize, ty), level);
+        }
+
+        // tightly packed RGB data of a tile level
+        inline const unsigned char *tile(const int tx, const int ty, const int level = 0) const
+        {
+            const size_t i = ((size_t)ty * m_header->tilesX + tx) * m_header->levels + level;
+            return m_file.data() + m_offsets[i];
+        }
+    };
+
+    // writes a container to a temporary file that is renamed when complete,
+    // so readers never see a partial file. Tile levels can be written in any
+    // order and from several threads. create() makes room for the file in
+    // the cache directory, see reserveCache().
+    class Writer
+    {
+        FILE *m_out;
+        std::string m_name, m_temp;
+        Header m_header;
+        std::vector<uint64_t> m_offsets;
+        std::vector<bool> m_written;
+        size_t m_missing;   // number of tile levels not written yet
+        uint64_t m_end;     // end of the data written so far
+        std::mutex m_mutex;
+
+        Writer(const Writer &);
+        Writer &operator=(const Writer &);
+
+        bool seek(const uint64_t pos)
+        {
+#ifdef _WIN32
+            return _fseeki64(m_out, (__int64)pos, SEEK_SET) == 0;
+#else
+            return fseeko(m_out, (off_t)pos, SEEK_SET) == 0;
+#endif
+        }
+
+        bool write(const uint64_t pos, const void *data, const size_t bytes)
+        {
+            if (!seek(pos) || fwrite(data, 1, bytes, m_out) != bytes) return false;
+            m_end = std::max(m_end, pos + bytes);
+            return true;
+        }
+
+        void discard()
+        {
+            if (m_out != NULL)
+            {
+                fclose(m_out);
+                m_out = NULL;
+                remove(m_temp.c_str());
+            }
+        }
+
+    public:
+        // the file is created by create() once the image size is known
+        Writer(const std::string &fname, const SourceKey &key)
+            : m_out(NULL), m_name(fname), m_missing(0), m_end(0)
+        {
+            m_header.source = key;
+            m_header.azimuth = 360.0;
+            m_header.elevation = 180.0;
+        }
+        ~Writer() { abort(); }
+
+        bool create(const int width, const int height, const int tileSize,
+                    const int levels)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            discard();
+            Header &h = m_header;
+            std::copy(MAGIC, MAGIC + 4, h.magic);
+            h.version = VERSION;
+            h.width = width;
+            h.height = height;
+            h.tileSize = tileSize;
+            h.channels = 3;
+            h.levels = levels;
+            h.tilesX = (width + tileSize - 1) / tileSize;
+            h.tilesY = (height + tileSize - 1) / tileSize;
+            h.reserved = 0;
+            m_offsets = layoutOffsets(h);
+            if (!reserveCache(m_name, m_offsets.back())) return false;
+            m_missing = m_offsets.size() - 1;
+            m_written.assign(m_missing, false);
+            m_end = 0;
+
+#ifdef _WIN32
+            m_temp = m_name + "." + std::to_string((long long)_getpid()) + ".tmp";
+#else
+            m_temp = m_name + "." + std::to_string((long long)getpid()) + ".tmp";
+#endif
+            m_out = fopen(m_temp.c_str(), "wb");
+            if (m_out == NULL) return false;
+            // the header is written again by finish()
+            if (!write(0, &m_header, sizeof(Header)) ||
+                !write(sizeof(Header), &m_offsets[0], m_missing * sizeof(uint64_t)))
+            {
+                discard();
+                return false;
+            }
+            return true;
+        }
+
+        inline bool isOpen() const { return m_out != NULL; }
+
+        inline void setFieldOfView(const double azimuth, const double elevation)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_header.azimuth = azimuth;
+            m_header.elevation = elevation;
+        }
+
+        bool writeTile(const int tx, const int ty, const int level, const Image &data)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_out == NULL) return false;
+            const size_t i = ((size_t)ty * m_header.tilesX + tx) * m_header.levels + level;
+            const int tw = levelSize(tileExtent(m_header.width, m_header.tileSize, tx), level);
+            const int th = levelSize(tileExtent(m_header.height, m_header.tileSize, ty), level);
+            if (i >= m_written.size() || data.width() != tw || data.height() != th ||
+                data.chan() != 3)
+            {
+                discard();
+                return false;
+            }
+            if (!write(m_offsets[i], data.data(), (size_t)tw * th * 3))
+            {
+                discard();
+                return false;
+            }
+            if (!m_written[i])
+            {
+                m_written[i] = true;
+                --m_missing;
+            }
+            return true;
+        }
+
+        // write the final header and move the file into place, fails if
+        // not all tiles have been written
+        bool finish()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_out == NULL) return false;
+            // extend the file to the aligned size after the last tile
+            const unsigned char zero = 0;
+            if (m_missing > 0 ||
+                (m_end < m_offsets.back() && !write(m_offsets.back() - 1, &zero, 1)) ||
+                !write(0, &m_header, sizeof(Header)))
+            {
+                discard();
+                return false;
+            }
+            const bool ok = fclose(m_out) == 0;
+            m_out = NULL;
+            if (ok)
+            {
+#ifdef _WIN32
+                remove(m_name.c_str());   // rename does not replace on Windows
+#endif
+                if (rename(m_temp.c_str(), m_name.c_str()) == 0) return true;
+            }
+            remove(m_temp.c_str());
+            return false;
+        }
+
+        // discard a partially written file
+        void abort()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            discard();
+        }
+    };
+
+} // namespace PVT
+} // namespace IMG
+
+#endif
@@ -0,0 +1,333 @@
+#ifndef _RECTILINEAR_H_
+#define _RECTILINEAR_H_
+
+// headless reference renderer: rectilinear views of an equirectangular
+// panorama on the CPU
+//
+// Every pixel is mapped like the fragment shaders do it: the ray through
+// its center on the near plane of the camera (in world coordinates, like
+// the interpolated vertex position) gives the panorama position
+// x = (atan(y,-x)+pi)/(2pi) and y = acos(z)/pi. The panorama is sampled
+// bilinearly like GL_LINEAR, repeating horizontally and clamped at the
+// poles. Four rays at a time are mapped with the batch sphere math of
+// vec3t.h. The view is cut into blocks that are spread over all cores.
+//
+// For a fixed field of view, size, pitch and roll the yaw of a view only
+// shifts the panorama positions of its pixels, so the positions of yaw 0
+// can be kept in a remap table and reused: a view is then a shift and a
+// bilinear fetch per pixel.
+
+#include <cmath>
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <mutex>
+#include "image.h"
+#include "vec3t.h"
+#include "camera.h"
+#include "parallel.h"
+
+namespace IMG
+{
+    namespace RECT
+    {
+        // size of the square blocks of the view that are handed out to the
+        // threads, a multiple of 4
+        const int BLOCK = 64;
+
+        // panorama pixel positions (sx[i],sy[i]) of the n rays o + i * d,
+        // sx and sy need room for n rounded up to a multiple of 4
+        inline void mapRays(const double o[3], const double d[3], const int n,
+                            const int width, const int height, float *sx, float *sy)
+        {
+#ifdef VEC3T_SSE2
+            const __m128 step = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+            const __m128 half = _mm_set1_ps(0.5f);
+            const __m128 su = _mm_set1_ps((float)width), sv = _mm_set1_ps((float)height);
+            for (int i = 0; i < n; i += 4)
+            {
+                const __m128 t = _mm_add_ps(_mm_set1_ps((float)i), step);
+                const __m128 x = _mm_add_ps(_mm_set1_ps((float)o[0]), _mm_mul_ps(t, _mm_set1_ps((float)d[0])));
+                const __m128 y = _mm_add_ps(_mm_set1_ps((float)o[1]), _mm_mul_ps(t, _mm_set1_ps((float)d[1])));
+                const __m128 z = _mm_add_ps(_mm_set1_ps((float)o[2]), _mm_mul_ps(t, _mm_set1_ps((float)d[2])));
+                __m128 u, v;
+                SPHERE::equirect_ps(x, y, z, u, v);
+                _mm_storeu_ps(&sx[i], _mm_sub_ps(_mm_mul_ps(u, su), half));
+                _mm_storeu_ps(&sy[i], _mm_sub_ps(_mm_mul_ps(v, sv), half));
+            }
+#else
+            const double pi = 3.141592653589793;
+            for (int i = 0; i < n; ++i)
+            {
+                const double x = o[0] + i * d[0], y = o[1] + i * d[1], z = o[2] + i * d[2];
+                const double phi = std::atan2(y, -x);
+                const double theta = std::atan2(std::sqrt(x * x + y * y), z);
+                sx[i] = (float)((phi + pi) / (2.0 * pi) * width - 0.5);
+                sy[i] = (float)(theta / pi * height - 0.5);
+            }
+#endif
+        }
+
+        // fixed point positions with 8 fraction bits, floor(v[i]*256) for
+        // v[i] > -1
+        inline void toFixed(const float *v, const int n, int *f)
+        {
+            int i = 0;
+#ifdef VEC3T_SSE2
+            const __m128 s = _mm_set1_ps(256.0f);
+            const __m128i one = _mm_set1_epi32(256);
+            for (; i + 4 <= n; i += 4)
+            {
+                const __m128 x = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&v[i]), s), s);
+                _mm_storeu_si128((__m128i *)&f[i], _mm_sub_epi32(_mm_cvttps_epi32(x), one));
+            }
+#endif
+            for (; i < n; ++i)
+            {
+                f[i] = (int)(v[i] * 256.0f + 256.0f) - 256;
+            }
+        }
+
+        // bilinear samples of the panorama at the n fixed point positions
+        // (fx[i] + dx,fy[i]) with 8 bit weights like texture units use them.
+        // fx[i] + dx has to be in [-256,512*width).
+        inline void sampleFixed(const Image &pano, const int *fx, const int *fy, const int n,
+                                unsigned char *dst, const int dx = 0)
+        {
+            const int w = pano.width(), h = pano.height(), ch = pano.chan();
+            const unsigned char *data = pano.data();
+            const size_t stride = (size_t)w * ch;
+            for (int i = 0; i < n; ++i, dst += ch)
+            {
+                const int x = fx[i] + dx;
+                int x0 = x >> 8;
+                if (x0 < 0) x0 += w;
+                else if (x0 >= w) x0 -= w;
+                const int x1 = (x0 + 1 == w) ? 0 : (x0 + 1) * ch;
+                x0 *= ch;
+                const int y = fy[i] >> 8;
+                const int y0 = std::max(0, std::min(y, h - 1));
+                const int y1 = std::max(0, std::min(y + 1, h - 1));
+                const int wx = x & 255, wy = fy[i] & 255;
+                const unsigned char *r0 = data + y0 * stride, *r1 = data + y1 * stride;
+                for (int c = 0; c < ch; ++c)
+                {
+                    const int top = (r0[x0 + c] << 8) + wx * (r0[x1 + c] - r0[x0 + c]);
+                    const int bottom = (r1[x0 + c] << 8) + wx * (r1[x1 + c] - r1[x0 + c]);
+                    dst[c] = (unsigned char)(((top << 8) + wy * (bottom - top) + 32768) >> 16);
+                }
+            }
+        }
+
+        // map the pixels of the camera's viewport onto a width x height
+        // panorama, blocks of the view are spread over the threads. fn(x,y,n,fx,fy)
+        // gets the fixed point positions of the n pixels from (x,y) on in
+        // every row of a block.
+        template <class FN>
+        void mapView(const Camera<double> &camera, const int width, const int height,
+                     FN fn, const unsigned int threads)
+        {
+            const Camera<double>::ViewPort vp = camera.getViewPort();
+            const Camera<double>::ViewFrustum vf = camera.getViewFrustum();
+            const int w = (int)vp.width(), h = (int)vp.height();
+            const Vec3d O = camera.getPosition(), X = camera.getX(), Y = camera.getY(),
+                        Z = camera.getZ();
+            // world positions of the pixel centers on the near plane
+            const double px = (vf.max[0] - vf.min[0]) / w, py = (vf.max[1] - vf.min[1]) / h;
+            const Vec3d corner = O + X * (vf.min[0] + 0.5 * px) + Y * (vf.max[1] - 0.5 * py) -
+                                 Z * vf.min[2];
+            const Vec3d right = X * px, down = Y * -py;
+
+            const int bx = (w + BLOCK - 1) / BLOCK;
+            const int by = (h + BLOCK - 1) / BLOCK;
+            PARALLEL::forEach(bx * by, [&](int b)
+            {
+                float sx[BLOCK], sy[BLOCK];
+                int fx[BLOCK], fy[BLOCK];
+                const int x0 = (b % bx) * BLOCK, y0 = (b / bx) * BLOCK;
+                const int n = std::min(BLOCK, w - x0);
+                const int y1 = std::min(y0 + BLOCK, h);
+                for (int y = y0; y < y1; ++y)
+                {
+                    const Vec3d o = corner + right * x0 + down * y;
+                    const double origin[3] = {o[0], o[1], o[2]};
+                    const double step[3] = {right[0], right[1], right[2]};
+                    mapRays(origin, step, n, width, height, sx, sy);
+                    toFixed(sx, n, fx);
+                    toFixed(sy, n, fy);
+                    fn(x0, y, n, fx, fy);
+                }
+            }, threads);
+        }
+
+        // panorama positions of every pixel of a view at yaw 0. Turning the
+        // view around the vertical axis only shifts them horizontally, by
+        // yaw / 360 of the panorama width.
+        struct Remap
+        {
+            double pitch, roll, fov;
+            int width, height;         // view
+            int panoWidth, panoHeight; // fx,fy are pixels of this size
+            std::vector<int> fx, fy;   // row by row, 8 fraction bits
+
+            inline bool matches(const double p, const double r, const double f,
+                                const int w, const int h, const int pw, const int ph) const
+            {
+                return pitch == p && roll == r && fov == f && width == w && height == h &&
+                       panoWidth == pw && panoHeight == ph;
+            }
+        };
+    }
+
+    // camera of a view given by angles in degrees relative to the start view
+    // of the viewer (looking along +y with z up): yaw to the right, pitch up
+    // and roll counter clockwise. fov spans the shorter side of the view.
+    inline Camera<double> viewCamera(const double yaw, const double pitch, const double roll,
+                                     const double fov, const int width, const int height)
+    {
+        const double rad = 3.141592653589793 / 180.0;
+        Camera<double> camera;
+        camera.setupPinholeCamera(Camera<double>::ViewPort(0, 0, width, height), 0.1, 1.0, fov);
+        camera.setOrientation(Vec3d(1, 0, 0), Vec3d(0, 0, 1), Vec3d(0, -1, 0));
+        camera.rotateAxis(Vec3d(0, 0, 1), -yaw * rad);
+        camera.pitch(pitch * rad);
+        camera.roll(roll * rad);
+        return camera;
+    }
+
+    // render the view of the camera into view, at the size of its viewport
+    // with the top row first. pano is the whole equirectangular image.
+    // Blocks of the view are spread over the given number of threads, 0 for
+    // all cores.
+    inline void renderRectilinear(const Image &pano, const Camera<double> &camera,
+                                  Image &view, const unsigned int threads = 0)
+    {
+        const Camera<double>::ViewPort vp = camera.getViewPort();
+        view.resize((int)vp.width(), (int)vp.height(), pano.chan());
+        if (view.width() <= 0 || view.height() <= 0 || !pano.isValid())
+        {
+            return;
+        }
+        RECT::mapView(camera, pano.width(), pano.height(),
+                      [&](int x, int y, int n, const int *fx, const int *fy)
+        {
+            RECT::sampleFixed(pano, fx, fy, n, &view(x, y));
+        }, threads);
+    }
+
+    // the most recently used remap tables of views, for rendering many views
+    // that differ only in yaw without evaluating atan per pixel. Tables are
+    // computed outside the lock, threads may share one cache.
+    class RemapCache
+    {
+        std::mutex m_mutex;
+        std::list<std::shared_ptr<const RECT::Remap> > m_tables; // most recent first
+        size_t m_capacity;
+
+    public:
+        explicit RemapCache(const size_t capacity = 4) : m_capacity(std::max<size_t>(1, capacity)) {}
+
+        std::shared_ptr<const RECT::Remap> get(const double pitch, const double roll,
+                                               const double fov, const int width,
+                                               const int height, const int panoWidth,
+                                               const int panoHeight,
+                                               const unsigned int threads = 0)
+        {
+            std::shared_ptr<const RECT::Remap> table = find(pitch, roll, fov, width, height,
+                                                            panoWidth, panoHeight);
+            if (table)
+            {
+                return table;
+            }
+            std::shared_ptr<RECT::Remap> r = std::make_shared<RECT::Remap>();
+            r->pitch = pitch;
+            r->roll = roll;
+            r->fov = fov;
+            r->width = width;
+            r->height = height;
+            r->panoWidth = panoWidth;
+            r->panoHeight = panoHeight;
+            r->fx.resize((size_t)width * height);
+            r->fy.resize((size_t)width * height);
+            RECT::mapView(viewCamera(0.0, pitch, roll, fov, width, height), panoWidth, panoHeight,
+                          [&](int x, int y, int n, const int *fx, const int *fy)
+            {
+                std::copy(fx, fx + n, &r->fx[(size_t)y * width + x]);
+                std::copy(fy, fy + n, &r->fy[(size_t)y * width + x]);
+            }, threads);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto it = m_tables.begin(); it != m_tables.end(); ++it)
+            {
+                // computed by another thread in the meantime
+                if ((*it)->matches(pitch, roll, fov, width, height, panoWidth, panoHeight))
+                {
+                    return *it;
+                }
+            }
+            m_tables.push_front(r);
+            if (m_tables.size() > m_capacity)
+            {
+                m_tables.pop_back();
+            }
+            return r;
+        }
+
+        std::shared_ptr<const RECT::Remap> find(const double pitch, const double roll,
+                                                const double fov, const int width,
+                                                const int height, const int panoWidth,
+                                                const int panoHeight)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto it = m_tables.begin(); it != m_tables.end(); ++it)
+            {
+                if ((*it)->matches(pitch, roll, fov, width, height, panoWidth, panoHeight))
+                {
+                    m_tables.splice(m_tables.begin(), m_tables, it);
+                    return m_tables.front();
+                }
+            }
+            return std::shared_ptr<const RECT::Remap>();
+        }
+
+        inline size_t size()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_tables.size();
+        }
+    };
+
+    // render the view of a remap table turned by yaw degrees to the right,
+    // the same as renderRectilinear with the camera of viewCamera
+    inline void renderRemapped(const Image &pano, const RECT::Remap &table, const double yaw,
+                               Image &view, const unsigned int threads = 0)
+    {
+        view.resize(table.width, table.height, pano.chan());
+        if (table.width <= 0 || table.height <= 0 || !pano.isValid())
+        {
+            return;
+        }
+        // whole turns do not change the view
+        const double turns = yaw / 360.0 - std::floor(yaw / 360.0);
+        const int dx = std::min((int)(turns * table.panoWidth * 256.0 + 0.5),
+                                table.panoWidth * 256 - 1);
+        PARALLEL::forEach(table.height, [&](int y)
+        {
+            const size_t row = (size_t)y * table.width;
+            RECT::sampleFixed(pano, &table.fx[row], &table.fy[row], table.width, &view(0, y), dx);
+        }, threads);
+    }
+
+    // render a view given by angles with a table of the cache
+    inline void renderRectilinear(const Image &pano, RemapCache &cache, const double yaw,
+                                  const double pitch, const double roll, const double fov,
+                                  const int width, const int height, Image &view,
+                                  const unsigned int threads = 0)
+    {
+        std::shared_ptr<const RECT::Remap> table =
+            cache.get(pitch, roll, fov, width, height, pano.width(), pano.height(), threads);
+        renderRemapped(pano, *table, yaw, view, threads);
+    }
+}
+
+#endif